@@ -0,0 +1,57 @@
+/**
+ * coordination backends for the lock recipe
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "backend.h"
+#include "stats.h"
+#include "children.h"
+
+static void real_sleep(const struct timespec *ts) {
+    nanosleep(ts, 0);
+}
+
+void (*backend_sleep)(const struct timespec *ts) = real_sleep;
+int64_t (*backend_clock)(void) = zl_stats_now;
+
+int backend_aget_children(struct backend *b, const char *path, backend_children_fn fn, void *ctx) {
+    struct String_vector children = { 0, NULL };
+    struct Stat stat;
+    int ret;
+
+    if (b->ops->aget_children) return b->ops->aget_children(b, path, fn, ctx);
+    memset(&stat, 0, sizeof(stat));
+    ret = b->ops->get_children(b, path, &children);
+    // the stat is taken after the listing, a change in between
+    // only makes the dir look younger than it is
+    if (ret == ZOK) ret = b->ops->exists(b, path, &stat);
+    fn(b, ret, path, &children, &stat, ctx);
+    free_String_vector(&children);
+    return ZOK;
+}
+
+int backend_aget(struct backend *b, const char *path, backend_data_fn fn, void *ctx) {
+    struct Stat stat;
+    int ret;
+
+    if (b->ops->aget) return b->ops->aget(b, path, fn, ctx);
+    memset(&stat, 0, sizeof(stat));
+    ret = b->ops->exists(b, path, &stat);
+    fn(b, ret, path, NULL, -1, &stat, ctx);
+    return ZOK;
+}
+
+struct backend* backend_open(const char *engine, const char *hosts, int timeout) {
+    if (engine == NULL || strcmp(engine, "zk") == 0)
+        return backend_zk_open(hosts, timeout);
+    if (strcmp(engine, "mem") == 0)
+        return backend_mem_open();
+    if (strcmp(engine, "flock") == 0)
+        return backend_flock_open(hosts);
+    errno = EINVAL;
+    return NULL;
+}
@@ -0,0 +1,113 @@
+/**
+ * coordination backends for the lock recipe
+ *
+ * the recipe only needs a handful of operations, so they sit behind
+ * a small vtable. results use the ZooKeeper error codes, String_vector
+ * and zoo_op_t, whatever engine is underneath
+ */
+
+#ifndef ZOO_LOCKED_BACKEND_H
+#define ZOO_LOCKED_BACKEND_H
+
+#include <stdint.h>
+#include <time.h>
+#include <zookeeper.h>
+
+struct backend;
+
+/** called once when a watched node is deleted or its session is gone */
+typedef void (*backend_watch_fn)(struct backend *b, const char *path, void *ctx);
+
+/**
+ * completions of the pipelined calls, path is the one asked for.
+ * the results only live for the call
+ */
+typedef void (*backend_children_fn)(struct backend *b, int rc, const char *path,
+                                    const struct String_vector *children, const struct Stat *stat, void *ctx);
+typedef void (*backend_data_fn)(struct backend *b, int rc, const char *path,
+                                const char *value, int valuelen, const struct Stat *stat, void *ctx);
+
+struct backend_ops {
+    const char *name;
+    int (*exists)(struct backend *b, const char *path, struct Stat *stat);
+    /** flags are ZOO_EPHEMERAL and ZOO_SEQUENCE */
+    int (*create)(struct backend *b, const char *path, const char *value, int valuelen,
+                  int flags, char *path_buffer, int path_buffer_len);
+    /** children are malloc'ed like zoo_get_children does */
+    int (*get_children)(struct backend *b, const char *path, struct String_vector *strings);
+    int (*remove)(struct backend *b, const char *path, int version);
+    /**
+     * sets a one shot watch on path. returns ZNONODE without
+     * setting it if path is already gone
+     */
+    int (*watch)(struct backend *b, const char *path, backend_watch_fn fn, void *ctx);
+    int (*multi)(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results);
+    /** session id, used to name our lock nodes */
+    int64_t (*session)(struct backend *b);
+    /** ends the session, which removes its ephemeral nodes */
+    void (*close)(struct backend *b);
+    /**
+     * optional, NULL where the engine only has synchronous calls.
+     * lists path and its stat without waiting for the reply, fn runs
+     * later on another thread. returns an error code if the call
+     * could not be sent, fn is not run then
+     */
+    int (*aget_children)(struct backend *b, const char *path, backend_children_fn fn, void *ctx);
+    /** optional too, the same for the data and stat of a node */
+    int (*aget)(struct backend *b, const char *path, backend_data_fn fn, void *ctx);
+    /**
+     * optional, sets a one shot watch on the children of path and puts
+     * how many there are now in *count. fn runs with path once one is
+     * added or removed, or with an empty path once the session is gone
+     */
+    int (*watch_children)(struct backend *b, const char *path, int *count, backend_watch_fn fn, void *ctx);
+};
+
+struct backend {
+    const struct backend_ops *ops;
+    int64_t connected_ns;   // CLOCK_MONOTONIC time the session came up, 0 until then
+};
+
+/**
+ * how the recipe and the backends wait and tell the time, nanosleep
+ * and CLOCK_MONOTONIC ns unless the simulator swaps in virtual time
+ */
+extern void (*backend_sleep)(const struct timespec *ts);
+extern int64_t (*backend_clock)(void);
+
+/**
+ * the pipelined calls, or the synchronous ones with fn run before
+ * they return where the engine has none. without a get data call
+ * those engines hand over the stat of a node but no data
+ */
+int backend_aget_children(struct backend *b, const char *path, backend_children_fn fn, void *ctx);
+int backend_aget(struct backend *b, const char *path, backend_data_fn fn, void *ctx);
+
+/**
+ * opens a session on the named engine:
+ *   zk     hosts is the ZooKeeper connect string
+ *   mem    in-process tree shared by all sessions of this process
+ *   flock  hosts is a directory, nodes are files held with flock
+ * returns NULL and sets errno on failure
+ */
+struct backend* backend_open(const char *engine, const char *hosts, int timeout);
+
+struct backend* backend_zk_open(const char *hosts, int timeout);
+struct backend* backend_mem_open(void);
+struct backend* backend_flock_open(const char *dir);
+
+/**
+ * wraps inner so that its calls get delayed or fail according to
+ * spec, see backend_fault.c. returns NULL with errno set to EINVAL
+ * if spec does not parse, inner is left open then
+ */
+struct backend* backend_fault_open(struct backend *inner, const char *spec);
+
+/**
+ * wraps inner so that every call is appended to the trace file,
+ * see record.h. returns NULL with errno set if file can not be
+ * opened, inner is left open then
+ */
+struct backend* backend_record_open(struct backend *inner, const char *file);
+
+#endif
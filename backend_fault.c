@@ -0,0 +1,339 @@
+/**
+ * fault injecting backend
+ *
+ * wraps another backend and makes its calls slow or fail the way a
+ * ZooKeeper ensemble does during rollouts and leader elections. the
+ * profile is a comma separated list, optionally starting with one of
+ * the named profiles below:
+ *
+ *   latency=MS | exp:MEAN | uniform:MIN:MAX | lognormal:MEDIAN:SIGMA
+ *           | pareto:MIN:ALPHA     delay before every call, in ms
+ *   loss=P        the request is lost: ZCONNECTIONLOSS, nothing happened
+ *   lostreply=P   the reply is lost: ZCONNECTIONLOSS, but the call went through
+ *   expire=P      the session expires: its ephemerals are gone and every
+ *                 later call returns ZSESSIONEXPIRED
+ *   election=P:MS an election starts: every call fails with
+ *                 ZCONNECTIONLOSS for the next MS ms
+ *   ops=NAME:NAME only these calls (exists, create, get_children,
+ *                 delete, watch, multi) are affected
+ *   seed=N        seed for the random choices
+ *
+ * probabilities are per call
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <zookeeper.h>
+
+#include "backend.h"
+#include "stats.h"
+#include "children.h"
+
+enum fault_op { OP_EXISTS, OP_CREATE, OP_GET_CHILDREN, OP_DELETE, OP_WATCH, OP_MULTI, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {
+    "exists", "create", "get_children", "delete", "watch", "multi"
+};
+
+enum latency_dist { LAT_NONE, LAT_FIXED, LAT_EXP, LAT_UNIFORM, LAT_LOGNORMAL, LAT_PARETO };
+
+struct fault_profile {
+    enum latency_dist dist;
+    double a, b;            // parameters of dist, in ms
+    double loss;
+    double lostreply;
+    double expire;
+    double election;
+    double election_ms;
+    int ops;                // bit mask of affected calls
+    uint64_t seed;
+};
+
+static const struct {
+    const char *name;
+    const char *spec;
+} named_profiles[] = {
+    { "none", "" },
+    { "slow", "latency=lognormal:20:1" },
+    { "lossy", "latency=exp:2,loss=0.05,lostreply=0.02" },
+    { "election", "latency=exp:1,election=0.02:2000" },
+    { "expiry", "latency=exp:1,expire=0.01" },
+};
+
+struct fault_backend {
+    struct backend base;
+    struct backend *inner;      // NULL once the session expired
+    struct fault_profile p;
+    uint64_t rng;
+    int64_t session;
+    int64_t outage_until;       // backend_clock() ns
+};
+
+struct fault_watch {
+    struct backend *outer;
+    backend_watch_fn fn;
+    void *ctx;
+};
+
+static double uniform(struct fault_backend *f) {
+    // xorshift64*
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return ((f->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int chance(struct fault_backend *f, double p) {
+    return p > 0 && uniform(f) < p;
+}
+
+static double sample_ms(struct fault_backend *f) {
+    double u;
+    switch (f->p.dist) {
+    case LAT_FIXED:
+        return f->p.a;
+    case LAT_EXP:
+        return -f->p.a * log(1 - uniform(f));
+    case LAT_UNIFORM:
+        return f->p.a + (f->p.b - f->p.a) * uniform(f);
+    case LAT_LOGNORMAL:
+        // Box-Muller, a is the median
+        u = sqrt(-2 * log(1 - uniform(f))) * cos(2 * M_PI * uniform(f));
+        return f->p.a * exp(f->p.b * u);
+    case LAT_PARETO:
+        return f->p.a / pow(1 - uniform(f), 1 / f->p.b);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * decides what happens to a call before it is made. returns ZOK
+ * to go ahead, or the error the caller should see instead
+ */
+static int before(struct fault_backend *f, enum fault_op op) {
+    double ms;
+    if (!f->inner) return ZSESSIONEXPIRED;
+    if (!(f->p.ops & (1 << op))) return ZOK;
+    ms = sample_ms(f);
+    if (ms > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(ms / 1000);
+        ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000);
+        backend_sleep(&ts);
+    }
+    if (chance(f, f->p.election)) {
+        f->outage_until = backend_clock() + (int64_t)(f->p.election_ms * 1000000);
+    }
+    if (backend_clock() < f->outage_until) return ZCONNECTIONLOSS;
+    if (chance(f, f->p.expire)) {
+        // the server drops the session and with it our ephemerals
+        f->inner->ops->close(f->inner);
+        f->inner = NULL;
+        return ZSESSIONEXPIRED;
+    }
+    if (chance(f, f->p.loss)) return ZCONNECTIONLOSS;
+    return ZOK;
+}
+
+/** the call was made, maybe its reply gets lost on the way back */
+static int after(struct fault_backend *f, enum fault_op op, int ret) {
+    if (f->inner && !f->base.connected_ns) f->base.connected_ns = f->inner->connected_ns;
+    if (!(f->p.ops & (1 << op))) return ret;
+    if (chance(f, f->p.lostreply)) return ZCONNECTIONLOSS;
+    return ret;
+}
+
+static int fault_exists(struct backend *b, const char *path, struct Stat *stat) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    int ret = before(f, OP_EXISTS);
+    if (ret != ZOK) return ret;
+    return after(f, OP_EXISTS, f->inner->ops->exists(f->inner, path, stat));
+}
+
+static int fault_create(struct backend *b, const char *path, const char *value, int valuelen,
+                        int flags, char *path_buffer, int path_buffer_len) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    int ret = before(f, OP_CREATE);
+    if (ret != ZOK) return ret;
+    return after(f, OP_CREATE, f->inner->ops->create(f->inner, path, value, valuelen,
+                                                     flags, path_buffer, path_buffer_len));
+}
+
+static int fault_get_children(struct backend *b, const char *path, struct String_vector *strings) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    int ret = before(f, OP_GET_CHILDREN);
+    if (ret != ZOK) return ret;
+    ret = f->inner->ops->get_children(f->inner, path, strings);
+    if (after(f, OP_GET_CHILDREN, ret) != ret) {
+        // the caller never sees a listing it did not get
+        free_String_vector(strings);
+        strings->count = 0;
+        return ZCONNECTIONLOSS;
+    }
+    return ret;
+}
+
+static int fault_delete(struct backend *b, const char *path, int version) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    int ret = before(f, OP_DELETE);
+    if (ret != ZOK) return ret;
+    return after(f, OP_DELETE, f->inner->ops->remove(f->inner, path, version));
+}
+
+static void fault_watcher(struct backend *inner, const char *path, void *ctx) {
+    struct fault_watch *w = (struct fault_watch*)ctx;
+    w->fn(w->outer, path, w->ctx);
+    free(w);
+}
+
+static int fault_watch(struct backend *b, const char *path, backend_watch_fn fn, void *ctx) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    struct fault_watch *w;
+    int ret = before(f, OP_WATCH);
+    if (ret != ZOK) return ret;
+    w = malloc(sizeof(*w));
+    if (!w) return ZSYSTEMERROR;
+    w->outer = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    ret = f->inner->ops->watch(f->inner, path, fault_watcher, w);
+    if (ret != ZOK) free(w);
+    // a lost reply still leaves the watch set, like on a real server
+    return after(f, OP_WATCH, ret);
+}
+
+static int fault_watch_children(struct backend *b, const char *path, int *count, backend_watch_fn fn, void *ctx) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    struct fault_watch *w;
+    int ret = before(f, OP_WATCH);
+    if (ret != ZOK) return ret;
+    if (!f->inner->ops->watch_children) return ZUNIMPLEMENTED;
+    w = malloc(sizeof(*w));
+    if (!w) return ZSYSTEMERROR;
+    w->outer = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    ret = f->inner->ops->watch_children(f->inner, path, count, fault_watcher, w);
+    if (ret != ZOK) free(w);
+    return after(f, OP_WATCH, ret);
+}
+
+static int fault_multi(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    int ret = before(f, OP_MULTI);
+    if (ret != ZOK) return ret;
+    return after(f, OP_MULTI, f->inner->ops->multi(f->inner, count, ops, results));
+}
+
+static int64_t fault_session(struct backend *b) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    if (f->inner) f->session = f->inner->ops->session(f->inner);
+    return f->session;
+}
+
+static void fault_close(struct backend *b) {
+    struct fault_backend *f = (struct fault_backend*)b;
+    if (f->inner) f->inner->ops->close(f->inner);
+    free(f);
+}
+
+static const struct backend_ops fault_ops = {
+    "fault",
+    fault_exists,
+    fault_create,
+    fault_get_children,
+    fault_delete,
+    fault_watch,
+    fault_multi,
+    fault_session,
+    fault_close,
+    NULL,
+    NULL,
+    fault_watch_children
+};
+
+static int parse_latency(struct fault_profile *p, const char *v) {
+    if (strncmp(v, "exp:", 4) == 0) {
+        p->dist = LAT_EXP;
+        return sscanf(v + 4, "%lf", &p->a) == 1 ? 0 : EINVAL;
+    }
+    if (strncmp(v, "uniform:", 8) == 0) {
+        p->dist = LAT_UNIFORM;
+        return sscanf(v + 8, "%lf:%lf", &p->a, &p->b) == 2 ? 0 : EINVAL;
+    }
+    if (strncmp(v, "lognormal:", 10) == 0) {
+        p->dist = LAT_LOGNORMAL;
+        return sscanf(v + 10, "%lf:%lf", &p->a, &p->b) == 2 ? 0 : EINVAL;
+    }
+    if (strncmp(v, "pareto:", 7) == 0) {
+        p->dist = LAT_PARETO;
+        return sscanf(v + 7, "%lf:%lf", &p->a, &p->b) == 2 && p->b > 0 ? 0 : EINVAL;
+    }
+    p->dist = LAT_FIXED;
+    return sscanf(v, "%lf", &p->a) == 1 ? 0 : EINVAL;
+}
+
+static int parse_profile(struct fault_profile *p, const char *spec) {
+    char *copy = strdup(spec);
+    char *item, *save = NULL;
+    int ret = 0;
+    size_t i;
+
+    if (!copy) return ENOMEM;
+    for (item = strtok_r(copy, ",", &save); item && ret == 0; item = strtok_r(NULL, ",", &save)) {
+        char *v = strchr(item, '=');
+        if (!v) {
+            for (i = 0; i < sizeof(named_profiles) / sizeof(named_profiles[0]); i++) {
+                if (strcmp(item, named_profiles[i].name) == 0) break;
+            }
+            ret = i < sizeof(named_profiles) / sizeof(named_profiles[0]) ?
+                  parse_profile(p, named_profiles[i].spec) : EINVAL;
+            continue;
+        }
+        *v++ = 0;
+        if (strcmp(item, "latency") == 0) ret = parse_latency(p, v);
+        else if (strcmp(item, "loss") == 0) p->loss = atof(v);
+        else if (strcmp(item, "lostreply") == 0) p->lostreply = atof(v);
+        else if (strcmp(item, "expire") == 0) p->expire = atof(v);
+        else if (strcmp(item, "election") == 0) {
+            if (sscanf(v, "%lf:%lf", &p->election, &p->election_ms) != 2) ret = EINVAL;
+        } else if (strcmp(item, "seed") == 0) p->seed = strtoull(v, NULL, 10);
+        else if (strcmp(item, "ops") == 0) {
+            char *name, *osave = NULL;
+            p->ops = 0;
+            for (name = strtok_r(v, ":", &osave); name; name = strtok_r(NULL, ":", &osave)) {
+                for (i = 0; i < OP_COUNT && strcmp(name, op_names[i]) != 0; i++);
+                if (i == OP_COUNT) ret = EINVAL;
+                else p->ops |= 1 << i;
+            }
+        } else ret = EINVAL;
+    }
+    free(copy);
+    return ret;
+}
+
+struct backend* backend_fault_open(struct backend *inner, const char *spec) {
+    struct fault_backend *f = calloc(1, sizeof(*f));
+    int ret;
+
+    if (!f) return NULL;
+    f->base.ops = &fault_ops;
+    f->inner = inner;
+    f->p.ops = (1 << OP_COUNT) - 1;
+    ret = parse_profile(&f->p, spec);
+    if (ret != 0) {
+        free(f);
+        errno = ret;
+        return NULL;
+    }
+    f->rng = f->p.seed ? f->p.seed : (uint64_t)zl_stats_now() ^ ((uint64_t)getpid() << 32);
+    if (!f->rng) f->rng = 1;
+    f->base.connected_ns = inner->connected_ns;
+    return &f->base;
+}
@@ -0,0 +1,467 @@
+/**
+ * in-memory backend
+ *
+ * one tree per process, shared by every session opened on it, with
+ * the same naming, sequence and ephemeral rules as ZooKeeper. it lets
+ * the recipe run at full speed in tests and benchmarks, and gives a
+ * single process microsecond locking with the same code
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <zookeeper.h>
+
+#include "backend.h"
+#include "stats.h"
+
+struct mem_watch {
+    char *path;
+    struct backend *b;
+    backend_watch_fn fn;
+    void *ctx;
+    struct mem_watch *next;
+};
+
+struct mem_node {
+    char *name;
+    struct mem_node *parent;
+    struct mem_node **children;
+    int32_t nchildren;
+    int32_t capacity;
+    struct Stat stat;
+    char *data;
+    struct mem_watch *watches;
+    struct mem_watch *child_watches;
+};
+
+struct mem_backend {
+    struct backend base;
+    int64_t session;
+};
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_node mem_root;
+static int64_t mem_zxid;
+static int64_t mem_sessions;
+// child watches of folders that changed, fired once mem_lock is let go
+static struct mem_watch *mem_changed;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct mem_node* child_named(struct mem_node *n, const char *name, int len) {
+    int32_t i;
+    for (i = 0; i < n->nchildren; i++) {
+        if (strncmp(n->children[i]->name, name, len) == 0 && n->children[i]->name[len] == 0)
+            return n->children[i];
+    }
+    return NULL;
+}
+
+/**
+ * walks path. with parent_only it stops at the parent and
+ * returns the last component in *last
+ */
+static struct mem_node* lookup(const char *path, int parent_only, const char **last) {
+    struct mem_node *n = &mem_root;
+
+    if (path[0] != '/') return NULL;
+    path++;
+    while (*path) {
+        const char *end = strchr(path, '/');
+        int len = end ? end - path : (int)strlen(path);
+        if (parent_only && !end) {
+            *last = path;
+            return n;
+        }
+        n = child_named(n, path, len);
+        if (!n) return NULL;
+        path += len + (end ? 1 : 0);
+    }
+    return parent_only ? NULL : n;
+}
+
+static void fill_stat(struct Stat *stat, const struct mem_node *n) {
+    if (!stat) return;
+    *stat = n->stat;
+    stat->numChildren = n->nchildren;
+}
+
+static void children_changed(struct mem_node *p) {
+    struct mem_watch *w = p->child_watches;
+    while (w) {
+        struct mem_watch *next = w->next;
+        w->next = mem_changed;
+        mem_changed = w;
+        w = next;
+    }
+    p->child_watches = NULL;
+}
+
+/** adds the child watches that are due to fire, called with mem_lock held */
+static struct mem_watch* changed(struct mem_watch *fire) {
+    while (mem_changed) {
+        struct mem_watch *w = mem_changed;
+        mem_changed = w->next;
+        w->next = fire;
+        fire = w;
+    }
+    return fire;
+}
+
+static int detach(struct mem_node *n) {
+    struct mem_node *p = n->parent;
+    int32_t i;
+    for (i = 0; i < p->nchildren; i++) {
+        if (p->children[i] == n) {
+            memmove(&p->children[i], &p->children[i+1], (p->nchildren - i - 1) * sizeof(struct mem_node*));
+            p->nchildren--;
+            p->stat.cversion++;
+            p->stat.pzxid = ++mem_zxid;
+            children_changed(p);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int attach(struct mem_node *p, struct mem_node *n) {
+    if (p->nchildren == p->capacity) {
+        int32_t cap = p->capacity ? p->capacity * 2 : 8;
+        struct mem_node **c = realloc(p->children, cap * sizeof(struct mem_node*));
+        if (!c) return ZSYSTEMERROR;
+        p->children = c;
+        p->capacity = cap;
+    }
+    p->children[p->nchildren++] = n;
+    n->parent = p;
+    p->stat.cversion++;
+    p->stat.pzxid = ++mem_zxid;
+    children_changed(p);
+    return ZOK;
+}
+
+/** frees a detached node, handing its watches to fire */
+static void free_node(struct mem_node *n, struct mem_watch **fire) {
+    struct mem_watch *w = n->watches;
+    while (w) {
+        struct mem_watch *next = w->next;
+        w->next = *fire;
+        *fire = w;
+        w = next;
+    }
+    children_changed(n);
+    free(n->children);
+    free(n->name);
+    free(n->data);
+    free(n);
+}
+
+static void free_watch(struct mem_watch *w) {
+    free(w->path);
+    free(w);
+}
+
+static void fire_watches(struct mem_watch *w) {
+    while (w) {
+        struct mem_watch *next = w->next;
+        w->fn(w->b, w->path, w->ctx);
+        free_watch(w);
+        w = next;
+    }
+}
+
+static int create_locked(struct mem_backend *mb, const char *path, const char *value, int valuelen,
+                         int flags, char *path_buffer, int path_buffer_len, struct mem_node **created) {
+    const char *last = NULL;
+    struct mem_node *p = lookup(path, 1, &last);
+    struct mem_node *n;
+    char seq[16] = "";
+    int ret;
+
+    if (!p || !last) return p ? ZBADARGUMENTS : ZNONODE;
+    if (p->stat.ephemeralOwner) return ZNOCHILDRENFOREPHEMERALS;
+    if (flags & ZOO_SEQUENCE) snprintf(seq, sizeof(seq), "%010d", p->stat.cversion);
+    if (!(flags & ZOO_SEQUENCE) && child_named(p, last, strlen(last))) return ZNODEEXISTS;
+
+    n = calloc(1, sizeof(*n));
+    if (!n) return ZSYSTEMERROR;
+    n->name = malloc(strlen(last) + strlen(seq) + 1);
+    if (!n->name) {
+        free(n);
+        return ZSYSTEMERROR;
+    }
+    sprintf(n->name, "%s%s", last, seq);
+    if (value && valuelen > 0) {
+        n->data = malloc(valuelen);
+        if (n->data) memcpy(n->data, value, valuelen);
+        n->stat.dataLength = valuelen;
+    }
+    n->stat.czxid = n->stat.mzxid = n->stat.pzxid = ++mem_zxid;
+    n->stat.ctime = n->stat.mtime = now_ms();
+    n->stat.ephemeralOwner = (flags & ZOO_EPHEMERAL) ? mb->session : 0;
+    ret = attach(p, n);
+    if (ret != ZOK) {
+        free(n->name);
+        free(n->data);
+        free(n);
+        return ret;
+    }
+    if (path_buffer && path_buffer_len > 0) {
+        snprintf(path_buffer, path_buffer_len, "%.*s%s", (int)(last - path), path, n->name);
+    }
+    if (created) *created = n;
+    return ZOK;
+}
+
+static int delete_locked(const char *path, int version, struct mem_node **deleted) {
+    struct mem_node *n = lookup(path, 0, NULL);
+
+    if (!n) return ZNONODE;
+    if (n == &mem_root) return ZBADARGUMENTS;
+    if (version != -1 && version != n->stat.version) return ZBADVERSION;
+    if (n->nchildren) return ZNOTEMPTY;
+    detach(n);
+    *deleted = n;
+    return ZOK;
+}
+
+static int mem_exists(struct backend *b, const char *path, struct Stat *stat) {
+    struct mem_node *n;
+    pthread_mutex_lock(&mem_lock);
+    n = lookup(path, 0, NULL);
+    if (n) fill_stat(stat, n);
+    pthread_mutex_unlock(&mem_lock);
+    return n ? ZOK : ZNONODE;
+}
+
+static int mem_create(struct backend *b, const char *path, const char *value, int valuelen,
+                      int flags, char *path_buffer, int path_buffer_len) {
+    struct mem_watch *fire;
+    int ret;
+    pthread_mutex_lock(&mem_lock);
+    ret = create_locked((struct mem_backend*)b, path, value, valuelen, flags, path_buffer, path_buffer_len, NULL);
+    fire = changed(NULL);
+    pthread_mutex_unlock(&mem_lock);
+    fire_watches(fire);
+    return ret;
+}
+
+static int mem_get_children(struct backend *b, const char *path, struct String_vector *strings) {
+    struct mem_node *n;
+    int32_t i;
+
+    pthread_mutex_lock(&mem_lock);
+    n = lookup(path, 0, NULL);
+    if (!n) {
+        pthread_mutex_unlock(&mem_lock);
+        return ZNONODE;
+    }
+    strings->count = n->nchildren;
+    strings->data = calloc(n->nchildren ? n->nchildren : 1, sizeof(char*));
+    for (i = 0; strings->data && i < n->nchildren; i++) {
+        strings->data[i] = strdup(n->children[i]->name);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return strings->data ? ZOK : ZSYSTEMERROR;
+}
+
+static int mem_delete(struct backend *b, const char *path, int version) {
+    struct mem_node *n = NULL;
+    struct mem_watch *fire = NULL;
+    int ret;
+
+    pthread_mutex_lock(&mem_lock);
+    ret = delete_locked(path, version, &n);
+    if (ret == ZOK) free_node(n, &fire);
+    fire = changed(fire);
+    pthread_mutex_unlock(&mem_lock);
+    fire_watches(fire);
+    return ret;
+}
+
+static int mem_watch(struct backend *b, const char *path, backend_watch_fn fn, void *ctx) {
+    struct mem_node *n;
+    struct mem_watch *w = calloc(1, sizeof(*w));
+
+    if (!w) return ZSYSTEMERROR;
+    w->path = strdup(path);
+    w->b = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    pthread_mutex_lock(&mem_lock);
+    n = lookup(path, 0, NULL);
+    if (n) {
+        w->next = n->watches;
+        n->watches = w;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    if (!n) free_watch(w);
+    return n ? ZOK : ZNONODE;
+}
+
+static int mem_watch_children(struct backend *b, const char *path, int *count, backend_watch_fn fn, void *ctx) {
+    struct mem_node *n;
+    struct mem_watch *w = calloc(1, sizeof(*w));
+
+    if (!w) return ZSYSTEMERROR;
+    w->path = strdup(path);
+    w->b = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    pthread_mutex_lock(&mem_lock);
+    n = lookup(path, 0, NULL);
+    if (n) {
+        *count = n->nchildren;
+        w->next = n->child_watches;
+        n->child_watches = w;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    if (!n) free_watch(w);
+    return n ? ZOK : ZNONODE;
+}
+
+/**
+ * runs all ops or none. deletes only detach the node, so
+ * a failed op can put everything back the way it was
+ */
+static int mem_multi(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results) {
+    struct mem_node *done[count > 0 ? count : 1];
+    struct mem_watch *fire = NULL;
+    int ret = ZOK;
+    int i;
+
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; i < count; i++) {
+        struct mem_node *n;
+        done[i] = NULL;
+        switch (ops[i].type) {
+        case ZOO_CREATE_OP:
+            ret = create_locked((struct mem_backend*)b, ops[i].create_op.path, ops[i].create_op.data,
+                                ops[i].create_op.datalen, ops[i].create_op.flags,
+                                ops[i].create_op.buf, ops[i].create_op.buflen, &done[i]);
+            if (results) results[i].value = ops[i].create_op.buf;
+            break;
+        case ZOO_DELETE_OP:
+            ret = delete_locked(ops[i].delete_op.path, ops[i].delete_op.version, &done[i]);
+            break;
+        case ZOO_CHECK_OP:
+            n = lookup(ops[i].check_op.path, 0, NULL);
+            ret = !n ? ZNONODE : (ops[i].check_op.version != n->stat.version ? ZBADVERSION : ZOK);
+            break;
+        default:
+            ret = ZUNIMPLEMENTED;
+        }
+        if (results) results[i].err = ret;
+        if (ret != ZOK) break;
+    }
+    if (ret != ZOK) {
+        int failed = i;
+        // undo in reverse order
+        for (i = failed - 1; i >= 0; i--) {
+            if (!done[i]) continue;
+            if (ops[i].type == ZOO_CREATE_OP) {
+                detach(done[i]);
+                free_node(done[i], &fire);
+            } else {
+                attach(done[i]->parent, done[i]);
+            }
+            if (results) results[i].err = ZRUNTIMEINCONSISTENCY;
+        }
+        for (i = failed + 1; results && i < count; i++) {
+            results[i].err = ZRUNTIMEINCONSISTENCY;
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            if (done[i] && ops[i].type == ZOO_DELETE_OP) free_node(done[i], &fire);
+        }
+    }
+    fire = changed(fire);
+    pthread_mutex_unlock(&mem_lock);
+    fire_watches(fire);
+    return ret;
+}
+
+static int64_t mem_session(struct backend *b) {
+    return ((struct mem_backend*)b)->session;
+}
+
+/** removes every ephemeral of session below n */
+static void reap(struct mem_node *n, int64_t session, struct mem_watch **fire) {
+    int32_t i = 0;
+    while (i < n->nchildren) {
+        struct mem_node *c = n->children[i];
+        reap(c, session, fire);
+        if (c->stat.ephemeralOwner == session && c->nchildren == 0) {
+            detach(c);
+            free_node(c, fire);
+        } else {
+            i++;
+        }
+    }
+}
+
+/** drops watches the closing session set, they must not fire anymore */
+static void unwatch(struct mem_node *n, struct backend *b) {
+    struct mem_watch **lists[2] = { &n->watches, &n->child_watches };
+    int32_t i;
+    for (i = 0; i < 2; i++) {
+        struct mem_watch **w = lists[i];
+        while (*w) {
+            if ((*w)->b == b) {
+                struct mem_watch *gone = *w;
+                *w = gone->next;
+                free_watch(gone);
+            } else {
+                w = &(*w)->next;
+            }
+        }
+    }
+    for (i = 0; i < n->nchildren; i++) {
+        unwatch(n->children[i], b);
+    }
+}
+
+static void mem_close(struct backend *b) {
+    struct mem_watch *fire = NULL;
+    pthread_mutex_lock(&mem_lock);
+    unwatch(&mem_root, b);
+    reap(&mem_root, ((struct mem_backend*)b)->session, &fire);
+    fire = changed(fire);
+    pthread_mutex_unlock(&mem_lock);
+    fire_watches(fire);
+    free(b);
+}
+
+static const struct backend_ops mem_ops = {
+    "mem",
+    mem_exists,
+    mem_create,
+    mem_get_children,
+    mem_delete,
+    mem_watch,
+    mem_multi,
+    mem_session,
+    mem_close,
+    NULL,
+    NULL,
+    mem_watch_children
+};
+
+struct backend* backend_mem_open(void) {
+    struct mem_backend *mb = calloc(1, sizeof(*mb));
+
+    if (!mb) return NULL;
+    mb->base.ops = &mem_ops;
+    pthread_mutex_lock(&mem_lock);
+    mb->session = ++mem_sessions;
+    pthread_mutex_unlock(&mem_lock);
+    mb->base.connected_ns = zl_stats_now();
+    return &mb->base;
+}
@@ -0,0 +1,316 @@
+/**
+ * recording backend
+ *
+ * wraps another backend and appends every call it passes on to a
+ * trace file, see record.h. entries are collected in memory and
+ * written in one append once a few kB are together and at close,
+ * so recording costs no extra round trip to the disk per call
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zookeeper.h>
+
+#include "backend.h"
+#include "record.h"
+
+#define FLUSH_AT 4096
+#define MAX_RECORDED_PATH 1024
+
+/** a call that is being made */
+struct call {
+    int64_t wall;
+    int64_t start;
+};
+
+struct record_backend {
+    struct backend base;
+    struct backend *inner;
+    int fd;
+    pthread_mutex_t lock;   // watches fire on the client's thread
+    int64_t session;        // the last one inner had
+    struct call *open;      // until the session is up and its entry written
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct record_watch {
+    struct record_backend *r;
+    backend_watch_fn fn;
+    void *ctx;
+};
+
+static int64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void begin(struct call *c) {
+    c->wall = wall_ns();
+    c->start = backend_clock();
+}
+
+static void flush_locked(struct record_backend *r) {
+    size_t off = 0;
+    while (off < r->len) {
+        ssize_t n = write(r->fd, r->buf + off, r->len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    r->len = 0;
+}
+
+/** adds one entry, the caller holds the lock */
+static void append_locked(struct record_backend *r, const struct call *c, int op, int flags,
+                          const char *path, const char *created, int result, uint32_t children, int32_t arg);
+
+/**
+ * a zk session only has its id once it is up, which the first call
+ * waits for. so the open entry goes in right before that call's
+ */
+static void opened_locked(struct record_backend *r) {
+    struct call *c = r->open;
+    if (!c || !r->inner) return;
+    r->open = NULL;
+    // its latency is the time until the session came up
+    if (r->inner->connected_ns) c->start = backend_clock() - (r->inner->connected_ns - c->start);
+    append_locked(r, c, RECORD_OPEN, 0, NULL, NULL, ZOK, 0, 0);
+    free(c);
+}
+
+static void append_locked(struct record_backend *r, const struct call *c, int op, int flags,
+                          const char *path, const char *created, int result, uint32_t children, int32_t arg) {
+    size_t pathlen = path ? strlen(path) : 0;
+    size_t createdlen = created ? strlen(created) : 0;
+    size_t size;
+    struct record_entry *e;
+    int64_t latency;
+
+    opened_locked(r);
+    latency = backend_clock() - c->start;
+    if (pathlen > MAX_RECORDED_PATH) pathlen = MAX_RECORDED_PATH;
+    if (createdlen > MAX_RECORDED_PATH) createdlen = MAX_RECORDED_PATH;
+    size = RECORD_SIZE(pathlen, createdlen);
+    if (r->len + size > r->cap) {
+        size_t cap = r->cap ? r->cap : 2 * FLUSH_AT;
+        char *buf;
+        while (cap < r->len + size) cap *= 2;
+        buf = realloc(r->buf, cap);
+        if (!buf) return;
+        r->buf = buf;
+        r->cap = cap;
+    }
+    e = (struct record_entry*)(r->buf + r->len);
+    memset(e, 0, size);
+    e->magic = RECORD_MAGIC;
+    e->size = size;
+    e->op = op;
+    e->flags = flags;
+    e->pathlen = pathlen;
+    e->createdlen = createdlen;
+    e->result = result;
+    e->latency_us = latency > 0 ? latency / 1000 : 0;
+    e->children = children;
+    e->arg = arg;
+    e->start_ns = c->wall;
+    if (r->inner) r->session = r->inner->ops->session(r->inner);
+    e->session = r->session;
+    memcpy(e + 1, path, pathlen);
+    memcpy((char*)(e + 1) + pathlen, created, createdlen);
+    r->len += size;
+}
+
+static void append(struct record_backend *r, const struct call *c, int op, int flags,
+                   const char *path, const char *created, int result, uint32_t children, int32_t arg) {
+    pthread_mutex_lock(&r->lock);
+    append_locked(r, c, op, flags, path, created, result, children, arg);
+    if (r->len >= FLUSH_AT) flush_locked(r);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int record_exists(struct backend *b, const char *path, struct Stat *stat) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    int ret;
+    begin(&c);
+    ret = r->inner->ops->exists(r->inner, path, stat);
+    append(r, &c, ZOO_EXISTS_OP, 0, path, NULL, ret, 0, 0);
+    return ret;
+}
+
+static int record_create(struct backend *b, const char *path, const char *value, int valuelen,
+                         int flags, char *path_buffer, int path_buffer_len) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    int ret;
+    begin(&c);
+    ret = r->inner->ops->create(r->inner, path, value, valuelen, flags, path_buffer, path_buffer_len);
+    append(r, &c, ZOO_CREATE_OP, flags & (RECORD_EPHEMERAL|RECORD_SEQUENCE), path,
+           ret == ZOK && path_buffer_len > 0 ? path_buffer : NULL, ret, 0, valuelen);
+    return ret;
+}
+
+static int record_get_children(struct backend *b, const char *path, struct String_vector *strings) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    int ret;
+    begin(&c);
+    ret = r->inner->ops->get_children(r->inner, path, strings);
+    append(r, &c, ZOO_GETCHILDREN_OP, 0, path, NULL, ret, ret == ZOK ? strings->count : 0, 0);
+    return ret;
+}
+
+static int record_delete(struct backend *b, const char *path, int version) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    int ret;
+    begin(&c);
+    ret = r->inner->ops->remove(r->inner, path, version);
+    append(r, &c, ZOO_DELETE_OP, 0, path, NULL, ret, 0, version);
+    return ret;
+}
+
+static void record_watcher(struct backend *inner, const char *path, void *ctx) {
+    struct record_watch *w = (struct record_watch*)ctx;
+    struct call c;
+    begin(&c);
+    append(w->r, &c, RECORD_EVENT, 0, path, NULL, ZOK, 0, 0);
+    w->fn(&w->r->base, path, w->ctx);
+    free(w);
+}
+
+static int record_watch(struct backend *b, const char *path, backend_watch_fn fn, void *ctx) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct record_watch *w = malloc(sizeof(*w));
+    struct call c;
+    int ret;
+    if (!w) return ZSYSTEMERROR;
+    w->r = r;
+    w->fn = fn;
+    w->ctx = ctx;
+    begin(&c);
+    ret = r->inner->ops->watch(r->inner, path, record_watcher, w);
+    // the watch may have fired already, its entry then comes first
+    append(r, &c, ZOO_EXISTS_OP, RECORD_WATCH, path, NULL, ret, 0, 0);
+    if (ret != ZOK) free(w);
+    return ret;
+}
+
+static int record_watch_children(struct backend *b, const char *path, int *count, backend_watch_fn fn, void *ctx) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct record_watch *w;
+    struct call c;
+    int ret;
+    if (!r->inner->ops->watch_children) return ZUNIMPLEMENTED;
+    w = malloc(sizeof(*w));
+    if (!w) return ZSYSTEMERROR;
+    w->r = r;
+    w->fn = fn;
+    w->ctx = ctx;
+    begin(&c);
+    ret = r->inner->ops->watch_children(r->inner, path, count, record_watcher, w);
+    append(r, &c, ZOO_GETCHILDREN_OP, RECORD_WATCH, path, NULL, ret, ret == ZOK ? *count : 0, 0);
+    if (ret != ZOK) free(w);
+    return ret;
+}
+
+static int record_multi(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    int ret, i;
+    begin(&c);
+    ret = r->inner->ops->multi(r->inner, count, ops, results);
+    // the ops go in right behind the multi, with its timing
+    pthread_mutex_lock(&r->lock);
+    append_locked(r, &c, ZOO_MULTI_OP, 0, count ? ops[0].create_op.path : NULL, NULL, ret, count, 0);
+    for (i = 0; i < count; i++) {
+        int err = results ? results[i].err : ret;
+        switch (ops[i].type) {
+        case ZOO_CREATE_OP:
+            append_locked(r, &c, ZOO_CREATE_OP,
+                          RECORD_IN_MULTI | (ops[i].create_op.flags & (RECORD_EPHEMERAL|RECORD_SEQUENCE)),
+                          ops[i].create_op.path,
+                          err == ZOK && ops[i].create_op.buflen > 0 ? ops[i].create_op.buf : NULL,
+                          err, 0, ops[i].create_op.datalen);
+            break;
+        case ZOO_DELETE_OP:
+            append_locked(r, &c, ZOO_DELETE_OP, RECORD_IN_MULTI, ops[i].delete_op.path, NULL,
+                          err, 0, ops[i].delete_op.version);
+            break;
+        case ZOO_SETDATA_OP:
+            append_locked(r, &c, ZOO_SETDATA_OP, RECORD_IN_MULTI, ops[i].set_op.path, NULL,
+                          err, 0, ops[i].set_op.version);
+            break;
+        default:
+            append_locked(r, &c, ops[i].type, RECORD_IN_MULTI, ops[i].check_op.path, NULL,
+                          err, 0, ops[i].check_op.version);
+        }
+    }
+    if (r->len >= FLUSH_AT) flush_locked(r);
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+static int64_t record_session(struct backend *b) {
+    struct record_backend *r = (struct record_backend*)b;
+    return r->inner->ops->session(r->inner);
+}
+
+static void record_close(struct backend *b) {
+    struct record_backend *r = (struct record_backend*)b;
+    struct call c;
+    opened_locked(r);
+    r->session = r->inner->ops->session(r->inner);
+    begin(&c);
+    r->inner->ops->close(r->inner);
+    // no more watches can fire, the lock is not needed anymore
+    r->inner = NULL;
+    append_locked(r, &c, RECORD_CLOSE, 0, NULL, NULL, ZOK, 0, 0);
+    flush_locked(r);
+    free(r->open);
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+    free(r->buf);
+    free(r);
+}
+
+static const struct backend_ops record_ops = {
+    "record",
+    record_exists,
+    record_create,
+    record_get_children,
+    record_delete,
+    record_watch,
+    record_multi,
+    record_session,
+    record_close,
+    NULL,
+    NULL,
+    record_watch_children
+};
+
+struct backend* backend_record_open(struct backend *inner, const char *file) {
+    struct record_backend *r = calloc(1, sizeof(*r));
+
+    if (!r) return NULL;
+    r->fd = open(file, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->base.ops = &record_ops;
+    r->base.connected_ns = inner->connected_ns;
+    r->inner = inner;
+    r->open = malloc(sizeof(*r->open));
+    if (r->open) begin(r->open);
+    return &r->base;
+}
@@ -0,0 +1,207 @@
+/**
+ * ZooKeeper backend, a thin layer over the synchronous zoo_* calls
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zookeeper.h>
+
+#include "backend.h"
+#include "stats.h"
+
+struct zk_backend {
+    struct backend base;
+    zhandle_t *zh;
+};
+
+struct zk_watch {
+    struct backend *b;
+    backend_watch_fn fn;
+    void *ctx;
+    int fired;
+};
+
+static void session_watcher(zhandle_t *zzh, int type, int state, const char *path, void* context)
+{
+    struct zk_backend *zb = (struct zk_backend*)context;
+    if (type == ZOO_SESSION_EVENT && state == ZOO_CONNECTED_STATE && !zb->base.connected_ns) {
+        zb->base.connected_ns = zl_stats_now();
+    }
+}
+
+static void node_watcher(zhandle_t *zzh, int type, int state, const char *path, void* context)
+{
+    struct zk_watch *w = (struct zk_watch*)context;
+    // session events are delivered to every watcher without consuming
+    // it, only expiry means the node we wait on is as good as gone
+    if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) return;
+    if (w->fired) return;
+    w->fired = 1;
+    w->fn(w->b, path, w->ctx);
+    if (type != ZOO_SESSION_EVENT) free(w);
+}
+
+static int zk_exists(struct backend *b, const char *path, struct Stat *stat) {
+    return zoo_exists(((struct zk_backend*)b)->zh, path, 0, stat);
+}
+
+static int zk_create(struct backend *b, const char *path, const char *value, int valuelen,
+                     int flags, char *path_buffer, int path_buffer_len) {
+    return zoo_create(((struct zk_backend*)b)->zh, path, value, valuelen,
+                      &ZOO_OPEN_ACL_UNSAFE, flags, path_buffer, path_buffer_len);
+}
+
+static int zk_get_children(struct backend *b, const char *path, struct String_vector *strings) {
+    return zoo_get_children(((struct zk_backend*)b)->zh, path, 0, strings);
+}
+
+static int zk_delete(struct backend *b, const char *path, int version) {
+    return zoo_delete(((struct zk_backend*)b)->zh, path, version);
+}
+
+static int zk_watch(struct backend *b, const char *path, backend_watch_fn fn, void *ctx) {
+    struct zk_watch *w = calloc(1, sizeof(*w));
+    struct Stat stat;
+    char buf[1];
+    int len = sizeof(buf);
+    int ret;
+
+    if (!w) return ZSYSTEMERROR;
+    w->b = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    // not exists, which leaves a creation watch behind on a node that
+    // is gone already. a get of a missing node watches nothing
+    ret = zoo_wget(((struct zk_backend*)b)->zh, path, node_watcher, w, buf, &len, &stat);
+    if (ret != ZOK) free(w);
+    return ret;
+}
+
+static int zk_watch_children(struct backend *b, const char *path, int *count, backend_watch_fn fn, void *ctx) {
+    struct zk_watch *w = calloc(1, sizeof(*w));
+    struct String_vector children = { 0, NULL };
+    int ret;
+
+    if (!w) return ZSYSTEMERROR;
+    w->b = b;
+    w->fn = fn;
+    w->ctx = ctx;
+    // like get, a listing of a missing node leaves no watch
+    ret = zoo_wget_children(((struct zk_backend*)b)->zh, path, node_watcher, w, &children);
+    if (ret == ZOK) {
+        *count = children.count;
+        deallocate_String_vector(&children);
+    } else {
+        free(w);
+    }
+    return ret;
+}
+
+/** what an async call needs to hand its reply over */
+struct zk_call {
+    struct backend *b;
+    backend_children_fn children;
+    backend_data_fn data;
+    void *ctx;
+    char path[];
+};
+
+static struct zk_call* new_call(struct backend *b, const char *path, void *ctx) {
+    struct zk_call *c = calloc(1, sizeof(*c) + strlen(path) + 1);
+    if (!c) return NULL;
+    c->b = b;
+    c->ctx = ctx;
+    strcpy(c->path, path);
+    return c;
+}
+
+static void children_done(int rc, const struct String_vector *strings, const struct Stat *stat, const void *data) {
+    struct zk_call *c = (struct zk_call*)data;
+    struct String_vector none = { 0, NULL };
+    struct Stat zero;
+    if (rc != ZOK) {
+        memset(&zero, 0, sizeof(zero));
+        strings = &none;
+        stat = &zero;
+    }
+    c->children(c->b, rc, c->path, strings, stat, c->ctx);
+    free(c);
+}
+
+static int zk_aget_children(struct backend *b, const char *path, backend_children_fn fn, void *ctx) {
+    struct zk_call *c = new_call(b, path, ctx);
+    int ret;
+    if (!c) return ZSYSTEMERROR;
+    c->children = fn;
+    ret = zoo_aget_children2(((struct zk_backend*)b)->zh, path, 0, children_done, c);
+    if (ret != ZOK) free(c);
+    return ret;
+}
+
+static void data_done(int rc, const char *value, int value_len, const struct Stat *stat, const void *data) {
+    struct zk_call *c = (struct zk_call*)data;
+    struct Stat zero;
+    if (rc != ZOK) {
+        memset(&zero, 0, sizeof(zero));
+        value = NULL;
+        value_len = -1;
+        stat = &zero;
+    }
+    c->data(c->b, rc, c->path, value, value_len, stat, c->ctx);
+    free(c);
+}
+
+static int zk_aget(struct backend *b, const char *path, backend_data_fn fn, void *ctx) {
+    struct zk_call *c = new_call(b, path, ctx);
+    int ret;
+    if (!c) return ZSYSTEMERROR;
+    c->data = fn;
+    ret = zoo_aget(((struct zk_backend*)b)->zh, path, 0, data_done, c);
+    if (ret != ZOK) free(c);
+    return ret;
+}
+
+static int zk_multi(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results) {
+    return zoo_multi(((struct zk_backend*)b)->zh, count, ops, results);
+}
+
+static int64_t zk_session(struct backend *b) {
+    return zoo_client_id(((struct zk_backend*)b)->zh)->client_id;
+}
+
+static void zk_close(struct backend *b) {
+    zookeeper_close(((struct zk_backend*)b)->zh);
+    free(b);
+}
+
+static const struct backend_ops zk_ops = {
+    "zk",
+    zk_exists,
+    zk_create,
+    zk_get_children,
+    zk_delete,
+    zk_watch,
+    zk_multi,
+    zk_session,
+    zk_close,
+    zk_aget_children,
+    zk_aget,
+    zk_watch_children
+};
+
+struct backend* backend_zk_open(const char *hosts, int timeout) {
+    struct zk_backend *zb = calloc(1, sizeof(*zb));
+
+    if (!zb) return NULL;
+    zb->base.ops = &zk_ops;
+    zoo_deterministic_conn_order(1); // enable deterministic order
+    zb->zh = zookeeper_init(hosts, session_watcher, timeout, 0, zb, 0);
+    if (!zb->zh) {
+        int err = errno;
+        free(zb);
+        errno = err;
+        return NULL;
+    }
+    return &zb->base;
+}
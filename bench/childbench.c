@@ -0,0 +1,346 @@
+/**
+ * childbench - cpu cost of the child list helpers
+ *
+ * times sort_children (and with it vstrcmp), child_floor, lookupnode,
+ * getName and free_String_vector over synthetic listings of
+ * x-<session>-<sequence> names, from 10 up to 1M children. for every
+ * case it prints ns per call, allocations per call and, where perf
+ * counters can be opened, cache misses per call
+ *
+ * with --thresholds FILE every case is checked against a ns per call
+ * limit and the run fails if one is slower
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "../children.h"
+
+/* ---------------------------------------------------------------- */
+/* allocation counting                                              */
+
+static int64_t allocations;
+
+#ifdef __GLIBC__
+// glibc lets a program replace malloc, its own strdup included
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+/* ---------------------------------------------------------------- */
+/* cache misses                                                     */
+
+static int perf_fd = -1;
+
+static void perf_open(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void perf_start(void) {
+#ifdef __linux__
+    if (perf_fd < 0) return;
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+static int64_t perf_stop(void) {
+    int64_t count = -1;
+#ifdef __linux__
+    if (perf_fd < 0) return -1;
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+#endif
+    return count;
+}
+
+/* ---------------------------------------------------------------- */
+/* cases                                                            */
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t min_time_ns = 200000000;
+
+struct fixture {
+    int n;
+    char **names;       // shuffled, like a listing comes back
+    char **scratch;     // what a case may reorder
+    char *needle;       // one of the names
+    char missing[40];   // a prefix that is not in the list
+    char path[80];
+};
+
+/** what one call between begin() and end() cost */
+static struct {
+    int counting;       // also count allocations and misses
+    int64_t ns;
+    int64_t allocs;
+    int64_t misses;
+} probe;
+
+static void begin(void) {
+    if (probe.counting) {
+        probe.allocs = allocations;
+        perf_start();
+    }
+    probe.ns = now_ns();
+}
+
+static void end(void) {
+    probe.ns = now_ns() - probe.ns;
+    if (probe.counting) {
+        probe.misses = perf_stop();
+        probe.allocs = allocations - probe.allocs;
+    }
+}
+
+/** one call of the function under test, with its setup around it */
+typedef void (*case_fn)(struct fixture *f);
+
+static void case_sort(struct fixture *f) {
+    struct String_vector v;
+    memcpy(f->scratch, f->names, f->n * sizeof(char*));
+    v.count = f->n;
+    v.data = f->scratch;
+    begin();
+    sort_children(&v);
+    end();
+}
+
+static void case_floor(struct fixture *f) {
+    char *volatile ret;
+    begin();
+    ret = child_floor(f->scratch, f->n, f->needle);
+    end();
+    (void)ret;
+}
+
+static void case_lookup(struct fixture *f) {
+    struct String_vector v;
+    char *ret;
+    v.count = f->n;
+    v.data = f->names;
+    begin();
+    // the first attempt of a run never finds itself, so it scans all
+    ret = lookupnode(&v, f->missing);
+    end();
+    free(ret);
+}
+
+static void case_getname(struct fixture *f) {
+    char *ret;
+    begin();
+    ret = getName(f->path);
+    end();
+    free(ret);
+}
+
+static void case_free(struct fixture *f) {
+    struct String_vector v;
+    int i;
+    v.count = f->n;
+    v.data = malloc(f->n * sizeof(char*));
+    for (i = 0; i < f->n; i++) v.data[i] = strdup(f->names[i]);
+    begin();
+    free_String_vector(&v);
+    end();
+}
+
+static struct {
+    const char *name;
+    case_fn fn;
+} cases[] = {
+    { "sort_children", case_sort },
+    { "child_floor", case_floor },
+    { "lookupnode", case_lookup },
+    { "getName", case_getname },
+    { "free_String_vector", case_free },
+};
+
+#define NCASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static void make_fixture(struct fixture *f, int n) {
+    int i;
+    f->n = n;
+    f->names = malloc(n * sizeof(char*));
+    f->scratch = malloc(n * sizeof(char*));
+    for (i = 0; i < n; i++) {
+        char name[40];
+        unsigned long long session = ((unsigned long long)rand() << 32 | rand()) & 0x7fffffffffffffffULL;
+        snprintf(name, sizeof(name), "x-%016llx-%010d", session, i);
+        f->names[i] = strdup(name);
+    }
+    for (i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        char *t = f->names[i];
+        f->names[i] = f->names[j];
+        f->names[j] = t;
+    }
+    memcpy(f->scratch, f->names, n * sizeof(char*));
+    {
+        struct String_vector v = { n, f->scratch };
+        sort_children(&v);
+    }
+    f->needle = f->scratch[n / 2];
+    snprintf(f->missing, sizeof(f->missing), "x-%016llx-", 0xffffffffffffffffULL);
+    snprintf(f->path, sizeof(f->path), "/zoo-locked/%s", f->needle);
+}
+
+static void free_fixture(struct fixture *f) {
+    struct String_vector v = { f->n, f->names };
+    free_String_vector(&v);
+    free(f->scratch);
+}
+
+/* ---------------------------------------------------------------- */
+/* thresholds                                                       */
+
+struct threshold {
+    char name[64];
+    int n;
+    double max_ns;
+};
+
+static struct threshold *limits;
+static int nlimits;
+
+static int read_thresholds(const char *file) {
+    FILE *f = fopen(file, "r");
+    char line[256];
+    if (!f) return errno;
+    while (fgets(line, sizeof(line), f)) {
+        struct threshold t;
+        if (line[0] == '#' || sscanf(line, "%63s %d %lf", t.name, &t.n, &t.max_ns) != 3) continue;
+        limits = realloc(limits, (nlimits + 1) * sizeof(*limits));
+        limits[nlimits++] = t;
+    }
+    fclose(f);
+    return 0;
+}
+
+static double limit_for(const char *name, int n) {
+    int i;
+    for (i = 0; i < nlimits; i++) {
+        if (limits[i].n == n && strcmp(limits[i].name, name) == 0) return limits[i].max_ns;
+    }
+    return -1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--sizes N,N,...] [--min-time MS] [--thresholds FILE]\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char *sizes = "10,100,1000,10000,100000,1000000";
+    const char *thresholds = NULL;
+    char *list, *tok;
+    int i, failed = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i+1 < argc) sizes = argv[++i];
+        else if (strcmp(argv[i], "--min-time") == 0 && i+1 < argc) min_time_ns = atoll(argv[++i]) * 1000000;
+        else if (strcmp(argv[i], "--thresholds") == 0 && i+1 < argc) thresholds = argv[++i];
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+    }
+    if (thresholds && read_thresholds(thresholds) != 0) {
+        fprintf(stderr, "Could not read %s\n", thresholds);
+        return ENOENT;
+    }
+    srand(42);
+    perf_open();
+
+    printf("%-20s %8s %10s %14s %10s %12s  %s\n", "case", "n", "calls", "ns/call", "ns/child", "allocs/call", "misses/call");
+    list = strdup(sizes);
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        struct fixture f;
+        int n = atoi(tok), c;
+        if (n <= 0) continue;
+        make_fixture(&f, n);
+        for (c = 0; c < NCASES; c++) {
+            int64_t spent = 0, calls = 0, allocs = 0, misses = 0;
+            double ns, limit;
+            int have_misses = perf_fd >= 0;
+
+            probe.counting = 0;
+            while (spent < min_time_ns || calls < 3) {
+                cases[c].fn(&f);
+                spent += probe.ns;
+                calls++;
+            }
+            // a second pass for allocations and misses, so their
+            // bookkeeping does not show up in the timings
+            probe.counting = 1;
+            for (i = 0; i < 3; i++) {
+                cases[c].fn(&f);
+                if (probe.misses < 0) have_misses = 0;
+                misses += probe.misses;
+                allocs += probe.allocs;
+            }
+            ns = (double)spent / calls;
+            printf("%-20s %8d %10lld %14.1f %10.2f", cases[c].name, n, (long long)calls, ns, ns / n);
+#ifdef HAVE_ALLOC_COUNT
+            printf(" %12.1f", allocs / 3.0);
+#else
+            printf(" %12s", "-");
+#endif
+            if (have_misses) printf("  %.1f", misses / 3.0);
+            else printf("  -");
+            limit = limit_for(cases[c].name, n);
+            if (limit >= 0 && ns > limit) {
+                printf("  SLOWER than %.0f", limit);
+                failed = 1;
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+        free_fixture(&f);
+    }
+    free(list);
+    return failed;
+}
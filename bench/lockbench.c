@@ -0,0 +1,339 @@
+/**
+ * lockbench - end-to-end throughput and latency of zoo-locked under contention
+ *
+ * starts N contender processes, each running the real zoo-locked binary
+ * in a loop against one lock path, and collects the JSON stats line of
+ * every run through --stats-fd. in try mode every run counts, in wait
+ * mode a contender reruns until it got the lock, which is how cron
+ * wrappers that must not skip a slot use it
+ *
+ * against zkstandin (or a ZooKeeper with mntr enabled) it also reports
+ * server packets and bytes per granted lock. those are all the server
+ * got, connects and pings included
+ *
+ * --mode try,wait runs the sweep in both modes, and with --faults
+ * each profile is run through zoo-locked --faults, to see how latency
+ * and success rate degrade under it
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+struct record {
+    int32_t contender;
+    int32_t acquired;
+    int32_t attempts;
+    int32_t errors;         // attempts that ended neither acquired nor locked
+    int64_t latency_ns;
+};
+
+static const char *zoo_locked = "./zoo-locked";
+static const char *backend = "zk";
+static const char *hosts = "localhost:2181";
+static const char *path = "/zoo-locked-bench";
+static const char *cmd = "true";
+static const char *faults = NULL;
+static int wait_mode = 0;
+static int duration = 10;
+static int backoff_ms = 1;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * runs zoo-locked once, returns 1 if it got the lock, 0 if not
+ * and -1 if it failed. acquire_ns is taken from its stats line
+ */
+static int run_once(int64_t *acquire_ns) {
+    char line[4096];
+    int len = 0, n, fds[2], status;
+    char *p;
+    pid_t pid;
+
+    if (pipe(fds) != 0) return -1;
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(fds[1], 3);
+        if (devnull >= 0) {
+            dup2(devnull, 1);
+            dup2(devnull, 2);
+        }
+        if (faults) {
+            execl(zoo_locked, zoo_locked, "--backend", backend, "--faults", faults,
+                  "--stats-fd", "3", hosts, path, cmd, (char*)NULL);
+        } else {
+            execl(zoo_locked, zoo_locked, "--backend", backend, "--stats-fd", "3",
+                  hosts, path, cmd, (char*)NULL);
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+    while (len < (int)sizeof(line) - 1 && (n = read(fds[0], line + len, sizeof(line) - 1 - len)) > 0) {
+        len += n;
+    }
+    line[len] = 0;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    p = strstr(line, "\"acquire_ns\":");
+    *acquire_ns = p ? atoll(p + 13) : -1;
+    if (strstr(line, "\"outcome\":\"acquired\"")) return 1;
+    if (strstr(line, "\"outcome\":\"locked\"")) return 0;
+    return -1;
+}
+
+static void contender(int idx, int out, int64_t deadline) {
+    struct timespec ts = { 0, backoff_ms * 1000000L };
+    struct record rec;
+
+    while (now_ns() < deadline) {
+        int64_t first = now_ns();
+        int64_t started, acquire_ns;
+        int ret;
+
+        rec.contender = idx;
+        rec.attempts = 0;
+        rec.errors = 0;
+        for (;;) {
+            started = now_ns();
+            ret = run_once(&acquire_ns);
+            rec.attempts++;
+            if (ret < 0) rec.errors++;
+            if (!wait_mode || ret == 1 || now_ns() >= deadline) break;
+            if (backoff_ms) nanosleep(&ts, 0);
+        }
+        rec.acquired = ret == 1;
+        rec.latency_ns = acquire_ns < 0 || ret < 0 ? -1 : (wait_mode ? started - first : 0) + acquire_ns;
+        if (write(out, &rec, sizeof(rec)) != sizeof(rec)) break;
+    }
+}
+
+/** reads one counter from the output of the mntr four letter word */
+static int64_t mntr_value(const char *text, const char *key) {
+    const char *p = strstr(text, key);
+    if (!p || p[strlen(key)] != '\t') return -1;
+    return atoll(p + strlen(key) + 1);
+}
+
+/** asks the first server in hosts for its counters */
+static int mntr(int64_t *packets, int64_t *bytes) {
+    char host[256], buf[8192];
+    char *port;
+    struct addrinfo hints, *res;
+    int fd, len = 0, n;
+
+    snprintf(host, sizeof(host), "%s", hosts);
+    host[strcspn(host, ",/")] = 0;
+    port = strrchr(host, ':');
+    if (port) *port++ = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port ? port : "2181", &hints, &res) != 0) return -1;
+    fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0 || write(fd, "mntr", 4) != 4) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    while (len < (int)sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) len += n;
+    buf[len] = 0;
+    close(fd);
+    *packets = mntr_value(buf, "zk_packets_received");
+    *bytes = mntr_value(buf, "zk_bytes_received");
+    if (*bytes >= 0 && mntr_value(buf, "zk_bytes_sent") >= 0) *bytes += mntr_value(buf, "zk_bytes_sent");
+    return *packets < 0 ? -1 : 0;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(int64_t *sorted, int n, double p) {
+    int i;
+    if (!n) return -1;
+    i = (int)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+static int bench(int n) {
+    int fds[2], i, running;
+    int64_t deadline, started, elapsed;
+    int64_t *grants = calloc(n, sizeof(int64_t));
+    int64_t *lat = NULL;
+    int nlat = 0, caplat = 0;
+    int64_t runs = 0, total = 0, errors = 0, sum = 0, sumsq = 0;
+    int64_t packets0, bytes0, packets1, bytes1;
+    int have_mntr;
+    struct record rec;
+    FILE *in;
+
+    if (!grants || pipe(fds) != 0) return ENOMEM;
+    have_mntr = strcmp(backend, "zk") == 0 && mntr(&packets0, &bytes0) == 0;
+    started = now_ns();
+    deadline = started + (int64_t)duration * 1000000000;
+    for (i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Could not start contender %d: %s\n", i, strerror(errno));
+            break;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            contender(i, fds[1], deadline);
+            _exit(0);
+        }
+    }
+    running = i;
+    close(fds[1]);
+    in = fdopen(fds[0], "r");
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        runs += rec.attempts;
+        errors += rec.errors;
+        if (rec.acquired) {
+            grants[rec.contender]++;
+            total++;
+        }
+        // in try mode a LOCKED answer is a result too, its latency counts
+        if ((rec.acquired || !wait_mode) && rec.latency_ns >= 0) {
+            if (nlat == caplat) {
+                caplat = caplat ? caplat * 2 : 1024;
+                lat = realloc(lat, caplat * sizeof(int64_t));
+            }
+            lat[nlat++] = rec.latency_ns;
+        }
+    }
+    fclose(in);
+    while (wait(NULL) > 0);
+    elapsed = now_ns() - started;
+    have_mntr = have_mntr && mntr(&packets1, &bytes1) == 0;
+
+    // Jain's fairness index over grants per contender
+    for (i = 0; i < running; i++) {
+        sum += grants[i];
+        sumsq += grants[i] * grants[i];
+    }
+    qsort(lat, nlat, sizeof(int64_t), cmp_int64);
+    printf("%-10.10s  %6d  %-4s  %8lld  %7lld  %6lld  %5.1f  %9.1f  %8.2f  %8.2f  %8.2f  %8.2f  %5.3f",
+           faults ? faults : "none", running, wait_mode ? "wait" : "try",
+           (long long)runs, (long long)total, (long long)errors,
+           runs ? 100.0 * (runs - errors) / runs : 0, total / (elapsed / 1e9),
+           percentile_ms(lat, nlat, .5), percentile_ms(lat, nlat, .9),
+           percentile_ms(lat, nlat, .99), percentile_ms(lat, nlat, 1),
+           sumsq ? (double)sum * sum / ((double)running * sumsq) : 0);
+    if (have_mntr && total) {
+        printf("  %13.1f", (double)(packets1 - packets0) / total);
+        if (bytes0 >= 0 && bytes1 >= 0) printf("  %11.1f", (double)(bytes1 - bytes0) / total);
+        else printf("  %11s", "-");
+    } else {
+        printf("  %13s  %11s", "-", "-");
+    }
+    printf("\n");
+    fflush(stdout);
+    free(grants);
+    free(lat);
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--zoo-locked BIN] [--backend zk|flock] [--hosts HOSTS] [--path PATH] [--cmd CMD]\n"
+                    "       [--mode try|wait|try,wait] [--duration SECONDS] [--backoff MS] [--sweep N,N,...] [--faults PROFILE]...\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char *sweep = "1,2,4,8,16,32,64,128";
+    const char *modes = "try";
+    const char **profiles = calloc(argc, sizeof(char*));
+    int nprofiles = 0, wanted = 0;
+    char *list, *tok;
+    int i, p;
+
+    for (i = 1; i < argc; i++) {
+        if (i+1 >= argc) {
+            usage(argv[0]);
+            return EINVAL;
+        }
+        if (strcmp(argv[i], "--zoo-locked") == 0) zoo_locked = argv[++i];
+        else if (strcmp(argv[i], "--backend") == 0) backend = argv[++i];
+        else if (strcmp(argv[i], "--hosts") == 0) hosts = argv[++i];
+        else if (strcmp(argv[i], "--path") == 0) path = argv[++i];
+        else if (strcmp(argv[i], "--cmd") == 0) cmd = argv[++i];
+        else if (strcmp(argv[i], "--mode") == 0) modes = argv[++i];
+        else if (strcmp(argv[i], "--duration") == 0) duration = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--backoff") == 0) backoff_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sweep") == 0) sweep = argv[++i];
+        else if (strcmp(argv[i], "--faults") == 0) profiles[nprofiles++] = argv[++i];
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+    }
+    // a bit per mode, 1 for try and 2 for wait, each one given once
+    list = strdup(modes);
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int bit = strcmp(tok, "try") == 0 ? 1 : strcmp(tok, "wait") == 0 ? 2 : 0;
+        if (!bit || (wanted & bit)) {
+            usage(argv[0]);
+            return EINVAL;
+        }
+        wanted |= bit;
+    }
+    free(list);
+    if (!wanted) {
+        usage(argv[0]);
+        return EINVAL;
+    }
+    // every contender is a process of its own, and mem is only shared
+    // within one, so nobody would ever contend
+    if (strcmp(backend, "mem") == 0) {
+        fprintf(stderr, "Could not benchmark the mem backend, it is not shared between processes\n");
+        return EINVAL;
+    }
+    if (access(zoo_locked, X_OK) != 0) {
+        fprintf(stderr, "Could not find %s, use --zoo-locked\n", zoo_locked);
+        return ENOENT;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!nprofiles) profiles[nprofiles++] = NULL;
+
+    printf("faults           N  mode      runs   grants  errors    ok%%   grants/s    p50_ms    p90_ms    p99_ms    max_ms   jain  packets/grant  bytes/grant\n");
+    for (p = 0; p < nprofiles; p++) {
+        faults = profiles[p];
+        for (wait_mode = 0; wait_mode < 2; wait_mode++) {
+            if (!(wanted & (1 << wait_mode))) continue;
+            list = strdup(sweep);
+            for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n <= 0) continue;
+                if (bench(n) != 0) {
+                    fprintf(stderr, "Could not run with %d contenders\n", n);
+                    return ENOMEM;
+                }
+            }
+            free(list);
+        }
+    }
+    return 0;
+}
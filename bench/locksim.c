@@ -0,0 +1,473 @@
+/**
+ * locksim - deterministic simulation of a fleet running the lock recipe
+ *
+ * every contender is a coroutine running the real lock_parent and
+ * lock_try against the in-memory backend. each backend call costs a
+ * network round trip of virtual time, and the recipe's retry sleeps
+ * go through backend_sleep, so they are virtual too. one seeded
+ * scheduler decides who runs next, which makes a run repeatable and
+ * lets hours of cron traffic go by in seconds
+ *
+ * contenders wake up once per period with a bit of jitter, like cron
+ * with skewed clocks, take the lock, hold it for a while and let go.
+ * some crash while holding, their lock then stays until the session
+ * timeout expires it. the run checks
+ *   mutual exclusion  never two holders at the same virtual time
+ *   liveness          no period in which someone found the lock free
+ *                     but nobody got it
+ *   fairness          Jain's index over grants per contender
+ * and prints the distribution of time to a decision (try mode) or to
+ * the lock (wait mode). it exits with 1 if a check failed
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "../backend.h"
+#include "../lock.h"
+
+#define STACK_SIZE (128*1024)
+
+/* ---------------------------------------------------------------- */
+/* options                                                          */
+
+static int opt_contenders = 1000;
+static int opt_periods = 60;
+static double opt_period_ms = 60000;
+static double opt_jitter_ms = 1000;
+static double opt_hold_ms = 2000;       // mean, exponential
+static double opt_rtt_ms = 1;           // mean round trip, exponential
+static double opt_crash = 0.001;        // per grant
+static double opt_timeout_ms = 30000;
+static double opt_backoff_ms = 100;
+static int opt_wait = 0;
+static uint64_t opt_seed = 1;
+static const char *opt_faults = NULL;
+static const char *opt_path = "/sim";
+
+/* ---------------------------------------------------------------- */
+/* scheduler                                                        */
+
+struct proc {
+    ucontext_t ctx;
+    void *stack;
+    int id;
+    int done;
+};
+
+struct event {
+    int64_t at;
+    uint64_t seq;               // keeps equal times in a fixed order
+    struct proc *p;
+};
+
+static struct event *heap;
+static int nheap, capheap;
+static uint64_t event_seq;
+static int64_t vnow;            // virtual ns
+static ucontext_t sched_ctx;
+static struct proc *current;
+static uint64_t rng;
+
+static double uniform(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int64_t exp_ns(double mean_ms) {
+    return (int64_t)(-mean_ms * log(1 - uniform()) * 1e6);
+}
+
+static int before(const struct event *a, const struct event *b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void push(int64_t at, struct proc *p) {
+    int i;
+    if (nheap == capheap) {
+        capheap = capheap ? capheap * 2 : 1024;
+        heap = realloc(heap, capheap * sizeof(struct event));
+    }
+    i = nheap++;
+    heap[i].at = at;
+    heap[i].seq = event_seq++;
+    heap[i].p = p;
+    while (i > 0 && before(&heap[i], &heap[(i-1)/2])) {
+        struct event t = heap[i];
+        heap[i] = heap[(i-1)/2];
+        heap[(i-1)/2] = t;
+        i = (i-1)/2;
+    }
+}
+
+static struct event pop(void) {
+    struct event top = heap[0];
+    int i = 0;
+    heap[0] = heap[--nheap];
+    for (;;) {
+        int l = 2*i+1, r = l+1, m = i;
+        if (l < nheap && before(&heap[l], &heap[m])) m = l;
+        if (r < nheap && before(&heap[r], &heap[m])) m = r;
+        if (m == i) break;
+        struct event t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+    return top;
+}
+
+/** lets virtual time pass for the running contender */
+static void vsleep_ns(int64_t ns) {
+    push(vnow + (ns > 0 ? ns : 0), current);
+    swapcontext(&current->ctx, &sched_ctx);
+}
+
+static void vsleep(const struct timespec *ts) {
+    vsleep_ns((int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+static int64_t vclock(void) {
+    return vnow;
+}
+
+/* ---------------------------------------------------------------- */
+/* network: every call takes half a round trip each way             */
+
+struct sim_backend {
+    struct backend base;
+    struct backend *inner;
+};
+
+static void oneway(void) {
+    vsleep_ns(exp_ns(opt_rtt_ms / 2));
+}
+
+#define INNER(b) (((struct sim_backend*)(b))->inner)
+
+static int sim_exists(struct backend *b, const char *path, struct Stat *stat) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->exists(INNER(b), path, stat);
+    oneway();
+    return ret;
+}
+
+static int sim_create(struct backend *b, const char *path, const char *value, int valuelen,
+                      int flags, char *path_buffer, int path_buffer_len) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->create(INNER(b), path, value, valuelen, flags, path_buffer, path_buffer_len);
+    oneway();
+    return ret;
+}
+
+static int sim_get_children(struct backend *b, const char *path, struct String_vector *strings) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->get_children(INNER(b), path, strings);
+    oneway();
+    return ret;
+}
+
+static int sim_delete(struct backend *b, const char *path, int version) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->remove(INNER(b), path, version);
+    oneway();
+    return ret;
+}
+
+static int sim_watch(struct backend *b, const char *path, backend_watch_fn fn, void *ctx) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->watch(INNER(b), path, fn, ctx);
+    oneway();
+    return ret;
+}
+
+static int sim_multi(struct backend *b, int count, const zoo_op_t *ops, zoo_op_result_t *results) {
+    int ret;
+    oneway();
+    ret = INNER(b)->ops->multi(INNER(b), count, ops, results);
+    oneway();
+    return ret;
+}
+
+static int64_t sim_session(struct backend *b) {
+    return INNER(b)->ops->session(INNER(b));
+}
+
+/** the ephemerals are gone once the close reached the server */
+static void sim_close(struct backend *b) {
+    oneway();
+    INNER(b)->ops->close(INNER(b));
+    free(b);
+}
+
+static const struct backend_ops sim_ops = {
+    "sim",
+    sim_exists,
+    sim_create,
+    sim_get_children,
+    sim_delete,
+    sim_watch,
+    sim_multi,
+    sim_session,
+    sim_close,
+    NULL,
+    NULL,
+    NULL
+};
+
+static struct backend* sim_open(void) {
+    struct sim_backend *sb = calloc(1, sizeof(*sb));
+    // session handshake
+    oneway();
+    oneway();
+    sb->base.ops = &sim_ops;
+    sb->inner = backend_mem_open();
+    sb->base.connected_ns = vnow;
+    if (opt_faults) {
+        char spec[512];
+        struct backend *fb;
+        snprintf(spec, sizeof(spec), "%s,seed=%llu", opt_faults, (unsigned long long)(rng | 1));
+        uniform();
+        fb = backend_fault_open(&sb->base, spec);
+        if (fb) return fb;
+    }
+    return &sb->base;
+}
+
+/* ---------------------------------------------------------------- */
+/* the fleet                                                        */
+
+static int holder = -1;
+static int64_t *grants;         // per contender
+static int *period_grants;
+static int *period_free;        // someone found the lock free in this period
+static int64_t *dead_until;     // per period, a crashed holder blocked it
+static int64_t *lat;
+static int nlat, caplat;
+static int64_t runs, locked, failed, crashed, violations, gave_up;
+
+static int period_of(int64_t t) {
+    int k = (int)(t / (int64_t)(opt_period_ms * 1e6));
+    return k < opt_periods ? k : opt_periods - 1;
+}
+
+static void record_latency(int64_t ns) {
+    if (nlat == caplat) {
+        caplat = caplat ? caplat * 2 : 4096;
+        lat = realloc(lat, caplat * sizeof(int64_t));
+    }
+    lat[nlat++] = ns;
+}
+
+static void contender(void) {
+    struct proc *p = current;
+    int64_t period_ns = (int64_t)(opt_period_ms * 1e6);
+    int k;
+
+    for (k = 0; k < opt_periods; k++) {
+        int64_t start = k * period_ns + (int64_t)(uniform() * opt_jitter_ms * 1e6);
+        int64_t first;
+        enum lock_result r = LOCK_FAILED;
+
+        if (start > vnow) vsleep_ns(start - vnow);
+        first = vnow;
+        for (;;) {
+            int64_t t0 = vnow;
+            char *id, *owner, *blocker;
+            struct backend *zb = sim_open();
+
+            runs++;
+            if (holder < 0 && dead_until[k] <= vnow) period_free[k] = 1;
+            if (lock_parent(zb, opt_path, 0) == ZOK) {
+                r = lock_try(zb, opt_path, 0, &id, &owner, &blocker);
+                free(id);
+                free(owner);
+                free(blocker);
+            } else {
+                r = LOCK_FAILED;
+            }
+            if (r == LOCK_ACQUIRED) {
+                if (holder >= 0) violations++;
+                holder = p->id;
+                grants[p->id]++;
+                period_grants[period_of(vnow)]++;
+                record_latency(vnow - (opt_wait ? first : t0));
+                if (uniform() < opt_crash) {
+                    // dies while holding, the server notices after the timeout
+                    int64_t expiry;
+                    vsleep_ns((int64_t)(uniform() * opt_hold_ms * 1e6));
+                    crashed++;
+                    expiry = vnow + (int64_t)(opt_timeout_ms * 1e6);
+                    for (int j = period_of(vnow); j <= period_of(expiry); j++) {
+                        if (dead_until[j] < expiry) dead_until[j] = expiry;
+                    }
+                    holder = -1;
+                    vsleep_ns(expiry - vnow);
+                    zb->ops->close(zb);
+                } else {
+                    vsleep_ns(exp_ns(opt_hold_ms));
+                    zb->ops->close(zb);
+                    holder = -1;
+                }
+                break;
+            }
+            zb->ops->close(zb);
+            if (r == LOCK_LOCKED) locked++;
+            else failed++;
+            if (!opt_wait) {
+                record_latency(vnow - t0);
+                break;
+            }
+            if (vnow + (int64_t)(opt_backoff_ms * 1e6) >= (k + 1) * period_ns) {
+                gave_up++;
+                break;
+            }
+            vsleep_ns((int64_t)(opt_backoff_ms * 1e6));
+        }
+    }
+    p->done = 1;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_ms(double p) {
+    if (!nlat) return -1;
+    return lat[(int)(p * (nlat - 1) + 0.5)] / 1e6;
+}
+
+/**
+ * prints the summary of the run, returns 0 if mutual exclusion and
+ * liveness held. out of main, which getcontext could clobber
+ */
+static int report(const struct timespec *w0, const struct timespec *w1) {
+    double sum = 0, sumsq = 0;
+    int i, idle = 0, ok;
+
+    for (i = 0; i < opt_contenders; i++) {
+        sum += grants[i];
+        sumsq += (double)grants[i] * grants[i];
+    }
+    for (i = 0; i < opt_periods; i++) {
+        if (period_free[i] && !period_grants[i]) idle++;
+    }
+    qsort(lat, nlat, sizeof(int64_t), cmp_int64);
+
+    printf("%d contenders, %d periods of %.1fs, %s mode, seed %llu%s%s\n",
+           opt_contenders, opt_periods, opt_period_ms / 1000, opt_wait ? "wait" : "try",
+           (unsigned long long)opt_seed, opt_faults ? ", faults " : "", opt_faults ? opt_faults : "");
+    printf("simulated %.1fs in %.2fs\n", vnow / 1e9,
+           (w1->tv_sec - w0->tv_sec) + (w1->tv_nsec - w0->tv_nsec) / 1e9);
+    printf("runs %lld  grants %.0f  locked %lld  failed %lld  crashed %lld  gave up %lld\n",
+           (long long)runs, sum, (long long)locked, (long long)failed, (long long)crashed, (long long)gave_up);
+    printf("mutual exclusion: %s (%lld overlapping grants)\n", violations ? "VIOLATED" : "ok", (long long)violations);
+    printf("liveness: %s (%d periods with the lock free but no grant)\n", idle ? "VIOLATED" : "ok", idle);
+    printf("fairness: Jain's index %.3f over grants per contender\n",
+           sumsq ? sum * sum / (opt_contenders * sumsq) : 0);
+    printf("%s ms: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+           opt_wait ? "time to lock" : "time to decision",
+           pct_ms(.5), pct_ms(.9), pct_ms(.99), pct_ms(.999), pct_ms(1));
+
+    // injected faults can leave a free lock untaken, that is expected
+    ok = !violations && (opt_faults || !idle);
+    return ok ? 0 : 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--contenders N] [--periods N] [--period MS] [--jitter MS] [--hold MS]\n"
+                    "       [--rtt MS] [--crash P] [--session-timeout MS] [--mode try|wait] [--backoff MS]\n"
+                    "       [--faults PROFILE] [--seed N]\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    struct proc *procs;
+    struct timespec w0, w1;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *v = i+1 < argc ? argv[i+1] : NULL;
+        if (!v) {
+            usage(argv[0]);
+            return EINVAL;
+        }
+        if (strcmp(argv[i], "--contenders") == 0) opt_contenders = atoi(v);
+        else if (strcmp(argv[i], "--periods") == 0) opt_periods = atoi(v);
+        else if (strcmp(argv[i], "--period") == 0) opt_period_ms = atof(v);
+        else if (strcmp(argv[i], "--jitter") == 0) opt_jitter_ms = atof(v);
+        else if (strcmp(argv[i], "--hold") == 0) opt_hold_ms = atof(v);
+        else if (strcmp(argv[i], "--rtt") == 0) opt_rtt_ms = atof(v);
+        else if (strcmp(argv[i], "--crash") == 0) opt_crash = atof(v);
+        else if (strcmp(argv[i], "--session-timeout") == 0) opt_timeout_ms = atof(v);
+        else if (strcmp(argv[i], "--mode") == 0) opt_wait = strcmp(v, "wait") == 0;
+        else if (strcmp(argv[i], "--backoff") == 0) opt_backoff_ms = atof(v);
+        else if (strcmp(argv[i], "--faults") == 0) opt_faults = v;
+        else if (strcmp(argv[i], "--seed") == 0) opt_seed = strtoull(v, NULL, 10);
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+        i++;
+    }
+    if (opt_contenders <= 0 || opt_periods <= 0) {
+        usage(argv[0]);
+        return EINVAL;
+    }
+    rng = opt_seed ? opt_seed : 1;
+    backend_sleep = vsleep;
+    backend_clock = vclock;
+    // the recipe reports its retries on stderr, thousands of times here
+    if (!freopen("/dev/null", "w", stderr)) return errno;
+
+    grants = calloc(opt_contenders, sizeof(int64_t));
+    period_grants = calloc(opt_periods, sizeof(int));
+    period_free = calloc(opt_periods, sizeof(int));
+    dead_until = calloc(opt_periods, sizeof(int64_t));
+    procs = calloc(opt_contenders, sizeof(struct proc));
+    if (!grants || !period_grants || !period_free || !dead_until || !procs) return ENOMEM;
+
+    for (i = 0; i < opt_contenders; i++) {
+        struct proc *p = &procs[i];
+        p->id = i;
+        p->stack = mmap(NULL, STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p->stack == MAP_FAILED) return ENOMEM;
+        getcontext(&p->ctx);
+        p->ctx.uc_stack.ss_sp = p->stack;
+        p->ctx.uc_stack.ss_size = STACK_SIZE;
+        p->ctx.uc_link = &sched_ctx;
+        makecontext(&p->ctx, contender, 0);
+        push(0, p);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &w0);
+    while (nheap) {
+        struct event e = pop();
+        vnow = e.at;
+        current = e.p;
+        swapcontext(&sched_ctx, &current->ctx);
+        if (current->done && current->stack) {
+            munmap(current->stack, STACK_SIZE);
+            current->stack = NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w1);
+
+    return report(&w0, &w1);
+}
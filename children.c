@@ -0,0 +1,78 @@
+/**
+ * child list handling of the lock recipe
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "children.h"
+
+void free_String_vector(struct String_vector *v) {
+    if (v->data) {
+        int32_t i;
+        for (i=0; i<v->count; i++) {
+            free(v->data[i]);
+        }
+        free(v->data);
+        v->data = 0;
+    }
+}
+
+int vstrcmp(const void* str1, const void* str2) {
+    const char **a = (const char**)str1;
+    const char **b = (const char**) str2;
+    return strcmp(strrchr(*a, '-')+1, strrchr(*b, '-')+1);
+}
+
+void sort_children(struct String_vector *vector) {
+    qsort( vector->data, vector->count, sizeof(char*), &vstrcmp);
+}
+
+char* child_floor(char **sorted_data, int len, char *element) {
+    char* ret = NULL;
+    int i =0;
+    // compare the way the list was sorted, by sequence only
+    for (i=0; i < len && vstrcmp(&sorted_data[i], &element) < 0; i++) {
+        ret = sorted_data[i];
+    }
+    return ret;
+}
+
+/**
+ * get the last name of the path
+ */
+char* getName(char* str) {
+    char* name = strrchr(str, '/');
+    if (name == NULL)
+        return NULL;
+    return strdup(name + 1);
+}
+
+/** see if our node already exists
+ * if it does then we dup the name and
+ * return it
+ */
+char* lookupnode(struct String_vector *vector, char *prefix) {
+    char *ret = NULL;
+    if (vector->data) {
+        int i = 0;
+        for (i = 0; i < vector->count; i++) {
+            char* child = vector->data[i];
+            if (strncmp(prefix, child, strlen(prefix)) == 0) {
+                ret = strdup(child);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+int is_lock_node(const char *name) {
+    const char *p;
+    int i;
+    if (strncmp(name, "x-", 2) != 0) return 0;
+    for (i = 2; i < 18 && name[i] && strchr("0123456789abcdef", name[i]); i++);
+    if (i != 18 || name[18] != '-' || !name[19]) return 0;
+    for (p = name + 19; *p >= '0' && *p <= '9'; p++);
+    return *p == 0;
+}
@@ -0,0 +1,32 @@
+/**
+ * child list handling of the lock recipe
+ *
+ * lock nodes are named x-<session>-<sequence>, these helpers
+ * sort a listing by sequence and find our place in it
+ */
+
+#ifndef ZOO_LOCKED_CHILDREN_H
+#define ZOO_LOCKED_CHILDREN_H
+
+#include <zookeeper.h>
+
+void free_String_vector(struct String_vector *v);
+
+/** qsort comparator, orders names by their sequence suffix */
+int vstrcmp(const void* str1, const void* str2);
+
+void sort_children(struct String_vector *vector);
+
+/** the last name in sorted_data that comes before element */
+char* child_floor(char **sorted_data, int len, char *element);
+
+/** the last name of the path, strdup'ed */
+char* getName(char* str);
+
+/** the first child starting with prefix, strdup'ed */
+char* lookupnode(struct String_vector *vector, char *prefix);
+
+/** if name is an x-<session>-<sequence> lock node */
+int is_lock_node(const char *name);
+
+#endif
@@ -1,2 +1,10 @@
 ZOOKEEPER_PATH=/Users/fxtentacle/Downloads/zookeeper-3.4.5/src/recipes/lock/src/c/../../../../../src/c
-gcc -I/opt/local/include -I${ZOOKEEPER_PATH}/include -I${ZOOKEEPER_PATH}/generated  -L/opt/local/lib -lzookeeper_mt main.c
+gcc -c -O2 -fPIC -I/opt/local/include -I${ZOOKEEPER_PATH}/include -I${ZOOKEEPER_PATH}/generated zoolocked.c lock.c children.c scan.c stats.c backend.c backend_zk.c backend_mem.c backend_flock.c backend_fault.c backend_record.c
+ar rcs libzoolocked.a zoolocked.o lock.o children.o scan.o stats.o backend.o backend_zk.o backend_mem.o backend_flock.o backend_fault.o backend_record.o
+gcc -I/opt/local/include -I${ZOOKEEPER_PATH}/include -I${ZOOKEEPER_PATH}/generated  -L/opt/local/lib main.c metrics.c trace.c status.c gc.c inherit.c prelock.c libzoolocked.a -lzookeeper_mt -lpthread -lm
+gcc -O2 -o zkstandin tools/zkstandin.c
+gcc -O2 -o lockbench bench/lockbench.c
+gcc -O2 -I${ZOOKEEPER_PATH}/include -I${ZOOKEEPER_PATH}/generated -o childbench bench/childbench.c children.c
+gcc -O2 -I/opt/local/include -I${ZOOKEEPER_PATH}/include -I${ZOOKEEPER_PATH}/generated -L/opt/local/lib -lzookeeper_mt -o locksim bench/locksim.c lock.c children.c stats.c backend.c backend_zk.c backend_mem.c backend_flock.c backend_fault.c -lm
+gcc -O2 -o zkreplay tools/zkreplay.c
+gcc -O2 -o zklockstat tools/zklockstat.c -lm
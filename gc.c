@@ -0,0 +1,158 @@
+/**
+ * zoo-locked gc, see gc.h
+ *
+ * the stat of a folder does not say when its children last changed,
+ * only at which zxid (pzxid). the scan sees the create and modify
+ * zxids of many nodes with their times though, and zxids only grow,
+ * so the first of those at or after pzxid bounds the change from
+ * above. folders without such a bound are kept for a later run
+ *
+ * only folders that held lock nodes go: no data, no ephemeral owner
+ * and a cversion above 0. deletes go out in multis and carry the
+ * version the scan saw, but that is the data version, which children
+ * coming and going never change. what guards a folder that got a
+ * child in between is ZNOTEMPTY, the multi then fails as a whole and
+ * its batch is deleted one by one
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zookeeper.h>
+
+#include "gc.h"
+#include "scan.h"
+
+struct sample {
+    int64_t zxid;
+    int64_t ms;
+};
+
+static int cmp_sample(const void *a, const void *b) {
+    int64_t x = ((const struct sample*)a)->zxid, y = ((const struct sample*)b)->zxid;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** latest time the children of d can have changed */
+static int64_t last_change(const struct lock_dir *d, const struct sample *s, int n, int64_t now) {
+    int lo = 0, hi = n;
+    // never had a child, or an engine without zxids
+    if (d->stat.cversion == 0 || d->stat.pzxid == d->stat.czxid) return d->stat.ctime;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s[mid].zxid < d->stat.pzxid) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n ? s[lo].ms : now;
+}
+
+/** deletes one by one what a failed multi left, returns how many went */
+static int delete_each(struct backend *zb, struct lock_dir **batch, int n, int *busy, int *error, FILE *out) {
+    int i, deleted = 0;
+    for (i = 0; i < n; i++) {
+        int ret = zb->ops->remove(zb, batch[i]->path, batch[i]->stat.version);
+        if (ret == ZOK) {
+            fprintf(out, "deleted %s\n", batch[i]->path);
+            deleted++;
+        } else if (ret == ZNOTEMPTY || ret == ZBADVERSION || ret == ZNONODE) {
+            // in use again, or someone else collected it
+            (*busy)++;
+        } else if (!*error) {
+            fprintf(stderr, "Could not delete %s: %s\n", batch[i]->path, zerror(ret));
+            *error = ret;
+        }
+    }
+    return deleted;
+}
+
+int lock_gc(struct backend *zb, const char *prefix, const struct gc_options *o, FILE *out) {
+    int64_t now = wall_ms(), start, due;
+    struct lock_dir *dirs, **idle;
+    struct sample *samples;
+    zoo_op_t *ops;
+    zoo_op_result_t *results;
+    int count, nsamples = 0, nidle = 0, empty = 0, deleted = 0, busy = 0;
+    int batch = o->batch > 0 ? o->batch : 1;
+    int error, i, j;
+
+    start = backend_clock();
+    error = scan_locks(zb, prefix, o->window, &dirs, &count);
+    if (error != ZOK) fprintf(stderr, "Could not list everything under %s: %s\n", prefix, zerror(error));
+
+    samples = malloc((2 * count + 1) * sizeof(struct sample));
+    idle = malloc((count + 1) * sizeof(struct lock_dir*));
+    ops = malloc(batch * sizeof(zoo_op_t));
+    results = malloc(batch * sizeof(zoo_op_result_t));
+    if (!samples || !idle || !ops || !results) {
+        free(samples);
+        free(idle);
+        free(ops);
+        free(results);
+        free_lock_dirs(dirs, count);
+        return ZSYSTEMERROR;
+    }
+    for (i = 0; i < count; i++) {
+        if (dirs[i].stat.czxid > 0) {
+            samples[nsamples].zxid = dirs[i].stat.czxid;
+            samples[nsamples++].ms = dirs[i].stat.ctime;
+        }
+        if (dirs[i].stat.mzxid > 0) {
+            samples[nsamples].zxid = dirs[i].stat.mzxid;
+            samples[nsamples++].ms = dirs[i].stat.mtime;
+        }
+    }
+    qsort(samples, nsamples, sizeof(struct sample), cmp_sample);
+    for (i = 0; i < count; i++) {
+        struct lock_dir *d = &dirs[i];
+        if (d->children.count || d->stat.numChildren || strcmp(d->path, prefix) == 0) continue;
+        // the scan takes any leaf for a folder. nodes with data,
+        // ephemerals and folders that never had a child are not ours
+        if (d->stat.dataLength || d->stat.ephemeralOwner || d->stat.cversion == 0) continue;
+        empty++;
+        if (now - last_change(d, samples, nsamples, now) >= o->ttl_ms) idle[nidle++] = d;
+    }
+
+    due = backend_clock();
+    for (i = 0; i < nidle; i += batch) {
+        int n = nidle - i < batch ? nidle - i : batch;
+        int ret;
+        if (o->dry_run) {
+            for (j = 0; j < n; j++) fprintf(out, "would delete %s\n", idle[i + j]->path);
+            continue;
+        }
+        if (o->rate > 0) {
+            // spread the deletes so the ensemble keeps up with them
+            int64_t wait = due - backend_clock();
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+                backend_sleep(&ts);
+            }
+            due += (int64_t)n * 1000000000 / o->rate;
+        }
+        for (j = 0; j < n; j++) zoo_delete_op_init(&ops[j], idle[i + j]->path, idle[i + j]->stat.version);
+        ret = zb->ops->multi(zb, n, ops, results);
+        if (ret == ZOK) {
+            for (j = 0; j < n; j++) fprintf(out, "deleted %s\n", idle[i + j]->path);
+            deleted += n;
+        } else {
+            deleted += delete_each(zb, idle + i, n, &busy, &error, out);
+        }
+    }
+    fprintf(stderr, "%d folders, %d empty, %d idle for %llds, %d %s, %d in use again, %.3fs\n",
+            count, empty, nidle, (long long)(o->ttl_ms / 1000), o->dry_run ? nidle : deleted,
+            o->dry_run ? "to delete" : "deleted", busy, (backend_clock() - start) / 1e9);
+
+    free(samples);
+    free(idle);
+    free(ops);
+    free(results);
+    free_lock_dirs(dirs, count);
+    return error;
+}
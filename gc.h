@@ -0,0 +1,26 @@
+/**
+ * zoo-locked gc: removes lock folders nobody used for a while
+ */
+
+#ifndef ZOO_LOCKED_GC_H
+#define ZOO_LOCKED_GC_H
+
+#include <stdio.h>
+#include "backend.h"
+
+struct gc_options {
+    int window;         // listings in flight
+    int64_t ttl_ms;     // only folders idle for longer go
+    int batch;          // deletes per multi
+    int rate;           // deletes per second, 0 for no limit
+    int dry_run;        // only print what would go
+};
+
+/**
+ * deletes the empty lock folders under prefix (not prefix itself)
+ * whose children last changed more than ttl ago, printing each to
+ * out. returns ZOK or the first error
+ */
+int lock_gc(struct backend *zb, const char *prefix, const struct gc_options *o, FILE *out);
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * lock inheritance for nested zoo-locked runs
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#include "inherit.h"
+
+// one line per held lock: pid, session, engine, hosts, path, node
+#define HELD_VAR "ZOO_LOCKED_HELD"
+// a shell, a script and a make or two sit between holder and us
+#define MAX_DEPTH 64
+
+/** parent of pid, or -1 if we cannot tell */
+static pid_t parent_of(pid_t pid) {
+#if defined(__linux__)
+    char name[32], buf[512], *p;
+    FILE *f;
+    int ppid;
+    size_t len;
+    
+    snprintf(name, sizeof(name), "/proc/%d/stat", (int)pid);
+    f = fopen(name, "r");
+    if (!f) return -1;
+    len = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[len] = 0;
+    // the command name is in parentheses and may contain anything
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p+1, " %*c %d", &ppid) != 1) return -1;
+    return ppid;
+#elif defined(__APPLE__)
+    struct kinfo_proc kp;
+    size_t len = sizeof(kp);
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid };
+    
+    if (sysctl(mib, 4, &kp, &len, NULL, 0) != 0 || len == 0) return -1;
+    return kp.kp_eproc.e_ppid;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * whether pid is one of our ancestors. where the process tree
+ * cannot be read, a live parent is the best we can check
+ */
+static int is_ancestor(pid_t pid) {
+    pid_t p = getppid();
+    int depth;
+    
+    if (pid <= 1) return 0;
+    for (depth = 0; depth < MAX_DEPTH && p > 1; depth++) {
+        if (p == pid) return 1;
+        p = parent_of(p);
+    }
+    return 0;
+}
+
+int inherit_held(const char *engine, const char *hosts, const char *path, char *node, int size) {
+    const char *held = getenv(HELD_VAR);
+    char *copy, *line, *save = NULL;
+    int found = 0;
+    
+    if (!held || !*held) return 0;
+    copy = strdup(held);
+    if (!copy) return 0;
+    for (line = strtok_r(copy, "\n", &save); line && !found; line = strtok_r(NULL, "\n", &save)) {
+        char *field[6], *p = line;
+        int n;
+        
+        for (n = 0; n < 6 && p; n++) {
+            field[n] = p;
+            p = strchr(p, '\t');
+            if (p) *p++ = 0;
+        }
+        if (n < 6) continue;
+        if (strcmp(field[2], engine) != 0 || strcmp(field[3], hosts) != 0 || strcmp(field[4], path) != 0) continue;
+        // a dead or unrelated holder has nothing to lend, its
+        // pid may even belong to someone else by now
+        if (!is_ancestor((pid_t)atol(field[0]))) continue;
+        snprintf(node, size, "%s", field[5]);
+        found = 1;
+    }
+    free(copy);
+    return found;
+}
+
+void inherit_export(const char *engine, const char *hosts, const char *path, const char *node, int64_t session) {
+    const char *held = getenv(HELD_VAR);
+    char sid[17];
+    char *buf;
+    size_t len;
+    
+    snprintf(sid, sizeof(sid), "%016llx", (unsigned long long)session);
+    // tabs and newlines would break the list, such locks are not lent
+    if (strpbrk(hosts, "\t\n") || strpbrk(path, "\t\n")) return;
+    len = (held ? strlen(held) + 1 : 0) + 32 + strlen(sid) + strlen(engine) + strlen(hosts) + strlen(path) + strlen(node) + 8;
+    buf = malloc(len);
+    if (!buf) return;
+    snprintf(buf, len, "%s%s%ld\t%s\t%s\t%s\t%s\t%s", held && *held ? held : "", held && *held ? "\n" : "",
+             (long)getpid(), sid, engine, hosts, path, node);
+    setenv(HELD_VAR, buf, 1);
+    free(buf);
+    setenv("ZOO_LOCKED_PATH", path, 1);
+    setenv("ZOO_LOCKED_NODE", node, 1);
+    setenv("ZOO_LOCKED_SESSION", sid, 1);
+}
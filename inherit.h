@@ -0,0 +1,28 @@
+/**
+ * lock inheritance for nested zoo-locked runs
+ *
+ * a task that holds a lock may call zoo-locked on the same path
+ * again, directly or from a script further down. the holder writes
+ * what it holds to ZOO_LOCKED_HELD, and a nested run that finds its
+ * path there under a live ancestor runs its task without asking
+ * the backend at all
+ */
+
+#ifndef ZOO_LOCKED_INHERIT_H
+#define ZOO_LOCKED_INHERIT_H
+
+#include <stdint.h>
+
+/**
+ * returns 1 if a process above us holds path on the same engine
+ * and hosts, and copies its lock node to node (size bytes)
+ */
+int inherit_held(const char *engine, const char *hosts, const char *path, char *node, int size);
+
+/**
+ * adds the lock we hold to ZOO_LOCKED_HELD and sets ZOO_LOCKED_PATH,
+ * ZOO_LOCKED_NODE and ZOO_LOCKED_SESSION for the task
+ */
+void inherit_export(const char *engine, const char *hosts, const char *path, const char *node, int64_t session);
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * the lock recipe, see lock.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zookeeper.h>
+#include <zookeeper_log.h>
+
+#include "lock.h"
+#include "children.h"
+#include "stats.h"
+#include "probes.h"
+
+static const struct timespec retry_delay = { 0, 500000 };
+
+/**
+ * just a method to retry get children
+ */
+static int retry_getchildren(struct backend *zb, const char* path, struct String_vector *vector, int retry) {
+    int ret = ZCONNECTIONLOSS;
+    int count = 0;
+    while (ret == ZCONNECTIONLOSS && count < retry) {
+        int64_t start = zl_stats_now();
+        ret = zb->ops->get_children(zb, path, vector);
+        zl_stats_listing(start, vector);
+        if (ret == ZOK) PROBE2(children__listed, path, vector->count);
+        if (ret == ZCONNECTIONLOSS) {
+            LOG_DEBUG(("connection loss to the server"));
+            zl_run_stats.listing_retries++;
+            backend_sleep(&retry_delay);
+            count++;
+        }
+    }
+    return ret;
+}
+
+int lock_parent(struct backend *zb, const char *path, int flags) {
+    struct Stat stat;
+    int64_t start = zl_stats_now();
+    int exists = zb->ops->exists(zb, path, &stat);
+    int count = 0;
+
+    // check if folder exists. if not, create
+    while ((exists == ZCONNECTIONLOSS || exists == ZNONODE) && (count < LOCK_MAX_RETRY)) {
+        count++;
+        backend_sleep(&retry_delay);
+
+        if (exists == ZCONNECTIONLOSS)
+            exists = zb->ops->exists(zb, path, &stat);
+        else if (exists == ZNONODE) {
+            exists = zb->ops->create(zb, path, NULL, 0, flags, NULL, 0);
+            // an older server does not know containers
+            if (flags && (exists == ZBADARGUMENTS || exists == ZUNIMPLEMENTED)) {
+                flags = 0;
+                exists = ZNONODE;
+            }
+        }
+    }
+    zl_stats_phase(PHASE_PARENT, start);
+    zl_run_stats.parent_retries = count;
+    // someone else creating it first is as good
+    return exists == ZNODEEXISTS ? ZOK : exists;
+}
+
+enum lock_result lock_try(struct backend *zb, const char *path, int flags, char **id, char **owner, char **blocker) {
+    int64_t start;
+    int count = 0;
+
+    *id = *owner = *blocker = NULL;
+    zl_run_stats.locking_ns = zl_stats_now();
+    while (count < LOCK_MAX_RETRY) {
+        count++;
+        backend_sleep(&retry_delay);
+        PROBE2(lock__start, path, count);
+
+        // get the session id
+        int64_t session = zb->ops->session(zb);
+        char prefix[30];
+        snprintf(prefix, 30, "x-%016llx-", (unsigned long long)session);
+        struct String_vector vectorst;
+        vectorst.data = NULL;
+        vectorst.count = 0;
+        int ret = retry_getchildren(zb, path, &vectorst, LOCK_MAX_RETRY);
+        // the folder is gone too, lock_parent was a while ago
+        if (ret == ZNONODE && lock_parent(zb, path, flags) == ZOK) continue;
+        if (ret != ZOK) {
+            fprintf(stderr, "Could not enumerate folder %s\n", path);
+            zl_run_stats.zkerrors++;
+            continue;
+        }
+        struct String_vector *vector = &vectorst;
+        *id = lookupnode(vector, prefix);
+        free_String_vector(vector);
+        if (*id == NULL) {
+            int len = strlen(path) + strlen(prefix) + 2;
+            char buf[len];
+            char retbuf[len+20];
+            snprintf(buf, len, "%s/%s", path, prefix);
+            start = zl_stats_now();
+            ret = zb->ops->create(zb, buf, NULL, 0, ZOO_EPHEMERAL|ZOO_SEQUENCE, retbuf, (len+20));
+            zl_stats_phase(PHASE_CREATE, start);
+
+            // zoo-locked gc removed the idle folder in between
+            if (ret == ZNONODE && lock_parent(zb, path, flags) == ZOK) continue;
+            // do not want to retry the create since
+            // we would end up creating more than one child
+            if (ret != ZOK) {
+                fprintf(stderr, "Could not create locking node %s\n", buf);
+                zl_run_stats.zkerrors++;
+                continue;
+            }
+            *id = getName(retbuf);
+            // without sys/sdt.h the arguments are not even evaluated,
+            // with it the parse is nothing next to the create above
+            PROBE2(node__created, retbuf, atoll(strrchr(retbuf, '-')+1));
+        }
+
+        ret = retry_getchildren(zb, path, vector, LOCK_MAX_RETRY);
+        if (ret != ZOK) {
+            fprintf(stderr, "Could not enumerate folder %s\n", path);
+            zl_run_stats.zkerrors++;
+            // the next round finds our node again
+            free(*id);
+            *id = NULL;
+            continue;
+        }
+        zl_run_stats.lock_retries = count - 1;
+        if (vector->count == 0) {
+            // our node is gone with our session
+            zl_run_stats.zkerrors++;
+            return LOCK_FAILED;
+        }
+        //sort this list
+        start = zl_stats_now();
+        sort_children(vector);
+        *owner = strdup(vector->data[0]);
+        char* lessthanme = child_floor(vector->data, vector->count, *id);
+        zl_stats_phase(PHASE_SORT, start);
+        zl_run_stats.decided_ns = zl_stats_now();
+        if (lessthanme != NULL) {
+            *blocker = strdup(lessthanme);
+            free_String_vector(vector);
+            PROBE2(lock__locked, path, *blocker);
+            zl_run_stats.outcome = "locked";
+            return LOCK_LOCKED;
+        }
+        free_String_vector(vector);
+        // nothing in front of us, so we have to be first
+        if (strcmp(*id, *owner) != 0) return LOCK_FAILED;
+        PROBE2(lock__acquired, path, *id);
+        zl_run_stats.outcome = "acquired";
+        return LOCK_ACQUIRED;
+    }
+    zl_run_stats.lock_retries = count - 1;
+    fprintf(stderr, "Too many retries while trying to lock %s\n", path);
+    return LOCK_FAILED;
+}
@@ -0,0 +1,45 @@
+/**
+ * the lock recipe
+ *
+ * every contender adds an ephemeral sequence node x-<session>-<seq>
+ * under the lock folder. whoever has the lowest sequence holds the
+ * lock, everyone else is told who is in front of them
+ */
+
+#ifndef ZOO_LOCKED_LOCK_H
+#define ZOO_LOCKED_LOCK_H
+
+#include "backend.h"
+
+#define LOCK_MAX_RETRY 5
+
+/**
+ * ZooKeeper 3.5's ZOO_CONTAINER create mode. the server removes a
+ * container once its last child is gone, so lock folders clean up
+ * after themselves
+ */
+#define LOCK_CONTAINER 4
+
+enum lock_result {
+    LOCK_ACQUIRED,
+    LOCK_LOCKED,    // someone else is in front of us
+    LOCK_FAILED     // retries ran out or our node went missing
+};
+
+/**
+ * makes sure the lock folder exists, returns a ZooKeeper error code.
+ * flags is 0 or LOCK_CONTAINER, a server that does not know containers
+ * gets a plain node
+ */
+int lock_parent(struct backend *zb, const char *path, int flags);
+
+/**
+ * one attempt at the lock on path. if the folder was collected since
+ * lock_parent it is created again, with flags as for lock_parent.
+ * *id is set to our node, *owner to the node holding the lock, and on
+ * LOCK_LOCKED *blocker to the node right in front of us. all three
+ * are malloc'ed or NULL
+ */
+enum lock_result lock_try(struct backend *zb, const char *path, int flags, char **id, char **owner, char **blocker);
+
+#endif
@@ -43,6 +43,20 @@
 #include <zookeeper.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stats.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+#include "backend.h"
+#include "zoolocked.h"
+#include "status.h"
+#include "gc.h"
+#include "inherit.h"
+#include "prelock.h"
 
 #ifdef HAVE_SYS_UTSNAME_H
 #include <sys/utsname.h>
@@ -58,88 +72,81 @@
 
 
 
-static void free_String_vector(struct String_vector *v) {
-    if (v->data) {
-        int32_t i;
-        for (i=0; i<v->count; i++) {
-            free(v->data[i]);
-        }
-        free(v->data);
-        v->data = 0;
-    }
-}
-
-static int vstrcmp(const void* str1, const void* str2) {
-    const char **a = (const char**)str1;
-    const char **b = (const char**) str2;
-    return strcmp(strrchr(*a, '-')+1, strrchr(*b, '-')+1);
-}
-
-static void sort_children(struct String_vector *vector) {
-    qsort( vector->data, vector->count, sizeof(char*), &vstrcmp);
-}
-
-static char* child_floor(char **sorted_data, int len, char *element) {
-    char* ret = NULL;
-    int i =0;
-    for (i=0; i < len; i++) {
-        if (strcmp(sorted_data[i], element) < 0) {
-            ret = sorted_data[i];
-        }
-    }
-    return ret;
-}
-
 /**
- * get the last name of the path
+ * the exit code a shell would report for a pclose status, 128 plus
+ * the signal for a command that was killed
  */
-static char* getName(char* str) {
-    char* name = strrchr(str, '/');
-    if (name == NULL)
-        return NULL;
-    return strdup(name + 1);
+static int exit_code(int status) {
+    if (status == -1) return errno;
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
 }
 
 /**
- * just a method to retry get children
+ * run a task through the shell and pass its output through,
+ * returns the exit code of the task
  */
-static int retry_getchildren(zhandle_t *zh, char* path, struct String_vector *vector, struct timespec *ts, int retry) {
-    int ret = ZCONNECTIONLOSS;
-    int count = 0;
-    while (ret == ZCONNECTIONLOSS && count < retry) {
-        ret = zoo_get_children(zh, path, 0, vector);
-        if (ret == ZCONNECTIONLOSS) {
-            LOG_DEBUG(("connection loss to the server"));
-            nanosleep(ts, 0);
-            count++;
-        }
-    }
+static int run_task(const char *cmd) {
+    int64_t start = zl_stats_now();
+    FILE *f = popen(cmd, "r");
+    char tmp[512];
+    int ret;
+    
+    zl_stats_phase(PHASE_SPAWN, start);
+    if (!f) return errno;
+    PROBE1(child__spawned, cmd);
+    start = zl_run_stats.spawned_ns = zl_stats_now();
+    while(fgets(tmp, sizeof(tmp), f)) printf("%s", tmp);
+    ret = exit_code(pclose(f));
+    zl_stats_phase(PHASE_CHILD, start);
+    PROBE2(child__exited, ret, zl_run_stats.phase_ns[PHASE_CHILD]);
     return ret;
 }
 
-/** see if our node already exists
- * if it does then we dup the name and
- * return it
+/**
+ * opens the engine on hosts with the --faults and --record layers
+ * on top. complains on stderr and returns NULL with errno set
  */
-static char* lookupnode(struct String_vector *vector, char *prefix) {
-    char *ret = NULL;
-    if (vector->data) {
-        int i = 0;
-        for (i = 0; i < vector->count; i++) {
-            char* child = vector->data[i];
-            if (strncmp(prefix, child, strlen(prefix)) == 0) {
-                ret = strdup(child);
-                break;
-            }
+static struct backend *open_level(const char *engine, const char *hosts, const char *faults, const char *recordfile) {
+    struct backend *zb = backend_open(engine, hosts, 30000);
+    struct backend *wb;
+    int err;
+    
+    if (!zb) {
+        fprintf(stderr, "Could not open %s backend on %s\n", engine, hosts);
+        return NULL;
+    }
+    if (faults) {
+        wb = backend_fault_open(zb, faults);
+        if (!wb) {
+            err = errno;
+            fprintf(stderr, "Could not use fault profile %s\n", faults);
+            zb->ops->close(zb);
+            errno = err;
+            return NULL;
         }
+        zb = wb;
     }
-    return ret;
+    // outermost, so the trace shows what the recipe saw
+    if (recordfile) {
+        wb = backend_record_open(zb, recordfile);
+        if (!wb) {
+            err = errno;
+            fprintf(stderr, "Could not record to %s\n", recordfile);
+            zb->ops->close(zb);
+            errno = err;
+            return NULL;
+        }
+        zb = wb;
+    }
+    return zb;
 }
 
-
-
-void watcher(zhandle_t *zzh, int type, int state, const char *path, void* context)
-{
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--backend zk|flock] [--faults PROFILE] [--record FILE] [--container] [--local DIR [--local-wait]] [--global HOSTS] [--prepare CMD] [--commit CMD] [--stats FILE | --stats-fd FD] [--metrics FILE] [--trace FILE] hosts path [cmd]\n"
+                    "       %s [--backend zk|flock] [--window N] status hosts prefix\n"
+                    "       %s [--backend zk|flock] [--window N] [--ttl SECONDS] [--batch N] [--rate N] [--dry-run] gc hosts prefix\n",
+            argv0, argv0, argv0);
 }
 
 
@@ -148,129 +155,314 @@ int main( int argc, const char* argv[] )
 {
     int exitcode = 0;
     
-	zhandle_t *zh;
-	const char* hosts = argv[1];
-	char *path = argv[2];
-	struct ACL_vector *acl = &ZOO_OPEN_ACL_UNSAFE;;
+	struct backend *zb = NULL;
+	struct zl_client *zc = NULL;
+	struct zl_lock *lock = NULL;
+	struct backend *gzb = NULL;
+	struct zl_client *gzc = NULL;
+	struct zl_lock *glock = NULL;
+	const char *globalhosts = NULL;
+	const char *engine = "zk";
+	const char *faults = NULL;
+	const char *recordfile = NULL;
+	const char* hosts;
+	char *path;
+	const char *prepare = NULL;
+	const char *commit = NULL;
+	FILE *prepf = NULL;
+	int statsfd = -1;
+	const char *metrics = NULL;
+	const char *tracefile = NULL;
+	const char *subcommand = NULL;
+	int window = 1000;
+	struct gc_options gco = { 0, 86400000, 100, 100, 0 };
+	int parent_flags = 0;
+	int64_t start;
+	int64_t locking;
 	char *id = NULL;
 	char* ownerid = NULL;
+	char inherited[256];
+	int inherit = 0;
+	const char *localdir = NULL;
+	int localwait = 0;
+	int localfd = -1;
+	long localholder;
 	
-	// connect
-    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
-    zoo_deterministic_conn_order(1); // enable deterministic order
-	zh = zookeeper_init(hosts, watcher, 30000, 0, 0, 0);
-   	if( !zh ) return errno;
-    
-    struct Stat stat;
-    int exists = zoo_exists(zh, path, 0, &stat);
-    int count = 0;
-	int maxretry = 5;
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = (.5)*1000000;
-    
-	// check if folder exists. if not, create
-    while ((exists == ZCONNECTIONLOSS || exists == ZNONODE) && (count < maxretry)) {
-        count++;
-        nanosleep(&ts, 0);
-
-        if (exists == ZCONNECTIONLOSS)
-            exists = zoo_exists(zh, path, 0, &stat);
-        else if (exists == ZNONODE)
-            exists = zoo_create(zh, path, NULL, 0, acl, 0, NULL, 0);
+	// options come before hosts and path
+	int argi = 1;
+	while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--backend") == 0 && argi+1 < argc) {
+            engine = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--faults") == 0 && argi+1 < argc) {
+            faults = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--record") == 0 && argi+1 < argc) {
+            recordfile = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--prepare") == 0 && argi+1 < argc) {
+            prepare = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--commit") == 0 && argi+1 < argc) {
+            commit = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--stats") == 0 && argi+1 < argc) {
+            statsfd = open(argv[argi+1], O_WRONLY|O_CREAT|O_APPEND, 0644);
+            if (statsfd < 0) {
+                fprintf(stderr, "Could not open %s\n", argv[argi+1]);
+                return errno;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "--stats-fd") == 0 && argi+1 < argc) {
+            char *end;
+            long fd = strtol(argv[argi+1], &end, 10);
+            if (end == argv[argi+1] || *end || fd < 0 || fd > INT_MAX) {
+                fprintf(stderr, "Could not use %s as stats fd\n", argv[argi+1]);
+                return EINVAL;
+            }
+            statsfd = fd;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--metrics") == 0 && argi+1 < argc) {
+            metrics = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--trace") == 0 && argi+1 < argc) {
+            tracefile = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--global") == 0 && argi+1 < argc) {
+            globalhosts = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--local") == 0 && argi+1 < argc) {
+            localdir = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--local-wait") == 0) {
+            localwait = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--container") == 0) {
+            parent_flags = ZL_CONTAINER;
+            argi++;
+        } else if (strcmp(argv[argi], "--window") == 0 && argi+1 < argc) {
+            window = atoi(argv[argi+1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--ttl") == 0 && argi+1 < argc) {
+            gco.ttl_ms = atoll(argv[argi+1]) * 1000;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--batch") == 0 && argi+1 < argc) {
+            gco.batch = atoi(argv[argi+1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--rate") == 0 && argi+1 < argc) {
+            gco.rate = atoi(argv[argi+1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--dry-run") == 0) {
+            gco.dry_run = 1;
+            argi++;
+        } else {
+            usage(argv[0]);
+            return EINVAL;
+        }
     }
-	if( count >= maxretry ) {
-        fprintf(stderr, "Could not create %s\n", path);
-        goto exitnow;
+	// status and gc look after the locks instead of taking one
+	if (argi < argc && (strcmp(argv[argi], "status") == 0 || strcmp(argv[argi], "gc") == 0)) {
+        subcommand = argv[argi];
+        argi++;
     }
-    
-    // lock loop
-    count = 0;
-    while (count < maxretry) {
-        count++;
-        nanosleep(&ts, 0);
-        
-        const clientid_t *cid = zoo_client_id(zh);
-        // get the session id
-        int64_t session = cid->client_id;
-        char prefix[30];
-#if defined(__x86_64__)
-        snprintf(prefix, 30, "x-%016lx-", session);
-#else
-        snprintf(prefix, 30, "x-%016llx-", session);
-#endif
-        struct String_vector vectorst;
-        vectorst.data = NULL;
-        vectorst.count = 0;
-        int ret = retry_getchildren(zh, path, &vectorst, &ts, maxretry);
-        if (ret != ZOK) {
-            fprintf(stderr, "Could not enumerate folder %s\n", path);
-            continue;
+	if (argc - argi < 2 || (!subcommand && argc - argi < 3 && commit == NULL)) {
+        usage(argv[0]);
+        return EINVAL;
+    }
+	// a tree in our own memory is seen by no other process, every run
+	// would get the lock
+	if (strcmp(engine, "mem") == 0) {
+        fprintf(stderr, "Could not lock on the mem backend, it is not shared between processes\n");
+        return EINVAL;
+    }
+	hosts = argv[argi];
+	path = (char*)argv[argi+1];
+	if (commit == NULL) commit = argv[argi+2];
+	zl_run_stats.start_ns = zl_stats_now();
+	if (tracefile) trace_init();
+	if (!subcommand) inherit = inherit_held(engine, hosts, path, inherited, sizeof(inherited));
+	
+	// settle it with the other processes on this host first, so
+	// that only one of them opens a session and queues up. an
+	// inherited lock already went through this
+	if (localdir && !subcommand && !inherit) {
+        localfd = prelock_take(localdir, path, localwait, &localholder);
+        if (localfd < 0 && errno == EWOULDBLOCK) {
+            zl_run_stats.outcome = "locked";
+            printf("LOCKED by %s on this host (pid %ld)\n", path, localholder);
+            goto exitnow;
         }
-        struct String_vector *vector = &vectorst;
-        id = lookupnode(vector, prefix);
-        free_String_vector(vector);
-        if (id == NULL) {
-            int len = strlen(path) + strlen(prefix) + 2;
-            char buf[len];
-            char retbuf[len+20];
-            snprintf(buf, len, "%s/%s", path, prefix);
-            ret = zoo_create(zh, buf, NULL, 0,  acl, ZOO_EPHEMERAL|ZOO_SEQUENCE, retbuf, (len+20));
-            
-            // do not want to retry the create since
-            // we would end up creating more than one child
-            if (ret != ZOK) {
-                fprintf(stderr, "Could not create locking node %s\n", buf);
-                continue;
-            }
-            id = getName(retbuf);
+        if (localfd < 0) {
+            exitcode = errno;
+            fprintf(stderr, "Could not lock %s in %s\n", path, localdir);
+            goto exitnow;
         }
-        
-        if (id != NULL) {
-            ret = retry_getchildren(zh, path, vector, &ts, maxretry);
-            if (ret != ZOK) {
-                fprintf(stderr, "Could not enumerate folder %s\n", path);
-                continue;
-            }
-            //sort this list
-            sort_children(vector);
-            ownerid = strdup(vector->data[0]);
-            char* lessthanme = child_floor(vector->data, vector->count, id);
-            if (lessthanme != NULL) {
-                int flen = strlen(path) + strlen(lessthanme) + 2;
-                char last_child[flen];
-                sprintf(last_child, "%s/%s",path, lessthanme);
-                printf("LOCKED by %s\n", last_child);
+    }
+	
+	// the prepare phase does not need the lock, so it runs
+	// while we connect. its output goes straight to our stdout
+	if (prepare) {
+        fflush(stdout);
+        zl_run_stats.prepare_ns = zl_stats_now();
+        prepf = popen(prepare, "w");
+        if (!prepf) {
+            exitcode = errno;
+            zl_run_stats.outcome = "prepare_failed";
+            fprintf(stderr, "Could not start prepare command\n");
+            goto exitnow;
+        }
+    }
+	
+	// a zoo-locked above us already holds the path, so its lock
+	// covers our task too and the backend is not asked at all
+	if (inherit) {
+        if (prepf) {
+            exitcode = exit_code(pclose(prepf));
+            prepf = NULL;
+            zl_stats_phase(PHASE_PREPARE, zl_run_stats.prepare_ns);
+            if (exitcode != 0) {
+                zl_run_stats.outcome = "prepare_failed";
+                fprintf(stderr, "Prepare failed with %d, not locking %s\n", exitcode, path);
                 goto exitnow;
-            } else {
-                // i got the lock
-                break;
             }
-            free_String_vector(vector);
-            return ZOK;
         }
-    }
-	if( count >= maxretry ) {
-        fprintf(stderr, "Too many retries while trying to lock %s\n", path);
+        zl_run_stats.outcome = "inherited";
+        id = strdup(inherited);
+        exitcode = run_task(commit);
         goto exitnow;
     }
 	
-	// check that it's locked
-	if(id == NULL || ownerid == NULL || (strcmp(id, ownerid) != 0)) {
+	// connect
+    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+	zl_run_stats.attempt_ns = zl_stats_now();
+	zb = open_level(engine, hosts, faults, recordfile);
+   	if( !zb ) {
+        exitcode = errno;
+        goto exitnow;
+    }
+    if (subcommand) {
+        gco.window = window;
+        if (strcmp(subcommand, "status") == 0) exitcode = lock_status(zb, path, window, stdout) == ZOK ? 0 : 1;
+        else exitcode = lock_gc(zb, path, &gco, stdout) == ZOK ? 0 : 1;
+        zb->ops->close(zb);
+        return exitcode;
+    }
+    zc = zl_wrap(zb, parent_flags);
+    if (!zc) {
+        exitcode = ENOMEM;
         goto exitnow;
     }
     
-    FILE *f = popen(argv[3], "r");
-    char tmp[512];
+    int ret = zl_lock_folder(zc, path);
+    // the synchronous calls above waited for the session
+    if (zb->connected_ns) zl_run_stats.phase_ns[PHASE_CONNECT] = zb->connected_ns - zl_run_stats.attempt_ns;
+	if (ret != ZOK) {
+        fprintf(stderr, "Could not create %s\n", path);
+        goto exitnow;
+    }
+    
+    // only take the lock once prepare is done, so that
+    // we hold it for the commit phase only
+    if (prepf) {
+        start = zl_stats_now();
+        exitcode = exit_code(pclose(prepf));
+        prepf = NULL;
+        zl_stats_phase(PHASE_PREPARE_WAIT, start);
+        zl_stats_phase(PHASE_PREPARE, zl_run_stats.prepare_ns);
+        if (exitcode != 0) {
+            zl_run_stats.outcome = "prepare_failed";
+            fprintf(stderr, "Prepare failed with %d, not locking %s\n", exitcode, path);
+            goto exitnow;
+        }
+    }
     
-    if(f){
-        while(fgets(tmp, sizeof(tmp), f)) printf("%s", tmp);
+    enum zl_result r = zl_lock_try(zc, path, &lock);
+    // the trace is written once the lock went with the session
+    if (lock && lock->id) id = strdup(lock->id);
+    if (lock && lock->owner) ownerid = strdup(lock->owner);
+    if (r == ZL_LOCKED) {
+        printf("LOCKED by %s/%s\n", path, lock->blocker);
+        zl_unlock(lock);
+        goto exitnow;
     }
+    if (r != ZL_ACQUIRED) goto exitnow;
     
-    exitcode = pclose(f) >> 8;
+    // with two levels, hosts is the ensemble in our datacenter and
+    // only its winner goes on to the global one, the same way
+    if (globalhosts) {
+        // the local lock is no run of the task yet
+        zl_run_stats.outcome = NULL;
+        locking = zl_run_stats.locking_ns;
+        gzb = open_level(engine, globalhosts, faults, recordfile);
+        if (!gzb) {
+            exitcode = errno;
+            goto exitnow;
+        }
+        gzc = zl_wrap(gzb, parent_flags);
+        if (!gzc) {
+            exitcode = ENOMEM;
+            goto exitnow;
+        }
+        if (zl_lock_folder(gzc, path) != ZOK) {
+            exitcode = EIO;
+            fprintf(stderr, "Could not create %s on %s\n", path, globalhosts);
+            goto exitnow;
+        }
+        r = zl_lock_try(gzc, path, &glock);
+        // queueing started on the local level
+        zl_run_stats.locking_ns = locking;
+        // the global level decides, so the trace names its nodes
+        if (glock && glock->id) {
+            free(id);
+            id = strdup(glock->id);
+        }
+        if (glock && glock->owner) {
+            free(ownerid);
+            ownerid = strdup(glock->owner);
+        }
+        if (r == ZL_LOCKED) {
+            printf("LOCKED by %s/%s on %s\n", path, glock->blocker, globalhosts);
+            zl_unlock(glock);
+            goto exitnow;
+        }
+        if (r != ZL_ACQUIRED) {
+            exitcode = EIO;
+            zl_run_stats.outcome = NULL;
+            fprintf(stderr, "Could not lock %s on %s\n", path, globalhosts);
+            goto exitnow;
+        }
+    }
+    
+    if (tracefile) trace_export();
+    inherit_export(engine, hosts, path, lock->id, zb->ops->session(zb));
+    exitcode = run_task(commit);
 
 exitnow:
-    zookeeper_close(zh);
+    // never leave a running prepare behind
+    if (prepf) pclose(prepf);
+    // the global lock goes first, so our datacenter's next
+    // winner finds it free
+    if (gzc) zl_close(gzc);
+    else if (gzb) gzb->ops->close(gzb);
+    if (zb) {
+        start = zl_stats_now();
+        // the lock goes with the session
+        if (zc) zl_close(zc);
+        else zb->ops->close(zb);
+        zl_stats_phase(PHASE_CLOSE, start);
+        PROBE2(session__closed, path, zl_run_stats.phase_ns[PHASE_CLOSE]);
+        zl_run_stats.released_ns = zl_stats_now();
+    }
+    // after the session, so the next one here finds the path free
+    prelock_release(localfd);
+    if (statsfd >= 0) zl_stats_write(statsfd, path, exitcode);
+    // an inherited run is part of the outer run's hold
+    if (metrics && !(zl_run_stats.outcome && strcmp(zl_run_stats.outcome, "inherited") == 0) && metrics_record(metrics, path) != 0) {
+        fprintf(stderr, "Could not update metrics in %s\n", metrics);
+    }
+    if (tracefile && trace_write(tracefile, path, id, ownerid) != 0) {
+        fprintf(stderr, "Could not write trace to %s\n", tracefile);
+    }
     return exitcode;
 }
 
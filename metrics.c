@@ -0,0 +1,290 @@
+/**
+ * prometheus textfile exporter for zoo-locked
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "metrics.h"
+
+#define METRICS_MAGIC 0x7a6c6d31    // "zlm1"
+#define METRICS_SLOTS 512
+#define METRICS_PATH_MAX 240
+
+// latency buckets are log-linear like HDR histograms: two sub-buckets
+// per power of two, from 16us up to ~275s. one more bucket is +Inf
+#define LAT_MIN_SHIFT 14
+#define LAT_OCTAVES 25
+#define LAT_BUCKETS (LAT_OCTAVES*2 + 1)
+// queue depth buckets are 0, 1, 2, 4, ... 65536, +Inf
+#define DEPTH_BUCKETS 19
+
+enum { OUT_ACQUIRED, OUT_LOCKED, OUT_PREPARE_FAILED, OUT_ERROR, OUT_COUNT };
+static const char *outcome_names[OUT_COUNT] = { "acquired", "locked", "prepare_failed", "error" };
+
+struct histogram {
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+struct depth_histogram {
+    uint64_t buckets[DEPTH_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+struct slot {
+    uint64_t hash;      // 0 while free, claimed with a CAS
+    uint32_t ready;     // path is valid
+    char path[METRICS_PATH_MAX];
+    uint64_t runs[OUT_COUNT];
+    uint64_t retries;
+    uint64_t zkerrors;
+    struct histogram acquire;
+    struct histogram hold;
+    struct depth_histogram depth;
+};
+
+struct state {
+    uint32_t magic;
+    uint32_t slots;
+    struct slot slot[METRICS_SLOTS];
+};
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;   // FNV-1a
+    for (; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static void add(uint64_t *counter, uint64_t v) {
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/** upper bound in ns of latency bucket i */
+static uint64_t lat_bound(int i) {
+    uint64_t base = 1ULL << (LAT_MIN_SHIFT + i/2);
+    return (i & 1) ? base + base/2 : base;
+}
+
+static void lat_observe(struct histogram *h, int64_t ns) {
+    int i;
+    if (ns < 0) return;
+    for (i = 0; i < LAT_BUCKETS-1 && (uint64_t)ns > lat_bound(i); i++);
+    add(&h->buckets[i], 1);
+    add(&h->count, 1);
+    add(&h->sum, ns);
+}
+
+static uint64_t depth_bound(int i) {
+    return i == 0 ? 0 : 1ULL << (i-1);
+}
+
+static void depth_observe(struct depth_histogram *h, int depth) {
+    int i;
+    for (i = 0; i < DEPTH_BUCKETS-1 && (uint64_t)depth > depth_bound(i); i++);
+    add(&h->buckets[i], 1);
+    add(&h->count, 1);
+    add(&h->sum, depth);
+}
+
+/**
+ * finds the slot for path, claiming a free one if needed.
+ * paths that do not fit anymore all share the last slot
+ */
+static struct slot* find_slot(struct state *st, const char *path) {
+    uint64_t h = hash_path(path);
+    int i, n;
+    
+    for (n = 0; n < METRICS_SLOTS-1; n++) {
+        struct slot *s = &st->slot[(h + n) % (METRICS_SLOTS-1)];
+        uint64_t cur = __atomic_load_n(&s->hash, __ATOMIC_ACQUIRE);
+        if (cur == 0) {
+            uint64_t expect = 0;
+            if (__atomic_compare_exchange_n(&s->hash, &expect, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                snprintf(s->path, sizeof(s->path), "%s", path);
+                __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+                return s;
+            }
+            cur = expect;
+        }
+        if (cur != h) continue;
+        // somebody else just claimed it, give them a moment to fill in the path
+        for (i = 0; i < 1000000 && !__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE); i++);
+        if (strncmp(s->path, path, sizeof(s->path)-1) == 0) return s;
+    }
+    
+    struct slot *other = &st->slot[METRICS_SLOTS-1];
+    uint64_t expect = 0;
+    if (__atomic_compare_exchange_n(&other->hash, &expect, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        snprintf(other->path, sizeof(other->path), "_other");
+        __atomic_store_n(&other->ready, 1, __ATOMIC_RELEASE);
+    }
+    return other;
+}
+
+static struct state* map_state(const char *file) {
+    int fd = open(file, O_RDWR|O_CREAT, 0644);
+    struct stat sb;
+    struct state *st;
+    
+    if (fd < 0) return NULL;
+    // growing to the same size from several processes at once is harmless
+    if (fstat(fd, &sb) != 0 || (sb.st_size < (off_t)sizeof(struct state) && ftruncate(fd, sizeof(struct state)) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    st = mmap(NULL, sizeof(struct state), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED) return NULL;
+    
+    uint32_t expect = 0;
+    if (__atomic_compare_exchange_n(&st->magic, &expect, METRICS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        st->slots = METRICS_SLOTS;
+    } else if (expect != METRICS_MAGIC) {
+        munmap(st, sizeof(struct state));
+        errno = EINVAL;
+        return NULL;
+    }
+    return st;
+}
+
+static void label_escaped(FILE *f, const char *str) {
+    for (; *str; str++) {
+        if (*str == '\\' || *str == '"') fprintf(f, "\\%c", *str);
+        else if (*str == '\n') fprintf(f, "\\n");
+        else fputc(*str, f);
+    }
+}
+
+static void write_lat(FILE *f, const char *name, const char *path, const struct histogram *h) {
+    uint64_t cum = 0;
+    int i;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        cum += get(&h->buckets[i]);
+        fprintf(f, "%s_bucket{path=\"", name);
+        label_escaped(f, path);
+        if (i < LAT_BUCKETS-1) fprintf(f, "\",le=\"%g\"} %llu\n", lat_bound(i) / 1e9, (unsigned long long)cum);
+        else fprintf(f, "\",le=\"+Inf\"} %llu\n", (unsigned long long)cum);
+    }
+    fprintf(f, "%s_sum{path=\"", name);
+    label_escaped(f, path);
+    fprintf(f, "\"} %.9f\n%s_count{path=\"", get(&h->sum) / 1e9, name);
+    label_escaped(f, path);
+    fprintf(f, "\"} %llu\n", (unsigned long long)get(&h->count));
+}
+
+static void write_depth(FILE *f, const char *name, const char *path, const struct depth_histogram *h) {
+    uint64_t cum = 0;
+    int i;
+    for (i = 0; i < DEPTH_BUCKETS; i++) {
+        cum += get(&h->buckets[i]);
+        fprintf(f, "%s_bucket{path=\"", name);
+        label_escaped(f, path);
+        if (i < DEPTH_BUCKETS-1) fprintf(f, "\",le=\"%llu\"} %llu\n", (unsigned long long)depth_bound(i), (unsigned long long)cum);
+        else fprintf(f, "\",le=\"+Inf\"} %llu\n", (unsigned long long)cum);
+    }
+    fprintf(f, "%s_sum{path=\"", name);
+    label_escaped(f, path);
+    fprintf(f, "\"} %llu\n%s_count{path=\"", (unsigned long long)get(&h->sum), name);
+    label_escaped(f, path);
+    fprintf(f, "\"} %llu\n", (unsigned long long)get(&h->count));
+}
+
+#define EACH_SLOT(st, s) \
+    for (s = &st->slot[0]; s < &st->slot[METRICS_SLOTS]; s++) \
+        if (__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE))
+
+/**
+ * writes the textfile to a temp file and renames it into
+ * place, so node_exporter never sees a half written file
+ */
+static int write_textfile(const char *textfile, struct state *st) {
+    int len = strlen(textfile) + 32;
+    char tmp[len];
+    struct slot *s;
+    FILE *f;
+    int i;
+    
+    snprintf(tmp, len, "%s.%d.tmp", textfile, (int)getpid());
+    f = fopen(tmp, "w");
+    if (!f) return errno;
+    
+    fprintf(f, "# HELP zoo_locked_runs_total Runs by lock path and outcome.\n# TYPE zoo_locked_runs_total counter\n");
+    EACH_SLOT(st, s) {
+        for (i = 0; i < OUT_COUNT; i++) {
+            fprintf(f, "zoo_locked_runs_total{path=\"");
+            label_escaped(f, s->path);
+            fprintf(f, "\",outcome=\"%s\"} %llu\n", outcome_names[i], (unsigned long long)get(&s->runs[i]));
+        }
+    }
+    fprintf(f, "# HELP zoo_locked_retries_total Retries while creating the folder, listing or locking.\n# TYPE zoo_locked_retries_total counter\n");
+    EACH_SLOT(st, s) {
+        fprintf(f, "zoo_locked_retries_total{path=\"");
+        label_escaped(f, s->path);
+        fprintf(f, "\"} %llu\n", (unsigned long long)get(&s->retries));
+    }
+    fprintf(f, "# HELP zoo_locked_zk_errors_total ZooKeeper calls that failed.\n# TYPE zoo_locked_zk_errors_total counter\n");
+    EACH_SLOT(st, s) {
+        fprintf(f, "zoo_locked_zk_errors_total{path=\"");
+        label_escaped(f, s->path);
+        fprintf(f, "\"} %llu\n", (unsigned long long)get(&s->zkerrors));
+    }
+    fprintf(f, "# HELP zoo_locked_acquire_seconds Time from connecting until the lock was acquired or found LOCKED.\n# TYPE zoo_locked_acquire_seconds histogram\n");
+    EACH_SLOT(st, s) write_lat(f, "zoo_locked_acquire_seconds", s->path, &s->acquire);
+    fprintf(f, "# HELP zoo_locked_hold_seconds Time the lock was held.\n# TYPE zoo_locked_hold_seconds histogram\n");
+    EACH_SLOT(st, s) write_lat(f, "zoo_locked_hold_seconds", s->path, &s->hold);
+    fprintf(f, "# HELP zoo_locked_queue_depth Lock nodes seen when the outcome was decided.\n# TYPE zoo_locked_queue_depth histogram\n");
+    EACH_SLOT(st, s) write_depth(f, "zoo_locked_queue_depth", s->path, &s->depth);
+    
+    if (fclose(f) != 0 || rename(tmp, textfile) != 0) {
+        int err = errno;
+        unlink(tmp);
+        return err;
+    }
+    return 0;
+}
+
+int metrics_record(const char *textfile, const char *path) {
+    int len = strlen(textfile) + 7;
+    char statefile[len];
+    struct state *st;
+    struct slot *s;
+    int ret;
+    
+    snprintf(statefile, len, "%s.state", textfile);
+    st = map_state(statefile);
+    if (!st) return errno;
+    
+    s = find_slot(st, path);
+    if (!zl_run_stats.outcome) add(&s->runs[OUT_ERROR], 1);
+    else if (strcmp(zl_run_stats.outcome, "acquired") == 0) add(&s->runs[OUT_ACQUIRED], 1);
+    else if (strcmp(zl_run_stats.outcome, "locked") == 0) add(&s->runs[OUT_LOCKED], 1);
+    else if (strcmp(zl_run_stats.outcome, "prepare_failed") == 0) add(&s->runs[OUT_PREPARE_FAILED], 1);
+    else add(&s->runs[OUT_ERROR], 1);
+    add(&s->retries, zl_run_stats.parent_retries + zl_run_stats.lock_retries + zl_run_stats.listing_retries);
+    add(&s->zkerrors, zl_run_stats.zkerrors);
+    lat_observe(&s->acquire, zl_stats_acquire_ns());
+    lat_observe(&s->hold, zl_stats_hold_ns());
+    if (zl_run_stats.decided_ns) depth_observe(&s->depth, zl_run_stats.children);
+    
+    ret = write_textfile(textfile, st);
+    munmap(st, sizeof(struct state));
+    return ret;
+}
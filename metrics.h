@@ -0,0 +1,18 @@
+/**
+ * prometheus textfile exporter for zoo-locked
+ *
+ * runs are aggregated in a small mmap'ed state file next to the
+ * textfile. all counters in there are updated with atomic adds,
+ * so concurrent wrappers never need to take a lock on it
+ */
+
+#ifndef ZOO_LOCKED_METRICS_H
+#define ZOO_LOCKED_METRICS_H
+
+/**
+ * adds the current run (see stats.h) to the state file
+ * textfile.state and rewrites textfile from it
+ */
+int metrics_record(const char *textfile, const char *path);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * host-local first stage for zoo-locked
+ *
+ * there is one file per lock path, named after the path with
+ * everything but [A-Za-z0-9._-] escaped as %XX. the files stay
+ * around, removing them would race with whoever just opened one
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "prelock.h"
+
+// leaves room below NAME_MAX, longer paths are hashed instead
+#define NAME_ESCAPED_MAX 200
+
+static int plain(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-';
+}
+
+static void file_name(const char *path, char *buf, int len) {
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned long long h = 1469598103934665603ULL;
+    const char *p;
+    int n = 0;
+    
+    for (p = path; *p && n + 3 < len && n + 3 < NAME_ESCAPED_MAX; p++) {
+        if (plain(*p)) {
+            buf[n++] = *p;
+        } else {
+            buf[n++] = '%';
+            buf[n++] = hex[(unsigned char)*p >> 4];
+            buf[n++] = hex[*p & 15];
+        }
+    }
+    if (!*p) {
+        buf[n] = 0;
+        return;
+    }
+    for (p = path; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    snprintf(buf, len, "h-%016llx", h);
+}
+
+int prelock_take(const char *dir, const char *path, int wait, long *holder) {
+    char name[NAME_ESCAPED_MAX + 8];
+    char file[4096], pid[24];
+    int fd, len, err;
+    
+    *holder = 0;
+    file_name(path, name, sizeof(name));
+    if (snprintf(file, sizeof(file), "%s/%s", dir, name) >= (int)sizeof(file)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    // the task must not keep the lock alive after we are gone
+    fd = open(file, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    while (flock(fd, wait ? LOCK_EX : LOCK_EX|LOCK_NB) != 0) {
+        if (errno == EINTR) continue;
+        err = errno;
+        if (err == EWOULDBLOCK) {
+            len = pread(fd, pid, sizeof(pid)-1, 0);
+            if (len > 0) {
+                pid[len] = 0;
+                *holder = atol(pid);
+            }
+        }
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    // losers only read it to name us, so failing here is harmless
+    len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+    if (ftruncate(fd, 0) == 0) len = pwrite(fd, pid, len, 0);
+    return fd;
+}
+
+void prelock_release(int fd) {
+    int ret;
+    
+    if (fd < 0) return;
+    // clear the pid first, a loser must not report a holder that left
+    ret = ftruncate(fd, 0);
+    (void)ret;
+    close(fd);
+}
@@ -0,0 +1,24 @@
+/**
+ * host-local first stage for zoo-locked
+ *
+ * processes on one host that want the same path settle it among
+ * themselves with an flock on a file under a local directory, and
+ * only the winner goes on to the ensemble. contention there then
+ * grows with hosts instead of processes
+ */
+
+#ifndef ZOO_LOCKED_PRELOCK_H
+#define ZOO_LOCKED_PRELOCK_H
+
+/**
+ * takes the local lock on path below dir, waiting for it if wait is
+ * set. returns the fd holding it, or -1 with errno set. EWOULDBLOCK
+ * means another process on this host has it, *holder is its pid
+ * then (0 if it has not written it yet)
+ */
+int prelock_take(const char *dir, const char *path, int wait, long *holder);
+
+/** gives the local lock up again */
+void prelock_release(int fd);
+
+#endif
@@ -0,0 +1,20 @@
+/**
+ * USDT tracepoints for zoo-locked
+ *
+ * with systemtap's sys/sdt.h available every probe is a single nop
+ * until a tracer attaches. without it (or with NO_USDT) they vanish
+ */
+
+#ifndef ZOO_LOCKED_PROBES_H
+#define ZOO_LOCKED_PROBES_H
+
+#if !defined(NO_USDT) && (defined(HAVE_SYS_SDT_H) || (defined(__has_include) && __has_include(<sys/sdt.h>)))
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(zoo_locked, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(zoo_locked, name, a, b)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#endif
+
+#endif
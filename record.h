@@ -0,0 +1,62 @@
+/**
+ * the binary trace written by --record and read by zkreplay
+ *
+ * a trace is a plain sequence of entries in host byte order, the
+ * magic tells when a file came from a machine of the other order.
+ * every process appends whole buffers of entries with O_APPEND, so
+ * many runs can share one file and files of a fleet can simply be
+ * concatenated or given to zkreplay together
+ */
+
+#ifndef ZOO_LOCKED_RECORD_H
+#define ZOO_LOCKED_RECORD_H
+
+#include <stdint.h>
+
+#define RECORD_MAGIC 0x725a
+
+// the ZooKeeper opcodes recorded, proto.h has them too
+#ifndef ZOO_CREATE_OP
+#define ZOO_CREATE_OP 1
+#define ZOO_DELETE_OP 2
+#define ZOO_SETDATA_OP 5
+#define ZOO_CHECK_OP 13
+#endif
+#ifndef ZOO_EXISTS_OP
+#define ZOO_EXISTS_OP 3
+#define ZOO_GETCHILDREN_OP 8
+#define ZOO_MULTI_OP 14
+#endif
+
+// op of the entries that are not a ZooKeeper request
+#define RECORD_OPEN -10     // the session came up, like createSession
+#define RECORD_CLOSE -11    // the session was closed, like closeSession
+#define RECORD_EVENT -1     // a watch fired, like a notification
+
+// flags, the low bits are the create flags
+#define RECORD_EPHEMERAL 1
+#define RECORD_SEQUENCE 2
+#define RECORD_WATCH 4      // an exists or listing that leaves a watch behind
+#define RECORD_IN_MULTI 8   // one op of the multi entry before it
+
+struct record_entry {
+    uint16_t magic;
+    uint16_t size;          // of the entry with its paths, a multiple of 8
+    int8_t op;              // ZooKeeper opcode or one of the RECORD_ ops
+    uint8_t flags;
+    uint16_t pathlen;       // the path follows the entry, without its 0
+    uint16_t createdlen;    // then the path a create got, if it got one
+    uint16_t reserved;
+    int32_t result;         // ZooKeeper error code
+    uint32_t latency_us;
+    uint32_t children;      // size of a listing, ops in a multi
+    int32_t arg;            // value length of a create, version of a delete or check
+    uint32_t reserved2;
+    int64_t start_ns;       // CLOCK_REALTIME, comparable across hosts
+    int64_t session;
+};
+
+#define RECORD_SIZE(pathlen, createdlen) \
+    ((sizeof(struct record_entry) + (pathlen) + (createdlen) + 7) & ~(size_t)7)
+
+#endif
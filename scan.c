@@ -0,0 +1,169 @@
+/**
+ * pipelined walk over lock folders, see scan.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zookeeper.h>
+
+#include "scan.h"
+#include "children.h"
+
+void window_init(struct window *w, int max) {
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->inflight = 0;
+    w->max = max > 0 ? max : 1;
+}
+
+void window_destroy(struct window *w) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+}
+
+void window_enter(struct window *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->inflight >= w->max) pthread_cond_wait(&w->cond, &w->lock);
+    w->inflight++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+void window_leave(struct window *w) {
+    pthread_mutex_lock(&w->lock);
+    w->inflight--;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void window_wait(struct window *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->inflight > 0) pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+char* child_path(const char *prefix, const char *name) {
+    size_t len = strlen(prefix);
+    char *path;
+    // the children of / do not get a double slash
+    if (len && prefix[len - 1] == '/') len--;
+    path = malloc(len + strlen(name) + 2);
+    if (!path) return NULL;
+    memcpy(path, prefix, len);
+    path[len] = '/';
+    strcpy(path + len + 1, name);
+    return path;
+}
+
+struct scan {
+    struct window w;        // its lock guards the rest too
+    char **todo;            // folders still to list
+    int ntodo;
+    int captodo;
+    struct lock_dir *dirs;
+    int ndirs;
+    int capdirs;
+    int error;
+};
+
+static void push_todo(struct scan *s, char *path) {
+    if (!path) return;
+    if (s->ntodo == s->captodo) {
+        s->captodo = s->captodo ? s->captodo * 2 : 256;
+        s->todo = realloc(s->todo, s->captodo * sizeof(char*));
+    }
+    s->todo[s->ntodo++] = path;
+}
+
+/** one listing came back, runs on the client's thread */
+static void listed(struct backend *b, int rc, const char *path,
+                   const struct String_vector *children, const struct Stat *stat, void *ctx) {
+    struct scan *s = (struct scan*)ctx;
+    struct String_vector locks = { 0, NULL };
+    int i;
+
+    if (rc == ZOK && children->count) locks.data = malloc(children->count * sizeof(char*));
+    pthread_mutex_lock(&s->w.lock);
+    if (rc == ZOK) {
+        for (i = 0; i < children->count; i++) {
+            if (is_lock_node(children->data[i])) {
+                if (locks.data) locks.data[locks.count++] = strdup(children->data[i]);
+            } else {
+                push_todo(s, child_path(path, children->data[i]));
+            }
+        }
+        if (locks.count || !children->count) {
+            struct lock_dir *d;
+            if (s->ndirs == s->capdirs) {
+                s->capdirs = s->capdirs ? s->capdirs * 2 : 256;
+                s->dirs = realloc(s->dirs, s->capdirs * sizeof(struct lock_dir));
+            }
+            d = &s->dirs[s->ndirs++];
+            d->path = strdup(path);
+            d->children = locks;
+            d->stat = *stat;
+            sort_children(&d->children);
+            locks.data = NULL;
+        }
+    } else if (rc != ZNONODE && !s->error) {
+        // a folder gone since its parent was listed is no error
+        s->error = rc;
+    }
+    s->w.inflight--;
+    pthread_cond_broadcast(&s->w.cond);
+    pthread_mutex_unlock(&s->w.lock);
+    free(locks.data);
+}
+
+static int cmp_dir(const void *a, const void *b) {
+    return strcmp(((const struct lock_dir*)a)->path, ((const struct lock_dir*)b)->path);
+}
+
+int scan_locks(struct backend *b, const char *prefix, int window,
+               struct lock_dir **dirs, int *count) {
+    struct scan s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+    window_init(&s.w, window);
+    push_todo(&s, strdup(prefix));
+    pthread_mutex_lock(&s.w.lock);
+    for (;;) {
+        char *path;
+        // more folders only turn up while listings are out
+        while (!s.ntodo && s.w.inflight) pthread_cond_wait(&s.w.cond, &s.w.lock);
+        if (!s.ntodo) break;
+        if (s.w.inflight >= s.w.max) {
+            pthread_cond_wait(&s.w.cond, &s.w.lock);
+            continue;
+        }
+        path = s.todo[--s.ntodo];
+        s.w.inflight++;
+        pthread_mutex_unlock(&s.w.lock);
+        // engines without pipelining call listed before this returns
+        ret = backend_aget_children(b, path, listed, &s);
+        free(path);
+        pthread_mutex_lock(&s.w.lock);
+        if (ret != ZOK) {
+            s.w.inflight--;
+            if (!s.error) s.error = ret;
+        }
+    }
+    pthread_mutex_unlock(&s.w.lock);
+    window_destroy(&s.w);
+    free(s.todo);
+
+    qsort(s.dirs, s.ndirs, sizeof(struct lock_dir), cmp_dir);
+    *dirs = s.dirs;
+    *count = s.ndirs;
+    return s.error;
+}
+
+void free_lock_dirs(struct lock_dir *dirs, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        free(dirs[i].path);
+        free_String_vector(&dirs[i].children);
+    }
+    free(dirs);
+}
@@ -0,0 +1,51 @@
+/**
+ * walks over all lock folders under a prefix
+ *
+ * a sequential walk pays one round trip per folder, which for
+ * thousands of locks takes minutes. the walk here keeps a window
+ * of listings in flight instead, on engines with pipelined calls
+ */
+
+#ifndef ZOO_LOCKED_SCAN_H
+#define ZOO_LOCKED_SCAN_H
+
+#include <pthread.h>
+#include "backend.h"
+
+/** at most max calls in flight, for callers that pipeline their own */
+struct window {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int inflight;
+    int max;
+};
+
+void window_init(struct window *w, int max);
+void window_destroy(struct window *w);
+/** waits for a free slot and takes it */
+void window_enter(struct window *w);
+/** gives the slot back, from the completion */
+void window_leave(struct window *w);
+/** waits until no call is in flight anymore */
+void window_wait(struct window *w);
+
+struct lock_dir {
+    char *path;
+    struct String_vector children;  // the lock nodes, sorted
+    struct Stat stat;               // of the folder
+};
+
+/**
+ * finds every lock folder under prefix, prefix included: folders
+ * with lock nodes in them and empty ones. *dirs is sorted by path.
+ * returns ZOK or the first error, *dirs has what was found anyway
+ */
+int scan_locks(struct backend *b, const char *prefix, int window,
+               struct lock_dir **dirs, int *count);
+
+void free_lock_dirs(struct lock_dir *dirs, int count);
+
+/** prefix/name, malloc'ed */
+char* child_path(const char *prefix, const char *name);
+
+#endif
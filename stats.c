@@ -0,0 +1,115 @@
+/**
+ * per-run phase timing for zoo-locked
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zookeeper.h>
+
+#include "stats.h"
+
+__thread struct run_stats zl_run_stats;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "connect", "parent", "create", "sort", "prepare",
+    "prepare_wait", "spawn", "child", "close"
+};
+
+int64_t zl_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void zl_stats_phase(enum stats_phase phase, int64_t start) {
+    zl_run_stats.phase_ns[phase] += zl_stats_now() - start;
+}
+
+int64_t zl_stats_acquire_ns(void) {
+    if (!zl_run_stats.decided_ns) return -1;
+    return zl_run_stats.decided_ns - zl_run_stats.attempt_ns - zl_run_stats.phase_ns[PHASE_PREPARE_WAIT];
+}
+
+int64_t zl_stats_hold_ns(void) {
+    if (!zl_run_stats.released_ns || !zl_run_stats.outcome || strcmp(zl_run_stats.outcome, "acquired") != 0)
+        return -1;
+    return zl_run_stats.released_ns - zl_run_stats.decided_ns;
+}
+
+void zl_stats_listing(int64_t start, const struct String_vector *vector) {
+    int64_t took = zl_stats_now() - start;
+    int32_t i;
+    
+    if (zl_run_stats.listings < STATS_MAX_LISTINGS)
+        zl_run_stats.listing_ns[zl_run_stats.listings] = took;
+    zl_run_stats.listings++;
+    if (vector->data) {
+        zl_run_stats.children = vector->count;
+        // jute encoding: vector length, then length prefixed strings
+        zl_run_stats.bytes += 4;
+        for (i = 0; i < vector->count; i++) {
+            zl_run_stats.bytes += 4 + strlen(vector->data[i]);
+        }
+    }
+}
+
+/**
+ * appends str as a JSON string, escaping what needs it
+ */
+static int json_string(char *buf, int len, const char *str) {
+    int n = 0;
+    
+    if (n < len) buf[n] = '"';
+    n++;
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            if (n+1 < len) { buf[n] = '\\'; buf[n+1] = c; }
+            n += 2;
+        } else if (c < 0x20) {
+            if (n+6 < len) snprintf(buf+n, 7, "\\u%04x", c);
+            n += 6;
+        } else {
+            if (n < len) buf[n] = c;
+            n++;
+        }
+    }
+    if (n < len) buf[n] = '"';
+    n++;
+    return n;
+}
+
+int zl_stats_write(int fd, const char *path, int exitcode) {
+    char line[4096];
+    int len = sizeof(line) - 2;
+    int n = 0;
+    int i;
+    
+#define OUT(...) do { n += snprintf(line+n, n < len ? len-n : 0, __VA_ARGS__); } while (0)
+    OUT("{\"time\":%lld,\"path\":", (long long)time(NULL));
+    if (n < len) n += json_string(line+n, len-n, path);
+    OUT(",\"outcome\":\"%s\",\"exit\":%d,\"total_ns\":%lld,\"acquire_ns\":%lld,\"hold_ns\":%lld",
+        zl_run_stats.outcome ? zl_run_stats.outcome : "error", exitcode,
+        (long long)(zl_stats_now() - zl_run_stats.start_ns),
+        (long long)zl_stats_acquire_ns(), (long long)zl_stats_hold_ns());
+    for (i = 0; i < PHASE_COUNT; i++) {
+        OUT(",\"%s_ns\":%lld", phase_names[i], (long long)zl_run_stats.phase_ns[i]);
+    }
+    OUT(",\"getchildren_ns\":[");
+    for (i = 0; i < zl_run_stats.listings && i < STATS_MAX_LISTINGS; i++) {
+        OUT("%s%lld", i ? "," : "", (long long)zl_run_stats.listing_ns[i]);
+    }
+    OUT("],\"getchildren\":%d,\"parent_retries\":%d,\"lock_retries\":%d,"
+        "\"getchildren_retries\":%d,\"children\":%d,\"bytes\":%lld,\"zk_errors\":%d}",
+        zl_run_stats.listings, zl_run_stats.parent_retries, zl_run_stats.lock_retries,
+        zl_run_stats.listing_retries, zl_run_stats.children, (long long)zl_run_stats.bytes, zl_run_stats.zkerrors);
+#undef OUT
+    if (n >= len) return ENOBUFS;
+    line[n++] = '\n';
+    
+    if (write(fd, line, n) != n) return errno;
+    return 0;
+}
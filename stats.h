@@ -0,0 +1,81 @@
+/**
+ * per-run phase timing for zoo-locked
+ *
+ * every phase is timed with CLOCK_MONOTONIC and the whole run
+ * is written out as a single JSON line when it ends
+ */
+
+#ifndef ZOO_LOCKED_STATS_H
+#define ZOO_LOCKED_STATS_H
+
+#include <stdint.h>
+
+struct String_vector;
+
+enum stats_phase {
+    PHASE_CONNECT,      // zookeeper_init until the session is connected
+    PHASE_PARENT,       // zoo_exists/zoo_create loop for the lock folder
+    PHASE_CREATE,       // zoo_create of our ephemeral sequence node
+    PHASE_SORT,         // sort_children and child_floor
+    PHASE_PREPARE,      // prepare command, start to exit
+    PHASE_PREPARE_WAIT, // time spent waiting for prepare after connecting
+    PHASE_SPAWN,        // popen of the task
+    PHASE_CHILD,        // task start until it exited
+    PHASE_CLOSE,        // zookeeper_close
+    PHASE_COUNT
+};
+
+#define STATS_MAX_LISTINGS 32
+
+struct run_stats {
+    int64_t start_ns;
+    int64_t prepare_ns;     // prepare command was started
+    int64_t attempt_ns;     // zookeeper_init was called
+    int64_t locking_ns;     // lock loop started
+    int64_t decided_ns;     // we know if we got the lock
+    int64_t released_ns;    // session closed, lock released
+    int64_t spawned_ns;     // task is running
+    int64_t phase_ns[PHASE_COUNT];
+    int64_t listing_ns[STATS_MAX_LISTINGS]; // each zoo_get_children
+    int listings;
+    int parent_retries;
+    int lock_retries;
+    int listing_retries;    // ZCONNECTIONLOSS retries in retry_getchildren
+    int children;           // size of the last child list
+    int64_t bytes;          // payload bytes of all replies we decoded
+    int zkerrors;
+    const char *outcome;
+};
+
+/**
+ * per thread, so that the library can lock from many at once. it is
+ * never reset, a thread that locks over and over keeps adding to it
+ * and clears it itself if it wants the numbers of one call
+ */
+extern __thread struct run_stats zl_run_stats;
+
+/** monotonic clock in nanoseconds */
+int64_t zl_stats_now(void);
+
+/** adds the time since start to a phase */
+void zl_stats_phase(enum stats_phase phase, int64_t start);
+
+/**
+ * time from connecting until we knew the lock outcome, not
+ * counting the wait for prepare. -1 if we never got that far
+ */
+int64_t zl_stats_acquire_ns(void);
+
+/** time the lock was held for, -1 if it was not acquired */
+int64_t zl_stats_hold_ns(void);
+
+/** records one child listing and what it returned */
+void zl_stats_listing(int64_t start, const struct String_vector *vector);
+
+/**
+ * writes the run as one JSON line. the line is written with
+ * a single write so concurrent runs can share an O_APPEND file
+ */
+int zl_stats_write(int fd, const char *path, int exitcode);
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * zoo-locked status, an inventory of all locks under a prefix
+ *
+ * one line per lock folder: how many contenders are queued, who
+ * holds it, since when and what its node says. the folders are
+ * listed with scan_locks, the owner nodes read with the same
+ * window of calls in flight
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zookeeper.h>
+
+#include "status.h"
+#include "scan.h"
+#include "stats.h"
+
+#define MAX_SHOWN_DATA 64
+
+struct owner {
+    struct window *w;
+    int rc;
+    struct Stat stat;
+    char data[MAX_SHOWN_DATA + 1];
+};
+
+static void owner_read(struct backend *b, int rc, const char *path,
+                       const char *value, int valuelen, const struct Stat *stat, void *ctx) {
+    struct owner *o = (struct owner*)ctx;
+    int i;
+    o->rc = rc;
+    o->stat = *stat;
+    if (valuelen > MAX_SHOWN_DATA) valuelen = MAX_SHOWN_DATA;
+    for (i = 0; value && i < valuelen; i++) {
+        o->data[i] = value[i] >= ' ' && value[i] < 127 ? value[i] : '.';
+    }
+    o->data[i > 0 ? i : 0] = 0;
+    window_leave(o->w);
+}
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int lock_status(struct backend *zb, const char *prefix, int window, FILE *out) {
+    int64_t start = zl_stats_now(), now;
+    struct lock_dir *dirs;
+    struct owner *owners;
+    struct window w;
+    int count, ret, i, held = 0, queued = 0;
+
+    ret = scan_locks(zb, prefix, window, &dirs, &count);
+    if (ret != ZOK) fprintf(stderr, "Could not list everything under %s: %s\n", prefix, zerror(ret));
+
+    owners = calloc(count ? count : 1, sizeof(struct owner));
+    if (!owners) {
+        free_lock_dirs(dirs, count);
+        return ZSYSTEMERROR;
+    }
+    window_init(&w, window);
+    for (i = 0; i < count; i++) {
+        char *path;
+        owners[i].w = &w;
+        owners[i].rc = ZNONODE;
+        if (!dirs[i].children.count) continue;
+        path = child_path(dirs[i].path, dirs[i].children.data[0]);
+        window_enter(&w);
+        if (!path || backend_aget(zb, path, owner_read, &owners[i]) != ZOK) window_leave(&w);
+        free(path);
+    }
+    window_wait(&w);
+    window_destroy(&w);
+
+    now = wall_ms();
+    fprintf(out, "%-40s %6s  %-30s %16s %10s  %s\n", "lock", "queue", "owner", "session", "held_s", "data");
+    for (i = 0; i < count; i++) {
+        struct lock_dir *d = &dirs[i];
+        struct owner *o = &owners[i];
+        if (!d->children.count) {
+            fprintf(out, "%-40s %6d  %-30s %16s %10s\n", d->path, 0, "-", "-", "-");
+            continue;
+        }
+        held++;
+        queued += d->children.count - 1;
+        // the session is in the name, the engine may not know it
+        fprintf(out, "%-40s %6d  %-30s %16.16s", d->path, d->children.count,
+                d->children.data[0], d->children.data[0] + 2);
+        if (o->rc == ZOK && o->stat.ctime > 0) fprintf(out, " %10.1f", (now - o->stat.ctime) / 1000.0);
+        else fprintf(out, " %10s", o->rc == ZOK ? "-" : "gone");
+        fprintf(out, "  %s\n", o->data);
+    }
+    fprintf(stderr, "%d locks, %d held, %d waiting, listed in %.3fs\n",
+            count, held, queued, (zl_stats_now() - start) / 1e9);
+
+    free(owners);
+    free_lock_dirs(dirs, count);
+    return ret;
+}
@@ -0,0 +1,18 @@
+/**
+ * zoo-locked status: lists every lock under a prefix with its queue
+ * and owner
+ */
+
+#ifndef ZOO_LOCKED_STATUS_H
+#define ZOO_LOCKED_STATUS_H
+
+#include <stdio.h>
+#include "backend.h"
+
+/**
+ * prints one line per lock folder under prefix to out, with window
+ * calls in flight. returns ZOK or the first error
+ */
+int lock_status(struct backend *zb, const char *prefix, int window, FILE *out);
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * the jute encoding of the ZooKeeper wire protocol, for the tools
+ * that speak it without the C client. big endian integers, strings
+ * and buffers prefixed with their length, -1 for null
+ */
+
+#ifndef ZOO_LOCKED_JUTE_H
+#define ZOO_LOCKED_JUTE_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+// opcodes
+#define OP_NOTIFY 0
+#define OP_CREATE 1
+#define OP_DELETE 2
+#define OP_EXISTS 3
+#define OP_GETDATA 4
+#define OP_SETDATA 5
+#define OP_GETACL 6
+#define OP_GETCHILDREN 8
+#define OP_SYNC 9
+#define OP_PING 11
+#define OP_GETCHILDREN2 12
+#define OP_CHECK 13
+#define OP_MULTI 14
+#define OP_CREATE2 15
+#define OP_CREATE_CONTAINER 19
+#define OP_DELETE_CONTAINER 20
+#define OP_CREATE_TTL 21
+#define OP_CREATE_SESSION -10
+#define OP_CLOSE -11
+#define OP_SETAUTH 100
+#define OP_SETWATCHES 101
+#define OP_ERROR -1
+
+// error codes
+#define ZOK 0
+#define ZRUNTIMEINCONSISTENCY -2
+#define ZMARSHALLINGERROR -5
+#define ZUNIMPLEMENTED -6
+#define ZBADARGUMENTS -8
+#define ZNONODE -101
+#define ZBADVERSION -103
+#define ZNOCHILDRENFOREPHEMERALS -108
+#define ZNODEEXISTS -110
+#define ZNOTEMPTY -111
+
+// create flags
+#define FLAG_EPHEMERAL 1
+#define FLAG_SEQUENCE 2
+
+// watch events
+#define EV_CREATED 1
+#define EV_DELETED 2
+#define EV_CHANGED 3
+#define EV_CHILD 4
+#define STATE_CONNECTED 3
+
+#define MAX_PACKET (1024*1024)
+
+struct ibuf {
+    const unsigned char *p;
+    int left;
+    int bad;
+};
+
+struct obuf {
+    char *data;
+    int len;
+    int cap;
+};
+
+static inline int32_t get_int(struct ibuf *b) {
+    int32_t v;
+    if (b->left < 4) { b->bad = 1; return 0; }
+    v = (int32_t)((uint32_t)b->p[0] << 24 | (uint32_t)b->p[1] << 16 | (uint32_t)b->p[2] << 8 | b->p[3]);
+    b->p += 4;
+    b->left -= 4;
+    return v;
+}
+
+static inline int64_t get_long(struct ibuf *b) {
+    uint64_t hi = (uint32_t)get_int(b);
+    uint64_t lo = (uint32_t)get_int(b);
+    return (int64_t)(hi << 32 | lo);
+}
+
+static inline int get_bool(struct ibuf *b) {
+    if (b->left < 1) { b->bad = 1; return 0; }
+    b->left--;
+    return *b->p++ != 0;
+}
+
+/** buffers and strings share the encoding. returns the length, -1 for null */
+static inline int get_buffer(struct ibuf *b, char **out) {
+    int32_t len = get_int(b);
+    *out = NULL;
+    if (len < 0 || b->bad) return -1;
+    if (len > b->left) { b->bad = 1; return -1; }
+    *out = malloc(len + 1);
+    if (!*out) { b->bad = 1; return -1; }
+    memcpy(*out, b->p, len);
+    (*out)[len] = 0;
+    b->p += len;
+    b->left -= len;
+    return len;
+}
+
+/** like get_buffer, but points into b instead of copying */
+static inline int get_ref(struct ibuf *b, const char **out) {
+    int32_t len = get_int(b);
+    *out = NULL;
+    if (len < 0 || b->bad) return -1;
+    if (len > b->left) { b->bad = 1; return -1; }
+    *out = (const char*)b->p;
+    b->p += len;
+    b->left -= len;
+    return len;
+}
+
+static inline char* get_string(struct ibuf *b) {
+    char *s;
+    get_buffer(b, &s);
+    return s;
+}
+
+static inline void put_raw(struct obuf *b, const void *data, int len) {
+    if (b->len + len > b->cap) {
+        int cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len) cap *= 2;
+        b->data = realloc(b->data, cap);
+        if (!b->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static inline void put_int(struct obuf *b, int32_t v) {
+    uint32_t n = htonl((uint32_t)v);
+    put_raw(b, &n, 4);
+}
+
+static inline void put_long(struct obuf *b, int64_t v) {
+    put_int(b, (int32_t)((uint64_t)v >> 32));
+    put_int(b, (int32_t)v);
+}
+
+static inline void put_bool(struct obuf *b, int v) {
+    char c = v ? 1 : 0;
+    put_raw(b, &c, 1);
+}
+
+static inline void put_buffer(struct obuf *b, const char *data, int len) {
+    put_int(b, data ? len : -1);
+    if (data) put_raw(b, data, len);
+}
+
+static inline void put_string(struct obuf *b, const char *s) {
+    put_buffer(b, s, s ? strlen(s) : 0);
+}
+
+#endif
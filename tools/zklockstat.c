@@ -0,0 +1,755 @@
+/**
+ * zklockstat - lock contention from ZooKeeper snapshots and txn logs
+ *
+ * reads the files of a server's dataDir directly, no ensemble
+ * involved, and follows the x-<session>-<sequence> nodes of the lock
+ * recipe through them: who queued where, who got the lock when and
+ * for how long. prints the most contended locks, with how often a
+ * try came back LOCKED, and the sessions that held locks longest
+ *
+ * the logs are mapped and read front to back once, pages behind the
+ * cursor are dropped again. only the live queues and sessions are
+ * kept, the hold times go into a histogram per lock, so memory grows
+ * with the number of lock folders and not with the length of the logs
+ *
+ * a snapshot gives the queues at its start, holds already running
+ * then are not counted. without one the first holds of each lock may
+ * be missed. snapshots are fuzzy, so creates of nodes already there
+ * and deletes of nodes not there are skipped
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jute.h"
+
+#define LOG_MAGIC 0x5a4b4c47        // ZKLG
+#define SNAP_MAGIC 0x5a4b534e       // ZKSN
+#define FILE_HEADER 16
+#define EOR 'B'
+#define BUCKETS 64                  // two per doubling of the hold time in ms
+#define DROP_BEHIND (64 << 20)
+
+static const char *opt_prefix = "/";
+static int opt_top = 10;
+static int64_t opt_since = 0;
+static int64_t opt_until = INT64_MAX;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------- */
+/* state                                                            */
+
+struct lnode {
+    int64_t seq;
+    int64_t session;
+    int64_t created_ms;
+    int64_t owner_ms;       // since when it holds the lock, -1 for unknown
+};
+
+struct lock {
+    struct lock *next;      // in its hash bucket
+    char *path;
+    struct lnode *queue;    // live nodes by sequence, the owner first
+    int nqueue;
+    int capqueue;
+    int64_t attempts;       // nodes created
+    int64_t locked;         // of those into a queue somebody was in
+    int64_t acquired;
+    int64_t qsum;           // queue lengths seen by the attempts
+    int maxq;
+    int64_t wait_sum;       // ms from create to owner
+    int64_t hold_sum;
+    int64_t hold_max;
+    uint32_t holds[BUCKETS];
+};
+
+struct sess {
+    struct sess *next;
+    int64_t id;
+    struct lock **locks;    // one entry per live node
+    int nlocks;
+    int caplocks;
+    int64_t acquired;
+    int64_t hold_sum;
+    int64_t hold_max;
+};
+
+static struct lock **locks;
+static size_t nlocks, caplocks;
+static struct sess **sessions;
+static size_t nsessions, capsessions;
+static struct sess *top;    // the sessions done with, longest held first
+static int ntop;
+
+static int64_t records, lock_txns, skipped, first_ms, last_ms;
+static int64_t last_zxid = -1;
+static uint32_t all_holds[BUCKETS];
+static int64_t all_acquired, all_attempts, all_locked;
+
+static void* xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t hash_path(const char *s, int len) {
+    uint64_t h = 14695981039346656037ULL;
+    while (len--) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t hash_id(int64_t id) {
+    uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+    return h ^ h >> 29;
+}
+
+static struct lock* find_lock(const char *path, int len, int add) {
+    struct lock **slot, *l;
+    size_t i;
+
+    if (add && nlocks >= caplocks) {
+        size_t cap = caplocks ? caplocks * 2 : 1024;
+        struct lock **grown = calloc(cap, sizeof(struct lock*));
+        if (!grown) xrealloc(NULL, SIZE_MAX);
+        for (i = 0; i < caplocks; i++) {
+            while ((l = locks[i])) {
+                locks[i] = l->next;
+                slot = &grown[hash_path(l->path, strlen(l->path)) & (cap - 1)];
+                l->next = *slot;
+                *slot = l;
+            }
+        }
+        free(locks);
+        locks = grown;
+        caplocks = cap;
+    }
+    if (!caplocks) return NULL;
+    slot = &locks[hash_path(path, len) & (caplocks - 1)];
+    for (l = *slot; l; l = l->next) {
+        if (strncmp(l->path, path, len) == 0 && l->path[len] == 0) return l;
+    }
+    if (!add) return NULL;
+    l = xrealloc(NULL, sizeof(struct lock));
+    memset(l, 0, sizeof(struct lock));
+    l->path = xrealloc(NULL, len + 1);
+    memcpy(l->path, path, len);
+    l->path[len] = 0;
+    l->next = *slot;
+    *slot = l;
+    nlocks++;
+    return l;
+}
+
+static struct sess* find_sess(int64_t id, int add) {
+    struct sess **slot, *s;
+    size_t i;
+
+    if (add && nsessions >= capsessions) {
+        size_t cap = capsessions ? capsessions * 2 : 1024;
+        struct sess **grown = calloc(cap, sizeof(struct sess*));
+        if (!grown) xrealloc(NULL, SIZE_MAX);
+        for (i = 0; i < capsessions; i++) {
+            while ((s = sessions[i])) {
+                sessions[i] = s->next;
+                slot = &grown[hash_id(s->id) & (cap - 1)];
+                s->next = *slot;
+                *slot = s;
+            }
+        }
+        free(sessions);
+        sessions = grown;
+        capsessions = cap;
+    }
+    if (!capsessions) return NULL;
+    slot = &sessions[hash_id(id) & (capsessions - 1)];
+    for (s = *slot; s; s = s->next) {
+        if (s->id == id) return s;
+    }
+    if (!add) return NULL;
+    s = xrealloc(NULL, sizeof(struct sess));
+    memset(s, 0, sizeof(struct sess));
+    s->id = id;
+    s->next = *slot;
+    *slot = s;
+    nsessions++;
+    return s;
+}
+
+/** takes s out of the table and keeps it if it is among the top */
+static void retire_sess(struct sess *s) {
+    struct sess **slot = &sessions[hash_id(s->id) & (capsessions - 1)];
+    int i;
+
+    while (*slot != s) slot = &(*slot)->next;
+    *slot = s->next;
+    nsessions--;
+    free(s->locks);
+    if (!s->acquired || opt_top <= 0) {
+        free(s);
+        return;
+    }
+    if (!top) top = xrealloc(NULL, opt_top * sizeof(struct sess));
+    if (ntop == opt_top && top[ntop - 1].hold_sum >= s->hold_sum) {
+        free(s);
+        return;
+    }
+    if (ntop < opt_top) ntop++;
+    for (i = ntop - 1; i > 0 && top[i - 1].hold_sum < s->hold_sum; i--) top[i] = top[i - 1];
+    top[i] = *s;
+    free(s);
+}
+
+static int bucket(int64_t ms) {
+    int b;
+    if (ms < 1) return 0;
+    b = (int)(2 * log2((double)ms)) + 1;
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+/** the middle of a bucket in ms */
+static double bucket_ms(int b) {
+    return b ? pow(2, (b - 0.5) / 2) : 0.5;
+}
+
+static double percentile(const uint32_t *h, int64_t n, double p) {
+    int64_t want = (int64_t)ceil(n * p), seen = 0;
+    int b;
+    if (n <= 0) return 0;
+    if (want < 1) want = 1;
+    for (b = 0; b < BUCKETS; b++) {
+        seen += h[b];
+        if (seen >= want) return bucket_ms(b);
+    }
+    return bucket_ms(BUCKETS - 1);
+}
+
+static int counting(int64_t ms) {
+    return ms >= opt_since && ms < opt_until;
+}
+
+/** the queue of l got a new head at ms */
+static void new_owner(struct lock *l, int64_t ms) {
+    struct lnode *n = &l->queue[0];
+    n->owner_ms = ms;
+    if (!counting(ms)) return;
+    l->acquired++;
+    all_acquired++;
+    l->wait_sum += ms - n->created_ms;
+}
+
+static void held(struct lock *l, struct lnode *n, int64_t ms) {
+    struct sess *s;
+    int64_t hold;
+    int b;
+
+    if (n->owner_ms < 0 || !counting(n->owner_ms)) return;
+    hold = ms - n->owner_ms;
+    if (hold < 0) hold = 0;
+    b = bucket(hold);
+    l->holds[b]++;
+    all_holds[b]++;
+    l->hold_sum += hold;
+    if (hold > l->hold_max) l->hold_max = hold;
+    s = find_sess(n->session, 1);
+    s->acquired++;
+    s->hold_sum += hold;
+    if (hold > s->hold_max) s->hold_max = hold;
+}
+
+static void remove_node(struct lock *l, int i, int64_t ms) {
+    struct sess *s = find_sess(l->queue[i].session, 0);
+    int j;
+
+    if (i == 0) held(l, &l->queue[0], ms);
+    if (s) {
+        for (j = 0; j < s->nlocks && s->locks[j] != l; j++);
+        if (j < s->nlocks) s->locks[j] = s->locks[--s->nlocks];
+    }
+    memmove(&l->queue[i], &l->queue[i + 1], (l->nqueue - i - 1) * sizeof(struct lnode));
+    l->nqueue--;
+    if (i == 0 && l->nqueue) new_owner(l, ms);
+}
+
+/**
+ * splits a path into its folder and the sequence of an x-<session>-
+ * <sequence> name, returns the folder length or -1 for other nodes
+ */
+static int parse_lock_path(const char *path, int len, int64_t *seq) {
+    const char *name;
+    int dir, i;
+
+    if (len <= 0 || !path) return -1;
+    for (dir = len - 1; dir >= 0 && path[dir] != '/'; dir--);
+    if (dir < 0) return -1;
+    name = path + dir + 1;
+    len -= dir + 1;
+    if (len < 20 || name[0] != 'x' || name[1] != '-' || name[18] != '-') return -1;
+    for (i = 2; i < 18; i++) {
+        if (!name[i] || !strchr("0123456789abcdef", name[i])) return -1;
+    }
+    *seq = 0;
+    for (i = 19; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9') return -1;
+        *seq = *seq * 10 + name[i] - '0';
+    }
+    // only what is under the prefix, the folder itself may be it
+    i = strlen(opt_prefix);
+    if (i > 1 && opt_prefix[i - 1] == '/') i--;
+    if (i > 1 && (dir < i || strncmp(path, opt_prefix, i) != 0 || (dir > i && path[i] != '/'))) return -1;
+    return dir ? dir : 1;
+}
+
+static void node_created(const char *path, int len, int64_t session, int64_t ms, int replaying) {
+    struct lnode n;
+    struct lock *l;
+    struct sess *s;
+    int64_t seq;
+    int dir = parse_lock_path(path, len, &seq), i;
+
+    if (dir < 0) return;
+    l = find_lock(path, dir, 1);
+    for (i = l->nqueue; i > 0 && l->queue[i - 1].seq > seq; i--);
+    if (i > 0 && l->queue[i - 1].seq == seq) return;
+    if (replaying) {
+        lock_txns++;
+        if (counting(ms)) {
+            l->attempts++;
+            all_attempts++;
+            if (l->nqueue) {
+                l->locked++;
+                all_locked++;
+            }
+            l->qsum += l->nqueue;
+            if (l->nqueue + 1 > l->maxq) l->maxq = l->nqueue + 1;
+        }
+    }
+    if (l->nqueue == l->capqueue) {
+        l->capqueue = l->capqueue ? l->capqueue * 2 : 4;
+        l->queue = xrealloc(l->queue, l->capqueue * sizeof(struct lnode));
+    }
+    memmove(&l->queue[i + 1], &l->queue[i], (l->nqueue - i) * sizeof(struct lnode));
+    n.seq = seq;
+    n.session = session;
+    n.created_ms = ms;
+    n.owner_ms = -1;
+    l->queue[i] = n;
+    l->nqueue++;
+    if (replaying && i == 0) {
+        // a lower sequence cannot turn up later, so this was free
+        if (l->nqueue > 1) l->queue[1].owner_ms = -1;
+        new_owner(l, ms);
+    }
+
+    s = find_sess(session, 1);
+    if (s->nlocks == s->caplocks) {
+        s->caplocks = s->caplocks ? s->caplocks * 2 : 4;
+        s->locks = xrealloc(s->locks, s->caplocks * sizeof(struct lock*));
+    }
+    s->locks[s->nlocks++] = l;
+}
+
+static void node_deleted(const char *path, int len, int64_t ms) {
+    struct lock *l;
+    int64_t seq;
+    int dir = parse_lock_path(path, len, &seq), i;
+
+    if (dir < 0 || !(l = find_lock(path, dir, 0))) return;
+    for (i = 0; i < l->nqueue && l->queue[i].seq != seq; i++);
+    if (i == l->nqueue) return;
+    lock_txns++;
+    remove_node(l, i, ms);
+}
+
+/** the session ended, its ephemeral nodes went with it */
+static void session_closed(int64_t id, int64_t ms) {
+    struct sess *s = find_sess(id, 0);
+    if (!s) return;
+    while (s->nlocks) {
+        struct lock *l = s->locks[s->nlocks - 1];
+        int i;
+        for (i = 0; i < l->nqueue && l->queue[i].session != id; i++);
+        if (i == l->nqueue) {
+            s->nlocks--;
+            continue;
+        }
+        lock_txns++;
+        remove_node(l, i, ms);
+    }
+    retire_sess(s);
+}
+
+/* ---------------------------------------------------------------- */
+/* files                                                            */
+
+struct mapped {
+    const char *name;
+    const unsigned char *data;
+    size_t size;
+    int64_t first_zxid;
+};
+
+static int map_file(struct mapped *m) {
+    struct stat st;
+    int fd = open(m->name, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open %s\n", m->name);
+        if (fd >= 0) close(fd);
+        return ENOENT;
+    }
+    m->size = st.st_size;
+    m->data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (m->data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", m->name);
+        m->data = NULL;
+        return EIO;
+    }
+    if (m->data) madvise((void*)m->data, m->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+static void unmap_file(struct mapped *m) {
+    if (m->data) munmap((void*)m->data, m->size);
+    m->data = NULL;
+}
+
+/** gives the pages before off back, they are not read again */
+static void drop_behind(struct mapped *m, size_t off, size_t *dropped) {
+    size_t page = sysconf(_SC_PAGESIZE), upto = off / page * page;
+    if (upto - *dropped < DROP_BEHIND) return;
+    madvise((void*)(m->data + *dropped), upto - *dropped, MADV_DONTNEED);
+    *dropped = upto;
+}
+
+static int check_header(struct mapped *m, int32_t magic) {
+    struct ibuf b = { m->data, m->size < FILE_HEADER ? (int)m->size : FILE_HEADER, 0 };
+    if (get_int(&b) != magic || b.bad) {
+        fprintf(stderr, "Could not read %s: not a %s\n", m->name, magic == LOG_MAGIC ? "txn log" : "snapshot");
+        return EINVAL;
+    }
+    return 0;
+}
+
+static uint32_t adler32(const unsigned char *p, size_t len) {
+    uint32_t a = 1, b = 0;
+    while (len) {
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+/** the zxid named in the file name, -1 if there is none */
+static int64_t name_zxid(const char *name) {
+    const char *dot = strrchr(name, '.');
+    char *end;
+    int64_t zxid;
+    if (!dot || !dot[1]) return -1;
+    zxid = strtoll(dot + 1, &end, 16);
+    return *end ? -1 : zxid;
+}
+
+/** one txn of a log or of a multi */
+static void apply(int type, struct ibuf *b, int64_t session, int64_t ms) {
+    const char *path;
+    int len;
+
+    switch (type) {
+    case OP_CREATE:
+    case OP_CREATE2:
+    case OP_CREATE_CONTAINER:
+    case OP_CREATE_TTL:
+        // all of them start with the path, lock nodes are ephemeral
+        len = get_ref(b, &path);
+        if (!b->bad) node_created(path, len, session, ms, 1);
+        break;
+    case OP_DELETE:
+    case OP_DELETE_CONTAINER:
+        len = get_ref(b, &path);
+        if (!b->bad) node_deleted(path, len, ms);
+        break;
+    case OP_MULTI: {
+        int32_t n = get_int(b), i;
+        for (i = 0; i < n && !b->bad; i++) {
+            int32_t sub = get_int(b);
+            struct ibuf part;
+            part.left = get_ref(b, (const char**)&part.p);
+            part.bad = part.left < 0;
+            if (!b->bad && !part.bad) apply(sub, &part, session, ms);
+        }
+        break;
+    }
+    case OP_CLOSE:
+        session_closed(session, ms);
+        break;
+    }
+}
+
+static int read_log(struct mapped *m) {
+    size_t off = FILE_HEADER, dropped = 0;
+
+    while (off + 12 <= m->size) {
+        struct ibuf b = { m->data + off, 12, 0 }, txn;
+        int64_t crc = get_long(&b), session, zxid, ms;
+        int32_t len = get_int(&b), type;
+
+        // logs are preallocated with zeros past their end
+        if (len <= 0 || off + 12 + len + 1 > m->size) break;
+        if ((uint32_t)crc != adler32(m->data + off + 12, len) || m->data[off + 12 + len] != EOR) {
+            fprintf(stderr, "%s: torn record at offset %zu, the rest is not read\n", m->name, off);
+            break;
+        }
+        txn.p = m->data + off + 12;
+        txn.left = len;
+        txn.bad = 0;
+        off += 12 + len + 1;
+        drop_behind(m, off, &dropped);
+
+        session = get_long(&txn);
+        get_int(&txn);
+        zxid = get_long(&txn);
+        ms = get_long(&txn);
+        type = get_int(&txn);
+        if (txn.bad) continue;
+        // logs overlap each other and the snapshot
+        if (zxid <= last_zxid) {
+            skipped++;
+            continue;
+        }
+        last_zxid = zxid;
+        records++;
+        if (!first_ms) first_ms = ms;
+        last_ms = ms;
+        apply(type, &txn, session, ms);
+    }
+    if (off == FILE_HEADER) fprintf(stderr, "%s: no records\n", m->name);
+    return 0;
+}
+
+/**
+ * moves the end of b up to the end of m, as far as an int counts. a
+ * snapshot is read in windows like that, slid on before every record
+ */
+static void slide(struct mapped *m, struct ibuf *b) {
+    size_t off = b->p - m->data, left = off < m->size ? m->size - off : 0;
+    b->left = left > INT32_MAX ? INT32_MAX : (int)left;
+}
+
+static int read_snapshot(struct mapped *m) {
+    struct ibuf b = { m->data + FILE_HEADER, 0, 0 };
+    size_t dropped = 0;
+    int32_t n, i, j;
+
+    // sessions, then the acl cache
+    slide(m, &b);
+    n = get_int(&b);
+    for (i = 0; i < n && !b.bad; i++) {
+        slide(m, &b);
+        get_long(&b);
+        get_int(&b);
+    }
+    n = get_int(&b);
+    for (i = 0; i < n && !b.bad; i++) {
+        int32_t acls;
+        slide(m, &b);
+        get_long(&b);
+        acls = get_int(&b);
+        for (j = 0; j < acls && !b.bad; j++) {
+            const char *s;
+            slide(m, &b);
+            get_int(&b);
+            get_ref(&b, &s);
+            get_ref(&b, &s);
+        }
+    }
+    // the nodes, parents first, up to the path /
+    while (!b.bad) {
+        const char *path, *data;
+        int64_t ctime, owner;
+        int len;
+        slide(m, &b);
+        len = get_ref(&b, &path);
+        if (b.bad || (len == 1 && path[0] == '/')) break;
+        get_ref(&b, &data);
+        get_long(&b);               // acl
+        get_long(&b);               // czxid
+        get_long(&b);               // mzxid
+        ctime = get_long(&b);
+        get_long(&b);               // mtime
+        get_int(&b);                // version
+        get_int(&b);                // cversion
+        get_int(&b);                // aversion
+        owner = get_long(&b);
+        get_long(&b);               // pzxid
+        if (!b.bad && owner) node_created(path, len, owner, ctime, 0);
+        drop_behind(m, b.p - m->data, &dropped);
+    }
+    if (b.bad) {
+        fprintf(stderr, "Could not read %s: cut short\n", m->name);
+        return EINVAL;
+    }
+    last_zxid = name_zxid(m->name);
+    return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* report                                                           */
+
+static struct lock **sorted;
+
+static int cmp_contended(const void *a, const void *b) {
+    const struct lock *x = *(struct lock* const*)a, *y = *(struct lock* const*)b;
+    if (x->hold_sum != y->hold_sum) return x->hold_sum < y->hold_sum ? 1 : -1;
+    if (x->locked != y->locked) return x->locked < y->locked ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+static int cmp_file(const void *a, const void *b) {
+    int64_t x = ((const struct mapped*)a)->first_zxid, y = ((const struct mapped*)b)->first_zxid;
+    return x < y ? -1 : x > y;
+}
+
+static void report(int64_t elapsed, int64_t bytes) {
+    int64_t n, waiting = 0, holding = 0;
+    size_t i, k = 0;
+    struct sess *s;
+
+    sorted = xrealloc(NULL, (nlocks + 1) * sizeof(struct lock*));
+    for (i = 0; i < caplocks; i++) {
+        struct lock *l;
+        for (l = locks[i]; l; l = l->next) {
+            sorted[k++] = l;
+            if (l->nqueue) {
+                holding++;
+                waiting += l->nqueue - 1;
+            }
+        }
+    }
+    qsort(sorted, k, sizeof(struct lock*), cmp_contended);
+
+    printf("%-40s %8s %8s %7s %10s %10s %10s %10s %6s %6s\n", "lock", "acquired", "locked", "locked%",
+           "hold_p50", "hold_p99", "hold_max", "wait_avg", "q_avg", "q_max");
+    for (i = 0; i < k && (int)i < opt_top; i++) {
+        struct lock *l = sorted[i];
+        int b;
+        for (n = 0, b = 0; b < BUCKETS; b++) n += l->holds[b];
+        printf("%-40s %8lld %8lld %6.1f%% %10.3f %10.3f %10.3f %10.3f %6.2f %6d\n", l->path,
+               (long long)l->acquired, (long long)l->locked,
+               l->attempts ? 100.0 * l->locked / l->attempts : 0.0,
+               fmin(percentile(l->holds, n, .5), l->hold_max) / 1000,
+               fmin(percentile(l->holds, n, .99), l->hold_max) / 1000,
+               l->hold_max / 1000.0, l->acquired ? l->wait_sum / 1000.0 / l->acquired : 0.0,
+               l->attempts ? (double)l->qsum / l->attempts : 0.0, l->maxq);
+    }
+
+    // the sessions still open count with what they held so far
+    for (i = 0; i < capsessions; i++) {
+        while ((s = sessions[i])) retire_sess(s);
+    }
+    printf("\n%-18s %8s %12s %10s\n", "session", "acquired", "held_s", "hold_max");
+    for (i = 0; (int)i < ntop; i++) {
+        printf("%016llx   %8lld %12.3f %10.3f\n", (unsigned long long)top[i].id,
+               (long long)top[i].acquired, top[i].hold_sum / 1000.0, top[i].hold_max / 1000.0);
+    }
+
+    for (n = 0, i = 0; i < BUCKETS; i++) n += all_holds[i];
+    printf("\n%zu locks, %lld attempts, %lld locked (%.1f%%), %lld acquired, hold p50 %.3fs p99 %.3fs\n",
+           k, (long long)all_attempts, (long long)all_locked,
+           all_attempts ? 100.0 * all_locked / all_attempts : 0.0, (long long)all_acquired,
+           percentile(all_holds, n, .5) / 1000, percentile(all_holds, n, .99) / 1000);
+    printf("at the end %lld held, %lld waiting\n", (long long)holding, (long long)waiting);
+    fprintf(stderr, "%lld txns over %.1fh, %lld on locks, %lld seen before, %.1f MB in %.3fs (%.0f MB/s)\n",
+            (long long)records, (last_ms - first_ms) / 3600000.0, (long long)lock_txns, (long long)skipped,
+            bytes / 1e6, elapsed / 1e9, elapsed ? bytes / 1e6 / (elapsed / 1e9) : 0.0);
+    free(sorted);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--snapshot FILE] [--prefix PATH] [--top N] [--since EPOCH] [--until EPOCH] log...\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    struct mapped snapshot = { NULL, NULL, 0, 0 }, *logs;
+    int64_t start = now_ns(), bytes = 0;
+    int nlogs, i, ret;
+
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--snapshot") == 0 && i+1 < argc) snapshot.name = argv[++i];
+        else if (strcmp(argv[i], "--prefix") == 0 && i+1 < argc) opt_prefix = argv[++i];
+        else if (strcmp(argv[i], "--top") == 0 && i+1 < argc) opt_top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--since") == 0 && i+1 < argc) opt_since = atoll(argv[++i]) * 1000;
+        else if (strcmp(argv[i], "--until") == 0 && i+1 < argc) opt_until = atoll(argv[++i]) * 1000;
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+    }
+    if ((i == argc && !snapshot.name) || opt_prefix[0] != '/') {
+        usage(argv[0]);
+        return EINVAL;
+    }
+
+    if (snapshot.name) {
+        if ((ret = map_file(&snapshot)) != 0) return ret;
+        if ((ret = check_header(&snapshot, SNAP_MAGIC)) != 0 || (ret = read_snapshot(&snapshot)) != 0) return ret;
+        bytes += snapshot.size;
+        unmap_file(&snapshot);
+    }
+
+    // in zxid order, whatever order the shell globbed them in
+    nlogs = argc - i;
+    logs = xrealloc(NULL, (nlogs + 1) * sizeof(struct mapped));
+    for (nlogs = 0; i < argc; i++, nlogs++) {
+        struct mapped *m = &logs[nlogs];
+        memset(m, 0, sizeof(struct mapped));
+        m->name = argv[i];
+        m->first_zxid = name_zxid(m->name);
+        if (m->first_zxid < 0) {
+            // not named log.<zxid>, its first record tells
+            struct ibuf b;
+            if ((ret = map_file(m)) != 0) return ret;
+            b.p = m->data + FILE_HEADER + 12 + 8 + 4;
+            b.left = m->size >= FILE_HEADER + 12 + 20 ? 8 : 0;
+            b.bad = 0;
+            m->first_zxid = get_long(&b);
+            unmap_file(m);
+        }
+    }
+    qsort(logs, nlogs, sizeof(struct mapped), cmp_file);
+    for (i = 0; i < nlogs; i++) {
+        if ((ret = map_file(&logs[i])) != 0) return ret;
+        if ((ret = check_header(&logs[i], LOG_MAGIC)) != 0) return ret;
+        read_log(&logs[i]);
+        bytes += logs[i].size;
+        unmap_file(&logs[i]);
+    }
+    free(logs);
+
+    report(now_ns() - start, bytes);
+    return 0;
+}
@@ -0,0 +1,876 @@
+/**
+ * zkreplay - drives recorded zoo-locked traces against a server again
+ *
+ * reads the traces written with zoo-locked --record, merges them and
+ * replays every recorded session as a session of its own, with the
+ * gaps between its calls as they were recorded. this way the load of
+ * a whole fleet at one instant, like all crons starting at 00:00 UTC,
+ * can be put on a test ensemble or a zkstandin
+ *
+ * by default a session waits for each reply and for the watches it
+ * waited for before it goes on, like the recipe does, so a slower
+ * server stretches the replay. with --open-loop every call goes out
+ * at its recorded time no matter what. --speed scales the gaps
+ *
+ * lock nodes are named after the session, the names of the replayed
+ * sessions and the sequence numbers they get are mapped in all paths
+ *
+ * --dump prints the traces instead
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <search.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "jute.h"
+#include "../record.h"
+
+#define XID_NOTIFICATION -1
+#define XID_PING -2
+
+static const char *opt_hosts = "localhost:2181";
+static double opt_speed = 1;
+static int opt_open_loop = 0;
+static int opt_timeout = 10000;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------- */
+/* traces                                                           */
+
+struct traced {
+    struct record_entry r;
+    char *path;
+    char *created;
+    int64_t sent;           // when the replay sent it
+};
+
+static struct traced *entries;
+static int nentries;
+static int capentries;
+
+static int load(const char *file) {
+    FILE *f = fopen(file, "r");
+    char *buf = NULL;
+    size_t len = 0, cap = 0, off = 0, n;
+
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", file);
+        return ENOENT;
+    }
+    do {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 1 << 20;
+            buf = realloc(buf, cap);
+        }
+        n = fread(buf + len, 1, cap - len, f);
+        len += n;
+    } while (n > 0);
+    fclose(f);
+
+    while (off + sizeof(struct record_entry) <= len) {
+        struct record_entry *r = (struct record_entry*)(buf + off);
+        struct traced *e;
+        if (r->magic == ((RECORD_MAGIC & 0xff) << 8 | RECORD_MAGIC >> 8)) {
+            fprintf(stderr, "%s was recorded on a machine of the other byte order\n", file);
+            free(buf);
+            return EINVAL;
+        }
+        if (r->magic != RECORD_MAGIC || r->size < RECORD_SIZE(r->pathlen, r->createdlen) || off + r->size > len) {
+            // a writer that died half way leaves a short tail behind
+            fprintf(stderr, "%s: skipping the rest from offset %zu, it is no trace\n", file, off);
+            break;
+        }
+        if (nentries == capentries) {
+            capentries = capentries ? capentries * 2 : 4096;
+            entries = realloc(entries, capentries * sizeof(struct traced));
+        }
+        e = &entries[nentries++];
+        memset(e, 0, sizeof(*e));
+        e->r = *r;
+        e->path = strndup((char*)(r + 1), r->pathlen);
+        if (r->createdlen) e->created = strndup((char*)(r + 1) + r->pathlen, r->createdlen);
+        off += r->size;
+    }
+    free(buf);
+    return 0;
+}
+
+static const char* op_name(const struct record_entry *r) {
+    switch (r->op) {
+    case RECORD_OPEN: return "open";
+    case RECORD_CLOSE: return "close";
+    case RECORD_EVENT: return "event";
+    case ZOO_CREATE_OP: return "create";
+    case ZOO_DELETE_OP: return "delete";
+    case ZOO_EXISTS_OP: return r->flags & RECORD_WATCH ? "watch" : "exists";
+    case ZOO_SETDATA_OP: return "set_data";
+    case ZOO_GETCHILDREN_OP: return r->flags & RECORD_WATCH ? "watch_children" : "get_children";
+    case ZOO_CHECK_OP: return "check";
+    case ZOO_MULTI_OP: return "multi";
+    default: return "unknown";
+    }
+}
+
+static void dump(void) {
+    int i;
+    for (i = 0; i < nentries; i++) {
+        struct record_entry *r = &entries[i].r;
+        printf("%lld.%06lld %016llx %s%-12s %5d %8uus",
+               (long long)(r->start_ns / 1000000000), (long long)(r->start_ns % 1000000000 / 1000),
+               (unsigned long long)r->session, r->flags & RECORD_IN_MULTI ? "  " : "",
+               op_name(r), r->result, r->latency_us);
+        if (r->op == ZOO_GETCHILDREN_OP || r->op == ZOO_MULTI_OP) printf(" n=%u", r->children);
+        if (r->flags & RECORD_EPHEMERAL) printf(" ephemeral");
+        if (r->flags & RECORD_SEQUENCE) printf(" sequence");
+        if (entries[i].path[0]) printf(" %s", entries[i].path);
+        if (entries[i].created) printf(" -> %s", entries[i].created);
+        printf("\n");
+    }
+}
+
+/* ---------------------------------------------------------------- */
+/* latencies per op                                                 */
+
+enum { ST_OPEN, ST_CREATE, ST_DELETE, ST_EXISTS, ST_WATCH, ST_CHILDREN, ST_MULTI, ST_CLOSE, ST_EVENT, ST_OTHER, ST_COUNT };
+
+static const char *st_names[ST_COUNT] = {
+    "open", "create", "delete", "exists", "watch", "get_children", "multi", "close", "event", "other"
+};
+
+struct opstat {
+    int64_t *recorded;
+    int64_t *replayed;
+    int n;
+    int cap;
+    int64_t calls;          // sent, replied or not
+    int64_t mismatched;     // got another result than recorded
+};
+
+static struct opstat opstats[ST_COUNT];
+
+static int st_index(const struct record_entry *r) {
+    switch (r->op) {
+    case RECORD_OPEN: return ST_OPEN;
+    case RECORD_CLOSE: return ST_CLOSE;
+    case RECORD_EVENT: return ST_EVENT;
+    case ZOO_CREATE_OP: return ST_CREATE;
+    case ZOO_DELETE_OP: return ST_DELETE;
+    case ZOO_EXISTS_OP: return r->flags & RECORD_WATCH ? ST_WATCH : ST_EXISTS;
+    case ZOO_GETCHILDREN_OP: return ST_CHILDREN;
+    case ZOO_MULTI_OP: return ST_MULTI;
+    default: return ST_OTHER;
+    }
+}
+
+static void add_latency(const struct traced *e, int64_t recorded, int64_t replayed, int result) {
+    struct opstat *s = &opstats[st_index(&e->r)];
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->recorded = realloc(s->recorded, s->cap * sizeof(int64_t));
+        s->replayed = realloc(s->replayed, s->cap * sizeof(int64_t));
+    }
+    s->recorded[s->n] = recorded;
+    s->replayed[s->n] = replayed;
+    s->n++;
+    if (result != e->r.result) s->mismatched++;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(int64_t *sorted, int n, double p) {
+    int i;
+    if (!n) return -1;
+    i = (int)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+/* ---------------------------------------------------------------- */
+/* sessions                                                         */
+
+enum state { S_IDLE, S_CONNECTING, S_HANDSHAKE, S_READY, S_DONE };
+
+struct pending {
+    int32_t xid;
+    int index;              // into the session's entries
+};
+
+struct rsession {
+    int64_t old_id;
+    int64_t new_id;
+    struct traced **ops;
+    int nops;
+    int next;               // the next entry to send
+    enum state state;
+    int fd;
+    int32_t xid;
+    struct obuf out;
+    int outoff;
+    char *in;
+    int inlen;
+    int incap;
+    struct pending *pending;
+    int npending;
+    int cappending;
+    int64_t connect_sent;
+    int64_t last_sent;
+    int64_t ready_at;       // closed loop: when the next entry is due
+    int watches;            // set and not fired yet
+    int64_t waiting_since;  // closed loop: waiting for a watch to fire
+    int64_t waiting_until;
+    int failed;
+};
+
+static struct rsession *sessions;
+static int nsessions;
+static struct addrinfo *server;
+static int64_t rec_t0, rep_t0;
+static int64_t lag_max;     // how late a call went out in open loop
+static int sessions_failed;
+
+static int cmp_entry(const void *a, const void *b) {
+    const struct traced *x = *(struct traced* const*)a, *y = *(struct traced* const*)b;
+    if (x->r.session != y->r.session) return x->r.session < y->r.session ? -1 : 1;
+    // entries of one session are in the order they were appended
+    return x < y ? -1 : x > y;
+}
+
+static void group_sessions(void) {
+    struct traced **sorted = malloc(nentries * sizeof(struct traced*));
+    int i, j;
+
+    for (i = 0; i < nentries; i++) sorted[i] = &entries[i];
+    qsort(sorted, nentries, sizeof(struct traced*), cmp_entry);
+    sessions = calloc(nentries ? nentries : 1, sizeof(struct rsession));
+    rec_t0 = INT64_MAX;
+    for (i = 0; i < nentries; i = j) {
+        struct rsession *s = &sessions[nsessions++];
+        for (j = i; j < nentries && sorted[j]->r.session == sorted[i]->r.session; j++);
+        s->old_id = sorted[i]->r.session;
+        s->ops = sorted + i;
+        s->nops = j - i;
+        s->fd = -1;
+        if (s->ops[0]->r.start_ns < rec_t0) rec_t0 = s->ops[0]->r.start_ns;
+    }
+}
+
+static struct rsession* find_session(int64_t old_id) {
+    int lo = 0, hi = nsessions - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (sessions[mid].old_id == old_id) return &sessions[mid];
+        if (sessions[mid].old_id < old_id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+/** when an entry was made in the recording, on the replay clock */
+static int64_t scheduled(const struct traced *e) {
+    return rep_t0 + (int64_t)((e->r.start_ns - rec_t0) / opt_speed);
+}
+
+/* ---------------------------------------------------------------- */
+/* paths                                                            */
+
+/** remembers the node a replayed create got for the recorded one */
+static void map_created(const struct traced *e, const char *path) {
+    ENTRY item, *found;
+    if (!e->created || !path) return;
+    item.key = e->created;
+    item.data = strdup(path);
+    found = hsearch(item, ENTER);
+    if (found && found->data != item.data) {
+        free(found->data);
+        found->data = item.data;
+    }
+}
+
+/**
+ * the path to send for a recorded one: a node a replayed create got,
+ * or with the x-<session>- of every replayed session renamed
+ */
+static char* rewrite(const char *path) {
+    ENTRY item, *found;
+    char *out, *p;
+
+    item.key = (char*)path;
+    found = hsearch(item, FIND);
+    if (found) return strdup(found->data);
+    out = strdup(path);
+    for (p = strstr(out, "x-"); p; p = strstr(p + 1, "x-")) {
+        char hex[17], *end;
+        struct rsession *s;
+        if (strlen(p) < 19 || p[18] != '-') continue;
+        memcpy(hex, p + 2, 16);
+        hex[16] = 0;
+        s = find_session((int64_t)strtoull(hex, &end, 16));
+        if (*end || !s || !s->new_id) continue;
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)s->new_id);
+        memcpy(p + 2, hex, 16);
+    }
+    return out;
+}
+
+/* ---------------------------------------------------------------- */
+/* requests                                                         */
+
+static void begin_packet(struct obuf *b, int32_t xid, int32_t type) {
+    put_int(b, 0);      // the length, filled in by end_packet
+    put_int(b, xid);
+    put_int(b, type);
+}
+
+static void end_packet(struct obuf *b, int start) {
+    uint32_t len = htonl(b->len - start - 4);
+    memcpy(b->data + start, &len, 4);
+}
+
+static void put_create(struct obuf *b, const struct traced *e, const char *path) {
+    int datalen = e->r.arg > 0 && e->r.arg < MAX_PACKET / 2 ? e->r.arg : 0;
+    char *data = calloc(1, datalen + 1);
+    put_string(b, path);
+    put_buffer(b, data, datalen);
+    free(data);
+    // world:anyone with all permissions, like ZOO_OPEN_ACL_UNSAFE
+    put_int(b, 1);
+    put_int(b, 31);
+    put_string(b, "world");
+    put_string(b, "anyone");
+    put_int(b, e->r.flags & (RECORD_EPHEMERAL|RECORD_SEQUENCE));
+}
+
+/** the body of an op, the same in and out of a multi */
+static void put_body(struct obuf *b, const struct traced *e) {
+    char *path = rewrite(e->path);
+    switch (e->r.op) {
+    case ZOO_CREATE_OP:
+        put_create(b, e, path);
+        break;
+    case ZOO_DELETE_OP:
+    case OP_CHECK:
+        put_string(b, path);
+        put_int(b, e->r.arg);
+        break;
+    case ZOO_SETDATA_OP:
+        put_string(b, path);
+        put_buffer(b, "", 0);
+        put_int(b, e->r.arg);
+        break;
+    case ZOO_EXISTS_OP:
+        put_string(b, path);
+        put_bool(b, (e->r.flags & RECORD_WATCH) != 0);
+        break;
+    case ZOO_GETCHILDREN_OP:
+        put_string(b, path);
+        put_bool(b, 0);
+        break;
+    }
+    free(path);
+}
+
+static void send_connect(struct rsession *s, int64_t now) {
+    char passwd[16] = { 0 };
+    int start = s->out.len;
+    put_int(&s->out, 0);
+    put_int(&s->out, 0);
+    put_long(&s->out, 0);
+    put_int(&s->out, opt_timeout);
+    put_long(&s->out, 0);
+    put_buffer(&s->out, passwd, 16);
+    put_bool(&s->out, 0);
+    end_packet(&s->out, start);
+    s->state = S_HANDSHAKE;
+    s->connect_sent = s->last_sent = now;
+}
+
+static void send_ping(struct rsession *s, int64_t now) {
+    int start = s->out.len;
+    begin_packet(&s->out, XID_PING, 11);
+    end_packet(&s->out, start);
+    s->last_sent = now;
+}
+
+/** sends the entry at s->next, returns how many entries it took */
+static int send_entry(struct rsession *s, int64_t now) {
+    struct traced *e = s->ops[s->next];
+    int start = s->out.len, used = 1, i;
+    struct pending *p;
+
+    if (e->r.op == ZOO_MULTI_OP) {
+        begin_packet(&s->out, ++s->xid, ZOO_MULTI_OP);
+        for (i = 1; s->next + i < s->nops && (s->ops[s->next + i]->r.flags & RECORD_IN_MULTI); i++) {
+            struct traced *op = s->ops[s->next + i];
+            put_int(&s->out, op->r.op);
+            put_bool(&s->out, 0);
+            put_int(&s->out, -1);
+            put_body(&s->out, op);
+        }
+        used = i;
+        put_int(&s->out, -1);
+        put_bool(&s->out, 1);
+        put_int(&s->out, -1);
+    } else if (e->r.op == RECORD_CLOSE) {
+        begin_packet(&s->out, ++s->xid, OP_CLOSE);
+    } else {
+        begin_packet(&s->out, ++s->xid, e->r.op);
+        put_body(&s->out, e);
+    }
+    end_packet(&s->out, start);
+
+    if (s->npending == s->cappending) {
+        s->cappending = s->cappending ? s->cappending * 2 : 8;
+        s->pending = realloc(s->pending, s->cappending * sizeof(struct pending));
+    }
+    p = &s->pending[s->npending++];
+    p->xid = s->xid;
+    p->index = s->next;
+    e->sent = s->last_sent = now;
+    opstats[st_index(&e->r)].calls++;
+    if (opt_open_loop && now - scheduled(e) > lag_max) lag_max = now - scheduled(e);
+    return used;
+}
+
+/** how long the recording waited for the watch that fired in e */
+static int64_t recorded_wait(const struct rsession *s, int index) {
+    const struct traced *prev = index > 0 ? s->ops[index - 1] : s->ops[index];
+    int64_t wait = s->ops[index]->r.start_ns - (prev->r.start_ns + (int64_t)prev->r.latency_us * 1000);
+    return wait > 0 ? wait : 0;
+}
+
+/**
+ * closed loop: the next entry is due after the gap the recording had
+ * between the end of e and its start
+ */
+static void due_after(struct rsession *s, const struct traced *e, int64_t now) {
+    int64_t gap;
+    if (s->next >= s->nops) return;
+    gap = s->ops[s->next]->r.start_ns - (e->r.start_ns + (int64_t)e->r.latency_us * 1000);
+    s->ready_at = now + (gap > 0 ? (int64_t)(gap / opt_speed) : 0);
+}
+
+static void finish(struct rsession *s) {
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+    s->state = S_DONE;
+}
+
+static void fail(struct rsession *s) {
+    if (!s->failed) sessions_failed++;
+    s->failed = 1;
+    finish(s);
+}
+
+static void start_connect(struct rsession *s, int64_t now) {
+    int one = 1;
+    s->fd = socket(server->ai_family, SOCK_STREAM, 0);
+    if (s->fd < 0) {
+        fail(s);
+        return;
+    }
+    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s->fd, server->ai_addr, server->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        fail(s);
+        return;
+    }
+    s->state = S_CONNECTING;
+    s->connect_sent = now;
+}
+
+/**
+ * sends what is due, returns when the session wants to run next
+ */
+static int64_t step(struct rsession *s, int64_t now) {
+    int64_t ping_at;
+
+    if (s->state == S_IDLE) {
+        int64_t at = scheduled(s->ops[0]);
+        if (now < at) return at;
+        start_connect(s, now);
+        // the session comes up with the connect, not as a call
+        if (s->ops[0]->r.op == RECORD_OPEN) {
+            opstats[ST_OPEN].calls++;
+            s->next = 1;
+        }
+        return INT64_MAX;
+    }
+    if (s->state != S_READY) return INT64_MAX;
+
+    if (s->waiting_until) {
+        if (s->watches > 0 && now < s->waiting_until) return s->waiting_until;
+        // the watch fired, or it never will
+        s->waiting_until = 0;
+        add_latency(s->ops[s->next - 1], recorded_wait(s, s->next - 1), now - s->waiting_since, ZOK);
+        due_after(s, s->ops[s->next - 1], now);
+    }
+    while (s->next < s->nops) {
+        struct traced *e = s->ops[s->next];
+        int64_t due;
+        if (e->r.flags & RECORD_IN_MULTI) {
+            // its multi was not recorded, nothing to send it with
+            s->next++;
+            continue;
+        }
+        if (opt_open_loop) {
+            due = scheduled(e);
+        } else {
+            if (s->npending) break;
+            due = s->ready_at;
+        }
+        if (now < due) {
+            ping_at = s->last_sent + opt_timeout / 3 * 1000000LL;
+            return due < ping_at ? due : ping_at;
+        }
+        if (e->r.op == RECORD_EVENT) {
+            s->next++;
+            if (opt_open_loop) continue;
+            opstats[ST_EVENT].calls++;
+            if (s->watches > 0) {
+                s->waiting_since = now;
+                s->waiting_until = now + opt_timeout * 1000000LL;
+                return s->waiting_until;
+            }
+            add_latency(e, recorded_wait(s, s->next - 1), 0, ZOK);
+            due_after(s, e, now);
+            continue;
+        }
+        s->next += send_entry(s, now);
+        if (e->r.op == RECORD_CLOSE) break;
+    }
+    if (s->next >= s->nops && !s->npending) {
+        // no close recorded: the process died, the server expires it
+        finish(s);
+        return INT64_MAX;
+    }
+    ping_at = s->last_sent + opt_timeout / 3 * 1000000LL;
+    if (now >= ping_at) {
+        send_ping(s, now);
+        ping_at = now + opt_timeout / 3 * 1000000LL;
+    }
+    return ping_at;
+}
+
+/* ---------------------------------------------------------------- */
+/* replies                                                          */
+
+static void handle_multi_reply(struct rsession *s, int index, struct ibuf *b) {
+    int i = index + 1;
+    for (;;) {
+        int32_t type = get_int(b);
+        int done = get_bool(b);
+        int32_t err = get_int(b);
+        char *path;
+        if (b->bad || done) break;
+        if (type == ZOO_CREATE_OP) {
+            path = get_string(b);
+            if (i < s->nops) map_created(s->ops[i], path);
+            free(path);
+        } else if (type == ZOO_SETDATA_OP) {
+            // the stat
+            b->p += b->left < 68 ? b->left : 68;
+            b->left -= b->left < 68 ? b->left : 68;
+        } else if (type == OP_ERROR) {
+            err = get_int(b);
+        }
+        (void)err;
+        i++;
+    }
+}
+
+static void handle_reply(struct rsession *s, struct ibuf *b, int64_t now) {
+    int32_t xid = get_int(b);
+    int32_t err;
+    struct traced *e;
+    int index;
+
+    get_long(b);
+    err = get_int(b);
+    if (b->bad) return;
+    if (xid == XID_PING) return;
+    if (xid == XID_NOTIFICATION) {
+        if (s->watches > 0) s->watches--;
+        return;
+    }
+    if (!s->npending || s->pending[0].xid != xid) {
+        fprintf(stderr, "session %016llx: reply %d out of order\n", (unsigned long long)s->new_id, xid);
+        fail(s);
+        return;
+    }
+    index = s->pending[0].index;
+    memmove(s->pending, s->pending + 1, --s->npending * sizeof(struct pending));
+    e = s->ops[index];
+    add_latency(e, (int64_t)e->r.latency_us * 1000, now - e->sent, err);
+
+    if (err == ZOK && e->r.op == ZOO_CREATE_OP) {
+        char *path = get_string(b);
+        map_created(e, path);
+        free(path);
+    } else if (e->r.op == ZOO_MULTI_OP) {
+        handle_multi_reply(s, index, b);
+    } else if (err == ZOK && e->r.op == ZOO_EXISTS_OP && (e->r.flags & RECORD_WATCH)) {
+        s->watches++;
+    } else if (e->r.op == RECORD_CLOSE) {
+        finish(s);
+        return;
+    }
+    if (!opt_open_loop) due_after(s, e, now);
+}
+
+static void handle_connected(struct rsession *s, struct ibuf *b, int64_t now) {
+    int32_t timeout;
+    get_int(b);
+    timeout = get_int(b);
+    s->new_id = get_long(b);
+    if (b->bad || timeout <= 0) {
+        fail(s);
+        return;
+    }
+    s->state = S_READY;
+    if (s->ops[0]->r.op == RECORD_OPEN) {
+        add_latency(s->ops[0], (int64_t)s->ops[0]->r.latency_us * 1000, now - s->connect_sent, ZOK);
+        due_after(s, s->ops[0], now);
+    } else {
+        s->ready_at = now;
+    }
+}
+
+static void read_session(struct rsession *s, int64_t now) {
+    ssize_t n;
+    int off = 0;
+
+    if (s->incap - s->inlen < 65536) {
+        s->incap = s->incap ? s->incap * 2 : 65536;
+        if (s->incap > 2 * MAX_PACKET + 65536) {
+            fail(s);
+            return;
+        }
+        s->in = realloc(s->in, s->incap);
+    }
+    n = read(s->fd, s->in + s->inlen, s->incap - s->inlen);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        fail(s);
+        return;
+    }
+    s->inlen += n;
+    while (s->state != S_DONE && s->inlen - off >= 4) {
+        uint32_t len;
+        struct ibuf b;
+        memcpy(&len, s->in + off, 4);
+        len = ntohl(len);
+        if (len > MAX_PACKET) {
+            fail(s);
+            return;
+        }
+        if (s->inlen - off < 4 + (int)len) break;
+        b.p = (unsigned char*)s->in + off + 4;
+        b.left = len;
+        b.bad = 0;
+        if (s->state == S_HANDSHAKE) handle_connected(s, &b, now);
+        else handle_reply(s, &b, now);
+        off += 4 + len;
+    }
+    if (s->state == S_DONE) return;
+    memmove(s->in, s->in + off, s->inlen - off);
+    s->inlen -= off;
+}
+
+static void write_session(struct rsession *s, int64_t now) {
+    if (s->state == S_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            fail(s);
+            return;
+        }
+        send_connect(s, now);
+    }
+    while (s->outoff < s->out.len) {
+        ssize_t n = write(s->fd, s->out.data + s->outoff, s->out.len - s->outoff);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+            fail(s);
+            return;
+        }
+        s->outoff += n;
+    }
+    s->outoff = s->out.len = 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* report                                                           */
+
+/** calls are the requests, not sessions coming and going or events */
+static int counted(const struct traced *e, int replayed) {
+    if (e->r.op < 0 || (e->r.flags & RECORD_IN_MULTI)) return 0;
+    return !replayed || e->sent != 0;
+}
+
+/** the busiest second, of the recording or of the replay */
+static int64_t peak_per_second(int replayed) {
+    int64_t span = 0, peak = 0;
+    int64_t *buckets;
+    int i;
+
+    for (i = 0; i < nentries; i++) {
+        int64_t t = replayed ? entries[i].sent - rep_t0 : entries[i].r.start_ns - rec_t0;
+        if (counted(&entries[i], replayed) && t / 1000000000 > span) span = t / 1000000000;
+    }
+    buckets = calloc(span + 1, sizeof(int64_t));
+    for (i = 0; i < nentries; i++) {
+        int64_t t = replayed ? entries[i].sent - rep_t0 : entries[i].r.start_ns - rec_t0;
+        if (!counted(&entries[i], replayed)) continue;
+        if (t >= 0 && ++buckets[t / 1000000000] > peak) peak = buckets[t / 1000000000];
+    }
+    free(buckets);
+    return peak;
+}
+
+static void report(int64_t elapsed) {
+    int64_t rec_end = 0, unreplayed = 0;
+    int i;
+
+    for (i = 0; i < nentries; i++) {
+        int64_t end = entries[i].r.start_ns + (int64_t)entries[i].r.latency_us * 1000;
+        if (end > rec_end) rec_end = end;
+    }
+    for (i = 0; i < nsessions; i++) {
+        struct rsession *s = &sessions[i];
+        unreplayed += s->nops - s->next + s->npending;
+    }
+
+    printf("%-13s %8s %8s %10s %10s %10s %10s %10s %10s\n", "op", "calls", "mismatch",
+           "rec_p50", "rec_p99", "rec_max", "rep_p50", "rep_p99", "rep_max");
+    for (i = 0; i < ST_COUNT; i++) {
+        struct opstat *s = &opstats[i];
+        if (!s->calls) continue;
+        qsort(s->recorded, s->n, sizeof(int64_t), cmp_int64);
+        qsort(s->replayed, s->n, sizeof(int64_t), cmp_int64);
+        printf("%-13s %8lld %8lld %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", st_names[i],
+               (long long)s->calls, (long long)s->mismatched,
+               percentile_ms(s->recorded, s->n, .5), percentile_ms(s->recorded, s->n, .99),
+               percentile_ms(s->recorded, s->n, 1), percentile_ms(s->replayed, s->n, .5),
+               percentile_ms(s->replayed, s->n, .99), percentile_ms(s->replayed, s->n, 1));
+    }
+    printf("sessions %d, failed %d, entries %d, not replayed %lld\n",
+           nsessions, sessions_failed, nentries, (long long)unreplayed);
+    printf("recorded %.3fs, peak %lld calls/s; replayed %.3fs at speed %g, peak %lld calls/s",
+           (rec_end - rec_t0) / 1e9, (long long)peak_per_second(0),
+           elapsed / 1e9, opt_speed, (long long)peak_per_second(1));
+    if (opt_open_loop) printf(", sent up to %.2fms late", lag_max / 1e6);
+    printf("\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--hosts HOST:PORT] [--speed X] [--open-loop] [--timeout MS] [--dump] trace...\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    struct addrinfo hints;
+    struct pollfd *pfds;
+    char host[256], *port;
+    int do_dump = 0, running, i;
+
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--hosts") == 0 && i+1 < argc) opt_hosts = argv[++i];
+        else if (strcmp(argv[i], "--speed") == 0 && i+1 < argc) opt_speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--open-loop") == 0) opt_open_loop = 1;
+        else if (strcmp(argv[i], "--timeout") == 0 && i+1 < argc) opt_timeout = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dump") == 0) do_dump = 1;
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+    }
+    if (i == argc || opt_speed <= 0 || opt_timeout <= 0) {
+        usage(argv[0]);
+        return EINVAL;
+    }
+    for (; i < argc; i++) {
+        int ret = load(argv[i]);
+        if (ret != 0) return ret;
+    }
+    if (do_dump) {
+        dump();
+        return 0;
+    }
+
+    group_sessions();
+    hcreate(nentries * 2 + 16);
+    snprintf(host, sizeof(host), "%s", opt_hosts);
+    host[strcspn(host, ",/")] = 0;
+    port = strrchr(host, ':');
+    if (port) *port++ = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port ? port : "2181", &hints, &server) != 0) {
+        fprintf(stderr, "Could not resolve %s\n", opt_hosts);
+        return ENOENT;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pfds = calloc(nsessions ? nsessions : 1, sizeof(struct pollfd));
+    rep_t0 = now_ns();
+    do {
+        int64_t now = now_ns(), next = now + 100000000;
+        int n = 0;
+
+        running = 0;
+        for (i = 0; i < nsessions; i++) {
+            struct rsession *s = &sessions[i];
+            int64_t at = step(s, now);
+            if (s->state == S_DONE) continue;
+            running++;
+            if (at < next) next = at;
+            if (s->fd < 0) continue;
+            pfds[n].fd = s->fd;
+            pfds[n].events = POLLIN | (s->state == S_CONNECTING || s->outoff < s->out.len ? POLLOUT : 0);
+            pfds[n].revents = 0;
+            n++;
+        }
+        if (!running) break;
+        if (poll(pfds, n, next > now ? (int)((next - now + 999999) / 1000000) : 0) < 0 && errno != EINTR) {
+            perror("poll");
+            return errno;
+        }
+        now = now_ns();
+        for (i = 0, n = 0; i < nsessions; i++) {
+            struct rsession *s = &sessions[i];
+            if (s->state == S_DONE || s->fd < 0) continue;
+            if (pfds[n].fd != s->fd) continue;
+            if (pfds[n].revents & POLLOUT) write_session(s, now);
+            if (s->state != S_DONE && (pfds[n].revents & (POLLIN|POLLHUP|POLLERR))) read_session(s, now);
+            n++;
+        }
+        // send what the steps queued without waiting for the next poll
+        for (i = 0; i < nsessions; i++) {
+            struct rsession *s = &sessions[i];
+            if (s->state > S_CONNECTING && s->state != S_DONE && s->outoff < s->out.len) write_session(s, now);
+        }
+    } while (running);
+
+    report(now_ns() - rep_t0);
+    freeaddrinfo(server);
+    return sessions_failed ? 1 : 0;
+}
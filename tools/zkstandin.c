@@ -0,0 +1,1171 @@
+/**
+ * zkstandin - a single process stand-in for a ZooKeeper server
+ *
+ * speaks the subset of the jute wire protocol zoo-locked needs:
+ * sessions with reconnect and expiry, exists, create (ephemeral,
+ * sequence), delete, getData/setData, getChildren(2), multi, sync,
+ * watches, setWatches and ping. plus the mntr and ruok four letter
+ * words. every reply can be held back by an injected latency, so
+ * the unmodified zookeeper_init path can be benchmarked on a laptop
+ *
+ * it keeps everything in memory and has no dependencies
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "jute.h"
+
+enum watch_kind { WATCH_DATA, WATCH_EXIST, WATCH_CHILD, WATCH_KINDS };
+
+/* ---------------------------------------------------------------- */
+/* options and counters                                             */
+
+static int opt_port = 2181;
+static int opt_latency = 0;         // ms added to every reply
+static int opt_jitter = 0;          // up to this many ms more
+static int opt_min_timeout = 4000;
+static int opt_max_timeout = 40000;
+static int opt_verbose = 0;
+
+static int64_t zxid;
+static int64_t packets_received, packets_sent, bytes_received, bytes_sent;
+static int64_t sessions_expired;
+static volatile sig_atomic_t expire_all;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---------------------------------------------------------------- */
+/* string keyed hash table                                          */
+
+struct table {
+    char **keys;
+    void **vals;
+    int cap;
+    int used;   // live entries plus tombstones
+    int live;
+};
+
+static char tombstone[1];
+
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int table_slot(struct table *t, const char *key, int for_insert) {
+    int i, first_tomb = -1;
+    if (!t->cap) return -1;
+    for (i = hash_str(key) & (t->cap - 1);; i = (i + 1) & (t->cap - 1)) {
+        if (!t->keys[i]) return for_insert && first_tomb >= 0 ? first_tomb : (for_insert ? i : -1);
+        if (t->keys[i] == tombstone) {
+            if (first_tomb < 0) first_tomb = i;
+        } else if (strcmp(t->keys[i], key) == 0) {
+            return i;
+        }
+    }
+}
+
+static void* table_get(struct table *t, const char *key) {
+    int i = table_slot(t, key, 0);
+    return i >= 0 ? t->vals[i] : NULL;
+}
+
+static void table_put(struct table *t, const char *key, void *val);
+
+static void table_grow(struct table *t) {
+    struct table old = *t;
+    int i;
+    t->cap = old.cap ? old.cap * 2 : 64;
+    if (old.live * 4 < old.cap) t->cap = old.cap;  // only tombstones to clean
+    t->keys = calloc(t->cap, sizeof(char*));
+    t->vals = calloc(t->cap, sizeof(void*));
+    if (!t->keys || !t->vals) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    t->used = t->live = 0;
+    for (i = 0; i < old.cap; i++) {
+        if (old.keys[i] && old.keys[i] != tombstone) table_put(t, old.keys[i], old.vals[i]);
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+/** key is kept, not copied */
+static void table_put(struct table *t, const char *key, void *val) {
+    int i;
+    if ((t->used + 1) * 2 > t->cap) table_grow(t);
+    i = table_slot(t, key, 1);
+    if (!t->keys[i] || t->keys[i] == tombstone) {
+        if (!t->keys[i]) t->used++;
+        t->live++;
+    }
+    t->keys[i] = (char*)key;
+    t->vals[i] = val;
+}
+
+static void table_del(struct table *t, const char *key) {
+    int i = table_slot(t, key, 0);
+    if (i < 0) return;
+    t->keys[i] = tombstone;
+    t->vals[i] = NULL;
+    t->live--;
+}
+
+/* ---------------------------------------------------------------- */
+/* data tree                                                        */
+
+struct session;
+
+struct node {
+    char *path;
+    char *data;
+    int datalen;
+    int64_t czxid, mzxid, ctime, mtime, pzxid;
+    int32_t version, cversion;
+    int64_t owner;              // ephemeral owner session id
+    struct node *parent;
+    int index;                  // position in parent->children
+    struct node **children;
+    int nchildren;
+    int cap;
+};
+
+static struct table nodes;
+
+static const char* base_name(const char *path) {
+    return strrchr(path, '/') + 1;
+}
+
+static void put_stat(struct obuf *b, const struct node *n) {
+    put_long(b, n->czxid);
+    put_long(b, n->mzxid);
+    put_long(b, n->ctime);
+    put_long(b, n->mtime);
+    put_int(b, n->version);
+    put_int(b, n->cversion);
+    put_int(b, 0);              // aversion
+    put_long(b, n->owner);
+    put_int(b, n->datalen);
+    put_int(b, n->nchildren);
+    put_long(b, n->pzxid);
+}
+
+static int valid_path(const char *path) {
+    size_t len;
+    if (!path || path[0] != '/') return 0;
+    len = strlen(path);
+    if (len > 1 && path[len-1] == '/') return 0;
+    if (strstr(path, "//") || strstr(path, "/./") || strstr(path, "/../")) return 0;
+    return 1;
+}
+
+static char* parent_path(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int len = slash == path ? 1 : slash - path;
+    char *p = malloc(len + 1);
+    memcpy(p, path, len);
+    p[len] = 0;
+    return p;
+}
+
+static void link_child(struct node *p, struct node *n) {
+    if (p->nchildren == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->children = realloc(p->children, p->cap * sizeof(struct node*));
+    }
+    n->index = p->nchildren;
+    p->children[p->nchildren++] = n;
+    n->parent = p;
+    p->cversion++;
+    p->pzxid = zxid;
+}
+
+static void unlink_child(struct node *n) {
+    struct node *p = n->parent;
+    struct node *last = p->children[--p->nchildren];
+    // order of children is unspecified, so swap the last one in
+    p->children[n->index] = last;
+    last->index = n->index;
+    p->cversion++;
+    p->pzxid = zxid;
+}
+
+static struct node* make_node(const char *path, const char *data, int datalen, int64_t owner) {
+    struct node *n = calloc(1, sizeof(*n));
+    n->path = strdup(path);
+    if (data && datalen > 0) {
+        n->data = malloc(datalen);
+        memcpy(n->data, data, datalen);
+        n->datalen = datalen;
+    }
+    n->czxid = n->mzxid = n->pzxid = zxid;
+    n->ctime = n->mtime = wall_ms();
+    n->owner = owner;
+    return n;
+}
+
+static void free_node(struct node *n) {
+    free(n->path);
+    free(n->data);
+    free(n->children);
+    free(n);
+}
+
+/* ---------------------------------------------------------------- */
+/* sessions, connections and watches                                */
+
+struct packet {
+    int64_t due;
+    int len;
+    struct packet *next;
+    char data[];
+};
+
+struct conn {
+    int fd;
+    int64_t id;
+    struct session *session;
+    int handshaken;
+    unsigned char *in;
+    int inlen;
+    int incap;
+    struct packet *queue;       // replies held back by the injected latency
+    struct packet *tail;
+    int64_t last_due;
+    char *out;                  // due bytes not written yet
+    int outlen;
+    int outoff;
+    int closing;                // close once everything is written
+};
+
+struct session {
+    int64_t id;
+    char key[24];
+    char passwd[16];
+    int timeout;
+    struct conn *conn;
+    int64_t expires;            // monotonic ms
+    struct node **ephemerals;
+    int nephemerals;
+    int cap;
+};
+
+struct watcher {
+    int fd;
+    int64_t conn;
+};
+
+struct watchset {
+    char *path;
+    struct watcher *w[WATCH_KINDS];
+    int n[WATCH_KINDS];
+    int cap[WATCH_KINDS];
+};
+
+static struct table sessions;
+static struct table watches;
+static struct conn **conns;     // by fd
+static int nconns;
+static int64_t conn_ids;
+static int64_t session_ids;
+
+struct event {
+    int type;
+    int kind_mask;
+    char *path;
+};
+
+// events of the current request, only delivered once it succeeded
+static struct event *events;
+static int nevents;
+static int capevents;
+
+static void queue_event(int type, int kinds, const char *path) {
+    if (nevents == capevents) {
+        capevents = capevents ? capevents * 2 : 16;
+        events = realloc(events, capevents * sizeof(struct event));
+    }
+    events[nevents].type = type;
+    events[nevents].kind_mask = kinds;
+    events[nevents].path = strdup(path);
+    nevents++;
+}
+
+static void drop_events(void) {
+    int i;
+    for (i = 0; i < nevents; i++) free(events[i].path);
+    nevents = 0;
+}
+
+static void add_watch(struct conn *c, int kind, const char *path) {
+    struct watchset *ws = table_get(&watches, path);
+    int i;
+    if (!ws) {
+        ws = calloc(1, sizeof(*ws));
+        ws->path = strdup(path);
+        table_put(&watches, ws->path, ws);
+    }
+    for (i = 0; i < ws->n[kind]; i++) {
+        if (ws->w[kind][i].conn == c->id) return;
+    }
+    if (ws->n[kind] == ws->cap[kind]) {
+        ws->cap[kind] = ws->cap[kind] ? ws->cap[kind] * 2 : 4;
+        ws->w[kind] = realloc(ws->w[kind], ws->cap[kind] * sizeof(struct watcher));
+    }
+    ws->w[kind][ws->n[kind]].fd = c->fd;
+    ws->w[kind][ws->n[kind]].conn = c->id;
+    ws->n[kind]++;
+}
+
+static void send_packet(struct conn *c, struct obuf *body, int32_t xid, int32_t err);
+
+static void notify(struct conn *c, int type, const char *path) {
+    struct obuf b = { 0 };
+    put_int(&b, type);
+    put_int(&b, STATE_CONNECTED);
+    put_string(&b, path);
+    send_packet(c, &b, -1, ZOK);
+    free(b.data);
+}
+
+/** delivers the events of a request that went through */
+static void fire_events(void) {
+    int i, k, j;
+    for (i = 0; i < nevents; i++) {
+        struct watchset *ws = table_get(&watches, events[i].path);
+        if (ws) {
+            for (k = 0; k < WATCH_KINDS; k++) {
+                if (!(events[i].kind_mask & (1 << k))) continue;
+                for (j = 0; j < ws->n[k]; j++) {
+                    struct watcher *w = &ws->w[k][j];
+                    struct conn *c = w->fd < nconns ? conns[w->fd] : NULL;
+                    int l;
+                    if (!c || c->id != w->conn) continue;
+                    // a client gets one event per path even if it set several kinds
+                    for (l = 0; l < k; l++) {
+                        int m;
+                        if (!(events[i].kind_mask & (1 << l))) continue;
+                        for (m = 0; m < ws->n[l] && ws->w[l][m].conn != w->conn; m++);
+                        if (m < ws->n[l]) break;
+                    }
+                    if (l == k) notify(c, events[i].type, events[i].path);
+                }
+                ws->n[k] = 0;
+            }
+            if (!ws->n[0] && !ws->n[1] && !ws->n[2]) {
+                table_del(&watches, ws->path);
+                for (k = 0; k < WATCH_KINDS; k++) free(ws->w[k]);
+                free(ws->path);
+                free(ws);
+            }
+        }
+        free(events[i].path);
+    }
+    nevents = 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* operations                                                       */
+
+struct undo {
+    int op;
+    struct node *node;
+    char *data;                 // what a setData replaced
+    int datalen;
+    int64_t mzxid, mtime;
+};
+
+static void add_ephemeral(struct session *s, struct node *n) {
+    if (s->nephemerals == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4;
+        s->ephemerals = realloc(s->ephemerals, s->cap * sizeof(struct node*));
+    }
+    s->ephemerals[s->nephemerals++] = n;
+}
+
+static void drop_ephemeral(struct node *n) {
+    char key[24];
+    struct session *s;
+    int i;
+    snprintf(key, sizeof(key), "%llx", (unsigned long long)n->owner);
+    s = table_get(&sessions, key);
+    for (i = 0; s && i < s->nephemerals; i++) {
+        if (s->ephemerals[i] == n) {
+            s->ephemerals[i] = s->ephemerals[--s->nephemerals];
+            break;
+        }
+    }
+}
+
+static int do_create(struct session *s, const char *path, const char *data, int datalen,
+                     int flags, struct node **created) {
+    char *ppath;
+    char *real;
+    struct node *p, *n;
+
+    if (!valid_path(path) || strcmp(path, "/") == 0) return ZBADARGUMENTS;
+    ppath = parent_path(path);
+    p = table_get(&nodes, ppath);
+    free(ppath);
+    if (!p) return ZNONODE;
+    if (p->owner) return ZNOCHILDRENFOREPHEMERALS;
+    real = malloc(strlen(path) + 12);
+    if (flags & FLAG_SEQUENCE) sprintf(real, "%s%010d", path, p->cversion);
+    else strcpy(real, path);
+    if (table_get(&nodes, real)) {
+        free(real);
+        return ZNODEEXISTS;
+    }
+    zxid++;
+    n = make_node(real, data, datalen, (flags & FLAG_EPHEMERAL) ? s->id : 0);
+    free(real);
+    table_put(&nodes, n->path, n);
+    link_child(p, n);
+    if (n->owner) add_ephemeral(s, n);
+    queue_event(EV_CREATED, 1 << WATCH_DATA | 1 << WATCH_EXIST, n->path);
+    queue_event(EV_CHILD, 1 << WATCH_CHILD, p->path);
+    *created = n;
+    return ZOK;
+}
+
+static void undo_create(struct node *n) {
+    unlink_child(n);
+    table_del(&nodes, n->path);
+    if (n->owner) drop_ephemeral(n);
+    free_node(n);
+}
+
+/** detaches n, the caller frees it once the request went through */
+static int do_delete(const char *path, int version, struct node **deleted) {
+    struct node *n = table_get(&nodes, path);
+    if (!valid_path(path)) return ZBADARGUMENTS;
+    if (!n) return ZNONODE;
+    if (!n->parent) return ZBADARGUMENTS;
+    if (version != -1 && version != n->version) return ZBADVERSION;
+    if (n->nchildren) return ZNOTEMPTY;
+    zxid++;
+    unlink_child(n);
+    table_del(&nodes, n->path);
+    if (n->owner) drop_ephemeral(n);
+    queue_event(EV_DELETED, 1 << WATCH_DATA | 1 << WATCH_EXIST | 1 << WATCH_CHILD, n->path);
+    queue_event(EV_CHILD, 1 << WATCH_CHILD, n->parent->path);
+    *deleted = n;
+    return ZOK;
+}
+
+static void undo_delete(struct node *n) {
+    char key[24];
+    struct session *s;
+    table_put(&nodes, n->path, n);
+    link_child(n->parent, n);
+    snprintf(key, sizeof(key), "%llx", (unsigned long long)n->owner);
+    if (n->owner && (s = table_get(&sessions, key))) add_ephemeral(s, n);
+}
+
+static int do_setdata(const char *path, const char *data, int datalen, int version, struct undo *u) {
+    struct node *n = table_get(&nodes, path);
+    if (!n) return ZNONODE;
+    if (version != -1 && version != n->version) return ZBADVERSION;
+    zxid++;
+    u->op = OP_SETDATA;
+    u->node = n;
+    u->data = n->data;
+    u->datalen = n->datalen;
+    u->mzxid = n->mzxid;
+    u->mtime = n->mtime;
+    n->data = NULL;
+    if (data && datalen > 0) {
+        n->data = malloc(datalen);
+        memcpy(n->data, data, datalen);
+    }
+    n->datalen = datalen > 0 ? datalen : 0;
+    n->version++;
+    n->mzxid = zxid;
+    n->mtime = wall_ms();
+    queue_event(EV_CHANGED, 1 << WATCH_DATA | 1 << WATCH_EXIST, path);
+    return ZOK;
+}
+
+static void undo_setdata(struct undo *u) {
+    struct node *n = u->node;
+    free(n->data);
+    n->data = u->data;
+    n->datalen = u->datalen;
+    n->mzxid = u->mzxid;
+    n->mtime = u->mtime;
+    n->version--;
+}
+
+/** makes an op stick once its request went through */
+static void keep_op(struct undo *u) {
+    if (u->op == OP_DELETE) free_node(u->node);
+    if (u->op == OP_SETDATA) free(u->data);
+}
+
+/** removes a session and everything it owned */
+static void expire_session(struct session *s) {
+    struct node *gone;
+    if (opt_verbose) fprintf(stderr, "session %llx expired\n", (unsigned long long)s->id);
+    while (s->nephemerals > 0) {
+        // delete every ephemeral, which also takes it off our list
+        if (do_delete(s->ephemerals[s->nephemerals-1]->path, -1, &gone) == ZOK) {
+            free_node(gone);
+        } else {
+            s->nephemerals--;
+        }
+    }
+    fire_events();
+    if (s->conn) s->conn->session = NULL;
+    table_del(&sessions, s->key);
+    free(s->ephemerals);
+    free(s);
+    sessions_expired++;
+}
+
+/* ---------------------------------------------------------------- */
+/* networking                                                       */
+
+static void send_packet(struct conn *c, struct obuf *body, int32_t xid, int32_t err) {
+    int len = 16 + (body ? body->len : 0);
+    struct packet *p = malloc(sizeof(*p) + 4 + len);
+    struct obuf hdr = { 0 };
+    int64_t due = now_ms() + opt_latency + (opt_jitter ? rand() % (opt_jitter + 1) : 0);
+
+    put_int(&hdr, len);
+    put_int(&hdr, xid);
+    put_long(&hdr, zxid);
+    put_int(&hdr, err);
+    memcpy(p->data, hdr.data, hdr.len);
+    if (body && body->len) memcpy(p->data + hdr.len, body->data, body->len);
+    free(hdr.data);
+    p->len = 4 + len;
+    // replies stay in order, jitter can only push later ones back
+    p->due = due > c->last_due ? due : c->last_due;
+    c->last_due = p->due;
+    p->next = NULL;
+    if (c->tail) c->tail->next = p;
+    else c->queue = p;
+    c->tail = p;
+    packets_sent++;
+}
+
+static void send_raw(struct conn *c, const char *data, int len) {
+    struct packet *p = malloc(sizeof(*p) + len);
+    memcpy(p->data, data, len);
+    p->len = len;
+    p->due = c->last_due > now_ms() ? c->last_due : now_ms();
+    p->next = NULL;
+    if (c->tail) c->tail->next = p;
+    else c->queue = p;
+    c->tail = p;
+}
+
+static void close_conn(struct conn *c) {
+    struct packet *p = c->queue;
+    if (opt_verbose) fprintf(stderr, "connection %lld closed\n", (long long)c->id);
+    if (c->session) {
+        c->session->conn = NULL;
+        // the client has until its timeout to come back
+        c->session->expires = now_ms() + c->session->timeout;
+    }
+    while (p) {
+        struct packet *next = p->next;
+        free(p);
+        p = next;
+    }
+    close(c->fd);
+    conns[c->fd] = NULL;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void handle_connect(struct conn *c, struct ibuf *b) {
+    struct obuf r = { 0 };
+    int32_t proto = get_int(b);
+    int64_t last_zxid = get_long(b);
+    int32_t timeout = get_int(b);
+    int64_t id = get_long(b);
+    char *passwd = NULL;
+    int plen = get_buffer(b, &passwd);
+    struct session *s = NULL;
+    int32_t len;
+    (void)proto;
+
+    if (b->bad) {
+        free(passwd);
+        c->closing = 1;
+        return;
+    }
+    if (timeout < opt_min_timeout) timeout = opt_min_timeout;
+    if (timeout > opt_max_timeout) timeout = opt_max_timeout;
+
+    if (id != 0) {
+        char key[24];
+        snprintf(key, sizeof(key), "%llx", (unsigned long long)id);
+        s = table_get(&sessions, key);
+        if (s && (plen != 16 || memcmp(passwd, s->passwd, 16) != 0)) s = NULL;
+        if (!s || last_zxid > zxid) {
+            // expired or unknown: a zero timeout tells the client so
+            char zero[16] = { 0 };
+            put_int(&r, 0);
+            put_int(&r, 0);
+            put_long(&r, 0);
+            put_buffer(&r, zero, 16);
+            put_bool(&r, 0);
+            len = htonl(r.len);
+            send_raw(c, (char*)&len, 4);
+            send_raw(c, r.data, r.len);
+            free(r.data);
+            free(passwd);
+            c->closing = 1;
+            return;
+        }
+        if (s->conn && s->conn != c) {
+            s->conn->session = NULL;
+            s->conn->closing = 1;
+        }
+    } else {
+        int i;
+        s = calloc(1, sizeof(*s));
+        do {
+            s->id = (int64_t)((uint64_t)(wall_ms() / 1000 & 0xffffffff) << 24 | (++session_ids & 0xffffff));
+            snprintf(s->key, sizeof(s->key), "%llx", (unsigned long long)s->id);
+        } while (table_get(&sessions, s->key));
+        for (i = 0; i < 16; i++) s->passwd[i] = rand();
+        table_put(&sessions, s->key, s);
+    }
+    free(passwd);
+    s->timeout = timeout;
+    s->conn = c;
+    s->expires = now_ms() + timeout;
+    c->session = s;
+    c->handshaken = 1;
+    if (opt_verbose) fprintf(stderr, "session %llx on connection %lld\n", (unsigned long long)s->id, (long long)c->id);
+
+    put_int(&r, 0);
+    put_int(&r, s->timeout);
+    put_long(&r, s->id);
+    put_buffer(&r, s->passwd, 16);
+    put_bool(&r, 0);
+    len = htonl(r.len);
+    send_raw(c, (char*)&len, 4);
+    send_raw(c, r.data, r.len);
+    free(r.data);
+}
+
+struct op {
+    int type;
+    char *path;
+    char *data;
+    int datalen;
+    int version;
+    int flags;
+};
+
+/** reads the body of a write op, the ACL of a create is read and ignored */
+static int read_op(struct ibuf *b, int type, struct op *op) {
+    int n, i;
+
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->path = get_string(b);
+    switch (type) {
+    case OP_CREATE:
+    case OP_CREATE2:
+        op->datalen = get_buffer(b, &op->data);
+        n = get_int(b);
+        for (i = 0; i < n && !b->bad; i++) {
+            char *scheme, *id;
+            get_int(b);
+            scheme = get_string(b);
+            id = get_string(b);
+            free(scheme);
+            free(id);
+        }
+        op->flags = get_int(b);
+        break;
+    case OP_DELETE:
+    case OP_CHECK:
+        op->version = get_int(b);
+        break;
+    case OP_SETDATA:
+        op->datalen = get_buffer(b, &op->data);
+        op->version = get_int(b);
+        break;
+    default:
+        return ZUNIMPLEMENTED;
+    }
+    return b->bad || !op->path ? ZMARSHALLINGERROR : ZOK;
+}
+
+static void free_op(struct op *op) {
+    free(op->path);
+    free(op->data);
+}
+
+static int run_op(struct conn *c, struct op *op, struct obuf *r, struct undo *u) {
+    int ret;
+
+    u->op = 0;
+    switch (op->type) {
+    case OP_CREATE:
+    case OP_CREATE2:
+        ret = do_create(c->session, op->path, op->data, op->datalen, op->flags, &u->node);
+        if (ret == ZOK) {
+            u->op = OP_CREATE;
+            put_string(r, u->node->path);
+            if (op->type == OP_CREATE2) put_stat(r, u->node);
+        }
+        return ret;
+    case OP_DELETE:
+        ret = do_delete(op->path, op->version, &u->node);
+        if (ret == ZOK) u->op = OP_DELETE;
+        return ret;
+    case OP_SETDATA:
+        ret = do_setdata(op->path, op->data, op->datalen, op->version, u);
+        if (ret == ZOK) put_stat(r, u->node);
+        return ret;
+    case OP_CHECK:
+        u->node = table_get(&nodes, op->path);
+        if (!u->node) return ZNONODE;
+        return op->version != -1 && op->version != u->node->version ? ZBADVERSION : ZOK;
+    }
+    return ZUNIMPLEMENTED;
+}
+
+static void handle_multi(struct conn *c, int32_t xid, struct ibuf *b) {
+    struct obuf r = { 0 };
+    struct obuf results[64];
+    int types[64];
+    int errs[64];
+    struct undo undo[64];
+    struct op op;
+    int n = 0, i, failed = -1;
+
+    for (;;) {
+        int type = get_int(b);
+        int done = get_bool(b);
+        get_int(b);
+        if (b->bad || done || type == -1) break;
+        if (n == 64) {
+            b->bad = 1;
+            break;
+        }
+        memset(&results[n], 0, sizeof(results[n]));
+        types[n] = type;
+        undo[n].op = 0;
+        errs[n] = read_op(b, type, &op);
+        if (errs[n] == ZOK && failed < 0) errs[n] = run_op(c, &op, &results[n], &undo[n]);
+        else if (errs[n] == ZOK) errs[n] = ZRUNTIMEINCONSISTENCY;
+        if (errs[n] != ZOK && failed < 0) failed = n;
+        free_op(&op);
+        n++;
+        // an op we cannot parse leaves us nowhere to continue from
+        if (b->bad) break;
+    }
+    if (b->bad && failed < 0 && n > 0) {
+        failed = n - 1;
+        errs[failed] = ZMARSHALLINGERROR;
+    }
+    if (failed >= 0) {
+        for (i = n - 1; i >= 0; i--) {
+            if (undo[i].op == OP_CREATE) undo_create(undo[i].node);
+            else if (undo[i].op == OP_DELETE) undo_delete(undo[i].node);
+            else if (undo[i].op == OP_SETDATA) undo_setdata(&undo[i]);
+            if (i < failed) errs[i] = ZOK;
+        }
+        drop_events();
+    } else {
+        for (i = 0; i < n; i++) keep_op(&undo[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (failed >= 0) {
+            // a failed multi only reports an error result per op
+            put_int(&r, OP_ERROR);
+            put_bool(&r, 0);
+            put_int(&r, errs[i]);
+            put_int(&r, errs[i]);
+        } else {
+            put_int(&r, types[i]);
+            put_bool(&r, 0);
+            put_int(&r, 0);
+            put_raw(&r, results[i].data, results[i].len);
+        }
+        free(results[i].data);
+    }
+    put_int(&r, -1);
+    put_bool(&r, 1);
+    put_int(&r, -1);
+    send_packet(c, &r, xid, ZOK);
+    free(r.data);
+    fire_events();
+}
+
+static void handle_setwatches(struct conn *c, struct ibuf *b) {
+    int64_t rel = get_long(b);
+    int kind, i, n;
+    for (kind = 0; kind < WATCH_KINDS && !b->bad; kind++) {
+        n = get_int(b);
+        for (i = 0; i < n && !b->bad; i++) {
+            char *path = get_string(b);
+            struct node *node;
+            if (!path) continue;
+            node = table_get(&nodes, path);
+            // whatever happened while the client was away fires right now
+            if (kind == WATCH_DATA && !node) notify(c, EV_DELETED, path);
+            else if (kind == WATCH_DATA && node->mzxid > rel) notify(c, EV_CHANGED, path);
+            else if (kind == WATCH_EXIST && node) notify(c, EV_CREATED, path);
+            else if (kind == WATCH_CHILD && !node) notify(c, EV_DELETED, path);
+            else if (kind == WATCH_CHILD && node->pzxid > rel) notify(c, EV_CHILD, path);
+            else add_watch(c, kind, path);
+            free(path);
+        }
+    }
+}
+
+static void handle_request(struct conn *c, struct ibuf *b) {
+    int32_t xid = get_int(b);
+    int32_t type = get_int(b);
+    struct obuf r = { 0 };
+    struct undo u;
+    struct op op;
+    char *path = NULL;
+    struct node *n;
+    int ret = ZOK, watch, i;
+
+    if (c->session) c->session->expires = now_ms() + c->session->timeout;
+    switch (type) {
+    case OP_PING:
+    case OP_SETAUTH:
+        break;
+    case OP_CLOSE:
+        send_packet(c, NULL, xid, ZOK);
+        if (c->session) expire_session(c->session);
+        c->session = NULL;
+        c->closing = 1;
+        return;
+    case OP_CREATE:
+    case OP_CREATE2:
+    case OP_DELETE:
+    case OP_SETDATA:
+        ret = read_op(b, type, &op);
+        if (ret == ZOK) ret = run_op(c, &op, &r, &u);
+        free_op(&op);
+        if (ret == ZOK) keep_op(&u);
+        if (ret != ZOK) {
+            r.len = 0;
+            drop_events();
+        }
+        break;
+    case OP_EXISTS:
+    case OP_GETDATA:
+    case OP_GETCHILDREN:
+    case OP_GETCHILDREN2:
+        path = get_string(b);
+        watch = get_bool(b);
+        if (b->bad || !path) {
+            ret = ZMARSHALLINGERROR;
+            break;
+        }
+        n = table_get(&nodes, path);
+        // only exists leaves a watch on a missing node
+        if (watch && (n || type == OP_EXISTS)) {
+            add_watch(c, type == OP_EXISTS && !n ? WATCH_EXIST :
+                      (type == OP_GETCHILDREN || type == OP_GETCHILDREN2) ? WATCH_CHILD : WATCH_DATA, path);
+        }
+        if (!n) {
+            ret = ZNONODE;
+            break;
+        }
+        if (type == OP_GETDATA) put_buffer(&r, n->data ? n->data : "", n->datalen);
+        if (type == OP_GETCHILDREN || type == OP_GETCHILDREN2) {
+            put_int(&r, n->nchildren);
+            for (i = 0; i < n->nchildren; i++) put_string(&r, base_name(n->children[i]->path));
+        }
+        if (type != OP_GETCHILDREN) put_stat(&r, n);
+        break;
+    case OP_SYNC:
+        path = get_string(b);
+        put_string(&r, path);
+        break;
+    case OP_MULTI:
+        handle_multi(c, xid, b);
+        return;
+    case OP_SETWATCHES:
+        handle_setwatches(c, b);
+        break;
+    default:
+        ret = ZUNIMPLEMENTED;
+    }
+    free(path);
+    send_packet(c, ret == ZOK ? &r : NULL, xid, ret);
+    free(r.data);
+    fire_events();
+}
+
+/** answers the four letter words, like a real server on its client port */
+static int handle_fourletter(struct conn *c) {
+    char buf[1024];
+    int len, i, alive = 0, ephemerals = 0;
+    if (c->inlen < 4) return 0;
+    for (i = 0; i < nconns; i++) alive += conns[i] != NULL;
+    for (i = 0; i < sessions.cap; i++) {
+        if (sessions.keys[i] && sessions.keys[i] != tombstone)
+            ephemerals += ((struct session*)sessions.vals[i])->nephemerals;
+    }
+    if (memcmp(c->in, "ruok", 4) == 0) {
+        len = snprintf(buf, sizeof(buf), "imok");
+    } else if (memcmp(c->in, "mntr", 4) == 0 || memcmp(c->in, "srvr", 4) == 0) {
+        len = snprintf(buf, sizeof(buf),
+            "zk_version\tzkstandin\nzk_server_state\tstandalone\n"
+            "zk_packets_received\t%lld\nzk_packets_sent\t%lld\n"
+            "zk_bytes_received\t%lld\nzk_bytes_sent\t%lld\n"
+            "zk_num_alive_connections\t%d\nzk_znode_count\t%d\n"
+            "zk_watch_count\t%d\nzk_ephemerals_count\t%d\n"
+            "zk_sessions\t%d\nzk_sessions_expired\t%lld\nzk_zxid\t0x%llx\n",
+            (long long)packets_received, (long long)packets_sent,
+            (long long)bytes_received, (long long)bytes_sent,
+            alive, nodes.live, watches.live, ephemerals, sessions.live,
+            (long long)sessions_expired, (unsigned long long)zxid);
+    } else {
+        return 0;
+    }
+    send_raw(c, buf, len);
+    c->closing = 1;
+    return 1;
+}
+
+static void handle_input(struct conn *c) {
+    int off = 0;
+    if (!c->handshaken && handle_fourletter(c)) {
+        c->inlen = 0;
+        return;
+    }
+    while (c->inlen - off >= 4 && !c->closing) {
+        struct ibuf b;
+        int32_t len = (int32_t)((uint32_t)c->in[off] << 24 | (uint32_t)c->in[off+1] << 16 |
+                                (uint32_t)c->in[off+2] << 8 | c->in[off+3]);
+        if (len < 0 || len > MAX_PACKET) {
+            c->closing = 1;
+            break;
+        }
+        if (c->inlen - off - 4 < len) break;
+        b.p = c->in + off + 4;
+        b.left = len;
+        b.bad = 0;
+        packets_received++;
+        if (!c->handshaken) handle_connect(c, &b);
+        else handle_request(c, &b);
+        off += 4 + len;
+    }
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+}
+
+static void read_conn(struct conn *c) {
+    ssize_t n;
+    if (c->incap - c->inlen < 65536) {
+        c->incap = c->incap ? c->incap * 2 : 65536;
+        if (c->incap > 2 * MAX_PACKET + 65536) {
+            close_conn(c);
+            return;
+        }
+        c->in = realloc(c->in, c->incap);
+    }
+    n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        close_conn(c);
+        return;
+    }
+    bytes_received += n;
+    c->inlen += n;
+    handle_input(c);
+}
+
+/** moves due packets to the output and writes what the socket takes */
+static void flush_conn(struct conn *c, int64_t now) {
+    while (c->queue && c->queue->due <= now) {
+        struct packet *p = c->queue;
+        c->out = realloc(c->out, c->outlen + p->len);
+        memcpy(c->out + c->outlen, p->data, p->len);
+        c->outlen += p->len;
+        c->queue = p->next;
+        if (!c->queue) c->tail = NULL;
+        free(p);
+    }
+    while (c->outoff < c->outlen) {
+        ssize_t n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) break;
+            close_conn(c);
+            return;
+        }
+        bytes_sent += n;
+        c->outoff += n;
+    }
+    if (c->outoff == c->outlen) {
+        c->outoff = c->outlen = 0;
+        if (c->closing && !c->queue) close_conn(c);
+    }
+}
+
+static void accept_conns(int lfd) {
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        int one = 1;
+        struct conn *c;
+        if (fd < 0) return;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (fd >= nconns) {
+            int n = nconns ? nconns : 1024;
+            while (n <= fd) n *= 2;
+            conns = realloc(conns, n * sizeof(struct conn*));
+            memset(conns + nconns, 0, (n - nconns) * sizeof(struct conn*));
+            nconns = n;
+        }
+        c = calloc(1, sizeof(*c));
+        c->fd = fd;
+        c->id = ++conn_ids;
+        conns[fd] = c;
+    }
+}
+
+/** expires sessions whose client went quiet for longer than their timeout */
+static void check_sessions(int64_t now) {
+    int i;
+    for (i = 0; i < sessions.cap; i++) {
+        struct session *s;
+        if (!sessions.keys[i] || sessions.keys[i] == tombstone) continue;
+        s = sessions.vals[i];
+        if (expire_all || s->expires <= now) {
+            if (s->conn) s->conn->closing = 1;
+            expire_session(s);
+        }
+    }
+    expire_all = 0;
+}
+
+static void on_usr1(int sig) {
+    (void)sig;
+    expire_all = 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--port N] [--latency MS] [--jitter MS] [--min-timeout MS] [--max-timeout MS] [--verbose]\n"
+                    "SIGUSR1 expires every session\n", argv0);
+}
+
+int main(int argc, const char* argv[])
+{
+    struct sockaddr_in addr;
+    struct pollfd *pfds = NULL;
+    int npfds = 0;
+    int lfd, one = 1, i;
+    int64_t last_check = 0;
+    struct node *root;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i+1 < argc) opt_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--latency") == 0 && i+1 < argc) opt_latency = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jitter") == 0 && i+1 < argc) opt_jitter = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--min-timeout") == 0 && i+1 < argc) opt_min_timeout = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-timeout") == 0 && i+1 < argc) opt_max_timeout = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--verbose") == 0) opt_verbose = 1;
+        else {
+            usage(argv[0]);
+            return EINVAL;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_usr1);
+    srand(time(NULL) ^ getpid());
+
+    root = make_node("/", NULL, 0, 0);
+    table_put(&nodes, root->path, root);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) return errno;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, 4096) != 0) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", opt_port, strerror(errno));
+        return errno;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+    fprintf(stderr, "zkstandin listening on port %d, latency %d+%dms\n", opt_port, opt_latency, opt_jitter);
+
+    for (;;) {
+        int64_t now = now_ms();
+        int64_t next = now + 100;
+        int n = 1;
+
+        if (npfds < nconns + 1) {
+            npfds = nconns + 1;
+            pfds = realloc(pfds, npfds * sizeof(struct pollfd));
+        }
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nconns; i++) {
+            struct conn *c = conns[i];
+            if (!c) continue;
+            pfds[n].fd = c->fd;
+            pfds[n].events = POLLIN | (c->outlen > c->outoff ? POLLOUT : 0);
+            pfds[n].revents = 0;
+            n++;
+            if (c->queue && c->queue->due < next) next = c->queue->due;
+        }
+        if (poll(pfds, n, next > now ? (int)(next - now) : 0) < 0 && errno != EINTR) {
+            perror("poll");
+            return errno;
+        }
+        if (pfds[0].revents & POLLIN) accept_conns(lfd);
+        for (i = 1; i < n; i++) {
+            struct conn *c = conns[pfds[i].fd];
+            if (!c) continue;
+            if (pfds[i].revents & (POLLIN|POLLHUP|POLLERR)) read_conn(c);
+        }
+        now = now_ms();
+        for (i = 0; i < nconns; i++) {
+            if (conns[i]) flush_conn(conns[i], now);
+        }
+        if (now - last_check >= 50 || expire_all) {
+            check_sessions(now);
+            last_check = now;
+        }
+    }
+}
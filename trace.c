@@ -0,0 +1,162 @@
+/**
+ * span export for zoo-locked
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+enum trace_span { SPAN_RUN, SPAN_PREPARE, SPAN_CONNECT, SPAN_QUEUE, SPAN_HOLD, SPAN_CHILD, SPAN_RELEASE, SPAN_COUNT };
+
+static const char *span_names[SPAN_COUNT] = {
+    "zoo-locked", "prepare", "connect", "queue", "hold", "child", "release"
+};
+
+static char trace_id[33];
+static char parent_id[17];      // span of whoever started us, may be empty
+static char span_ids[SPAN_COUNT][17];
+
+static void random_hex(char *buf, int bytes) {
+    unsigned char raw[16];
+    int fd = open("/dev/urandom", O_RDONLY);
+    int i;
+    
+    if (fd < 0 || read(fd, raw, bytes) != bytes) {
+        // no entropy, fall back to something that is at least unique per run
+        uint64_t seed = (uint64_t)zl_stats_now() ^ ((uint64_t)getpid() << 32);
+        for (i = 0; i < bytes; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            raw[i] = seed >> 56;
+        }
+    }
+    if (fd >= 0) close(fd);
+    for (i = 0; i < bytes; i++) {
+        snprintf(buf + 2*i, 3, "%02x", raw[i]);
+    }
+}
+
+void trace_init(void) {
+    const char *tp = getenv("TRACEPARENT");
+    int i;
+    
+    // version-traceid-parentid-flags
+    if (tp && strlen(tp) >= 55 && tp[2] == '-' && tp[35] == '-' && tp[52] == '-') {
+        memcpy(trace_id, tp+3, 32);
+        memcpy(parent_id, tp+36, 16);
+    } else {
+        random_hex(trace_id, 16);
+        parent_id[0] = 0;
+    }
+    for (i = 0; i < SPAN_COUNT; i++) {
+        random_hex(span_ids[i], 8);
+    }
+}
+
+void trace_export(void) {
+    char tp[64];
+    snprintf(tp, sizeof(tp), "00-%s-%s-01", trace_id, span_ids[SPAN_HOLD]);
+    setenv("TRACEPARENT", tp, 1);
+}
+
+static int json_escaped(char *buf, int len, const char *str) {
+    int n = 0;
+    for (; str && *str && n < len-7; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') { buf[n++] = '\\'; buf[n++] = c; }
+        else if (c < 0x20) n += snprintf(buf+n, 7, "\\u%04x", c);
+        else buf[n++] = c;
+    }
+    buf[n] = 0;
+    return n;
+}
+
+int trace_write(const char *file, const char *path, const char *node, const char *owner) {
+    int64_t end = zl_stats_now();
+    struct timespec rt;
+    int64_t offset;
+    int64_t spans[SPAN_COUNT][2];
+    char epath[512], enode[256], eowner[256];
+    char buf[8192];
+    int n = 0;
+    int i, fd;
+    const char *seq = node ? strrchr(node, '-') : NULL;
+    
+    // chrome traces from several processes only line up on wall clock time
+    clock_gettime(CLOCK_REALTIME, &rt);
+    offset = ((int64_t)rt.tv_sec * 1000000000 + rt.tv_nsec) - end;
+    
+    memset(spans, 0, sizeof(spans));
+    spans[SPAN_RUN][0] = zl_run_stats.start_ns;
+    spans[SPAN_RUN][1] = end;
+    if (zl_run_stats.prepare_ns) {
+        spans[SPAN_PREPARE][0] = zl_run_stats.prepare_ns;
+        spans[SPAN_PREPARE][1] = zl_run_stats.prepare_ns + zl_run_stats.phase_ns[PHASE_PREPARE];
+    }
+    if (zl_run_stats.phase_ns[PHASE_CONNECT]) {
+        spans[SPAN_CONNECT][0] = zl_run_stats.attempt_ns;
+        spans[SPAN_CONNECT][1] = zl_run_stats.attempt_ns + zl_run_stats.phase_ns[PHASE_CONNECT];
+    }
+    if (zl_run_stats.locking_ns) {
+        spans[SPAN_QUEUE][0] = zl_run_stats.locking_ns;
+        spans[SPAN_QUEUE][1] = zl_run_stats.decided_ns ? zl_run_stats.decided_ns : end;
+    }
+    if (zl_stats_hold_ns() >= 0) {
+        spans[SPAN_HOLD][0] = zl_run_stats.decided_ns;
+        spans[SPAN_HOLD][1] = zl_run_stats.released_ns;
+    }
+    if (zl_run_stats.spawned_ns) {
+        spans[SPAN_CHILD][0] = zl_run_stats.spawned_ns;
+        spans[SPAN_CHILD][1] = zl_run_stats.spawned_ns + zl_run_stats.phase_ns[PHASE_CHILD];
+    }
+    if (zl_run_stats.released_ns) {
+        spans[SPAN_RELEASE][0] = zl_run_stats.released_ns - zl_run_stats.phase_ns[PHASE_CLOSE];
+        spans[SPAN_RELEASE][1] = zl_run_stats.released_ns;
+    }
+    
+    json_escaped(epath, sizeof(epath), path);
+    json_escaped(enode, sizeof(enode), node);
+    json_escaped(eowner, sizeof(eowner), owner);
+    for (i = 0; i < SPAN_COUNT; i++) {
+        if (!spans[i][0]) continue;
+        // the child span nests under hold, everything else under the run
+        const char *parent = i == SPAN_RUN ? parent_id : span_ids[i == SPAN_CHILD ? SPAN_HOLD : SPAN_RUN];
+        n += snprintf(buf+n, n < (int)sizeof(buf) ? sizeof(buf)-n : 0,
+            "{\"name\":\"%s\",\"cat\":\"zoo_locked\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%s\",\"span_id\":\"%s\",\"parent_span_id\":\"%s\","
+            "\"lock.path\":\"%s\",\"lock.node\":\"%s\",\"lock.sequence\":%lld,\"lock.owner\":\"%s\",\"outcome\":\"%s\"}},\n",
+            span_names[i], (spans[i][0] + offset) / 1e3, (spans[i][1] - spans[i][0]) / 1e3,
+            (int)getpid(), (int)getpid(), trace_id, span_ids[i], parent,
+            epath, enode, seq ? atoll(seq+1) : -1LL, eowner, zl_run_stats.outcome ? zl_run_stats.outcome : "error");
+    }
+    if (n >= (int)sizeof(buf)) return ENOBUFS;
+    
+    // the JSON array format does not need the closing bracket, so runs
+    // can keep appending. a new file gets the opening bracket through
+    // link, so nobody can append to it before the bracket is there
+    if (access(file, F_OK) != 0) {
+        int len = strlen(file) + 32;
+        char tmp[len];
+        snprintf(tmp, len, "%s.%d.tmp", file, (int)getpid());
+        fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) return errno;
+        if (write(fd, "[\n", 2) == 2) link(tmp, file);
+        close(fd);
+        unlink(tmp);
+    }
+    fd = open(file, O_WRONLY|O_APPEND);
+    if (fd < 0) return errno;
+    if (write(fd, buf, n) != n) {
+        close(fd);
+        return errno;
+    }
+    close(fd);
+    return 0;
+}
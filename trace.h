@@ -0,0 +1,27 @@
+/**
+ * span export for zoo-locked
+ *
+ * every run is written as Chrome trace events (chrome://tracing,
+ * Perfetto) carrying W3C trace context ids, and the context of
+ * the hold span is passed to the task in TRACEPARENT
+ */
+
+#ifndef ZOO_LOCKED_TRACE_H
+#define ZOO_LOCKED_TRACE_H
+
+/**
+ * picks up TRACEPARENT from our environment if there is one,
+ * otherwise starts a new trace
+ */
+void trace_init(void);
+
+/** sets TRACEPARENT so the task's spans nest under the hold span */
+void trace_export(void);
+
+/**
+ * appends the spans of this run (see stats.h) to file.
+ * node is our lock node and owner the one holding the lock
+ */
+int trace_write(const char *file, const char *path, const char *node, const char *owner);
+
+#endif
@@ -0,0 +1,1194 @@
+/**
+ * libzoolocked, see zoolocked.h
+ *
+ * the recipe is lock_try from lock.c. waiting means watching the node
+ * right in front of ours and trying again once it is gone, with the
+ * node we already have. the watches only mark the paths they belong
+ * to, the calls are made by the waiting thread, or for async locks by
+ * one thread per shard, never from a watch
+ *
+ * the lock table is split in ZL_SHARDS by the hash of the path, each
+ * with its own mutex, cond and async worker. threads on different
+ * paths, and the watches of those paths, mostly never meet
+ *
+ * with zl_batch new async locks first gather in the client for a
+ * window, their nodes are made by one multi and listed in one
+ * pipelined round. what comes of it goes on in the shards as usual
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zookeeper.h>
+
+#include "zoolocked.h"
+#include "lock.h"
+#include "children.h"
+#include "scan.h"
+
+#define ZL_SHARDS 16        // a power of two
+#define ZL_BUCKETS 256      // per shard
+#define ZL_FOLDERS 8        // per shard
+#define ZL_WINDOW 64        // listings in flight after a batch
+
+/**
+ * what the client knows about one path. it lives while the path is
+ * claimed or queued for, and only the holder has a node and a watch
+ */
+struct zl_entry {
+    char *path;
+    struct zl_lock *holder;     // the claim, NULL while only queued for
+    char *watching;             // the node in front of the holder's
+    int woken;                  // it is gone, or there is nothing to wait for yet
+    int queued;                 // threads waiting for holder to let go
+    char *owner;                // held by another session, known while watched
+    char *tail;                 // the last node in the queue when we looked
+    char *kept;                 // our node, kept after unlock for the next one
+    int64_t kept_until;
+    int contended;              // someone else joined the queue behind kept, not kept again until released
+    struct zl_entry *lingering; // the next entry with a kept node
+    struct zl_entry *next;      // in its bucket
+};
+
+struct zl_wait {
+    struct zl_lock *lock;
+    int64_t deadline_ns;
+    int64_t queued_ns;          // when it came in, for zl_batch_stats
+    zl_lock_fn fn;
+    void *ctx;
+    struct zl_wait *next;
+};
+
+/**
+ * a slice of the lock table, picked by the hash of the path. paths in
+ * different shards never share a mutex, not even in a watch
+ */
+struct zl_shard {
+    pthread_mutex_t lock;       // guards the rest
+    pthread_cond_t cond;        // a path was released or a holder woken
+    struct zl_entry *paths[ZL_BUCKETS];
+    struct zl_entry *lingering; // the ones with a kept node, for the worker
+    struct zl_wait *waits;      // the async ones
+    char *folders[ZL_FOLDERS];  // made sure of lately
+    int nextfolder;
+    pthread_t worker;
+    int working;
+};
+
+struct zl_client {
+    struct backend *zb;
+    int flags;
+    int closing;                // set under all shard locks at once,
+    int linger_ms;              // so any one of them is enough to read
+    struct zl_shard shards[ZL_SHARDS];
+    pthread_mutex_t batch_lock; // guards the rest
+    pthread_cond_t batch_cond;  // a lock came in or the client closes
+    struct zl_wait *batch;      // async locks not sent yet
+    int batched;
+    int batch_max;
+    int batch_window_us;
+    int batch_closing;
+    pthread_t batcher;
+    int batching;
+    struct zl_batch_stats batch_stats;
+};
+
+struct zl_client* zl_wrap(struct backend *b, int flags) {
+    struct zl_client *c = calloc(1, sizeof(*c));
+    pthread_condattr_t attr;
+    int i;
+
+    if (!c) return NULL;
+    c->zb = b;
+    c->flags = flags;
+    // deadlines are on the monotonic clock, like backend_clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (i = 0; i < ZL_SHARDS; i++) {
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+        pthread_cond_init(&c->shards[i].cond, &attr);
+    }
+    pthread_mutex_init(&c->batch_lock, NULL);
+    pthread_cond_init(&c->batch_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return c;
+}
+
+struct zl_client* zl_open(const char *engine, const char *hosts, int timeout, int flags) {
+    struct backend *b = backend_open(engine, hosts, timeout);
+    struct zl_client *c;
+
+    if (!b) return NULL;
+    c = zl_wrap(b, flags);
+    if (!c) {
+        b->ops->close(b);
+        errno = ENOMEM;
+    }
+    return c;
+}
+
+struct backend* zl_backend(struct zl_client *c) {
+    return c->zb;
+}
+
+int64_t zl_deadline(int timeout_ms) {
+    return backend_clock() + (int64_t)timeout_ms * 1000000;
+}
+
+/** FNV-1a like metrics.c, over the first len bytes */
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    while (len--) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct zl_shard* shard_of(struct zl_client *c, uint64_t h) {
+    return &c->shards[h & (ZL_SHARDS - 1)];
+}
+
+/** the entry of the first len bytes of path, called with s->lock held */
+static struct zl_entry* find(struct zl_shard *s, uint64_t h, const char *path, size_t len) {
+    struct zl_entry *e;
+    for (e = s->paths[(h / ZL_SHARDS) % ZL_BUCKETS]; e; e = e->next) {
+        if (strncmp(e->path, path, len) == 0 && e->path[len] == 0) return e;
+    }
+    return NULL;
+}
+
+/** finds or adds the entry of path, called with s->lock held */
+static struct zl_entry* entry(struct zl_shard *s, uint64_t h, const char *path) {
+    struct zl_entry *e = find(s, h, path, strlen(path));
+    if (e) return e;
+    e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return NULL;
+    }
+    e->next = s->paths[(h / ZL_SHARDS) % ZL_BUCKETS];
+    s->paths[(h / ZL_SHARDS) % ZL_BUCKETS] = e;
+    return e;
+}
+
+static void free_entry(struct zl_entry *e) {
+    free(e->kept);
+    free(e->path);
+    free(e->watching);
+    free(e->owner);
+    free(e->tail);
+    free(e);
+}
+
+/** drops the owner another session has, its watch fired or failed */
+static void unseen(struct zl_entry *e) {
+    free(e->owner);
+    free(e->tail);
+    e->owner = e->tail = NULL;
+}
+
+/**
+ * drops e once nobody holds, queues for or remembers it, called with
+ * s->lock held
+ */
+static void forget(struct zl_shard *s, uint64_t h, struct zl_entry *e) {
+    struct zl_entry **p = &s->paths[(h / ZL_SHARDS) % ZL_BUCKETS];
+    if (e->holder || e->queued || e->owner || e->kept) return;
+    while (*p && *p != e) p = &(*p)->next;
+    if (*p) *p = e->next;
+    free_entry(e);
+}
+
+/** waits on the shard's cond until deadline, 0 once it passed */
+static int wait_until(struct zl_shard *s, int64_t deadline_ns) {
+    struct timespec ts;
+    if (deadline_ns == INT64_MAX) {
+        pthread_cond_wait(&s->cond, &s->lock);
+        return 1;
+    }
+    ts.tv_sec = deadline_ns / 1000000000;
+    ts.tv_nsec = deadline_ns % 1000000000;
+    return pthread_cond_timedwait(&s->cond, &s->lock, &ts) != ETIMEDOUT;
+}
+
+static struct zl_lock* new_lock(struct zl_client *c, const char *path) {
+    struct zl_lock *l = calloc(1, sizeof(*l));
+    if (!l) return NULL;
+    l->client = c;
+    l->path = strdup(path);
+    if (!l->path) {
+        free(l);
+        return NULL;
+    }
+    return l;
+}
+
+static void free_lock(struct zl_lock *l) {
+    free(l->path);
+    free(l->id);
+    free(l->owner);
+    free(l->blocker);
+    free(l);
+}
+
+/** the holder of a path while its kept node is being deleted */
+static struct zl_lock dropping;
+
+static void unlinger(struct zl_shard *s, struct zl_entry *e) {
+    struct zl_entry **p = &s->lingering;
+    while (*p && *p != e) p = &(*p)->lingering;
+    if (*p) *p = e->lingering;
+    e->lingering = NULL;
+}
+
+/**
+ * makes l the holder of e, called with the shard lock held. returns 1
+ * if l got the node we kept from the last unlock and holds the lock
+ * already
+ */
+static int claim(struct zl_shard *s, struct zl_entry *e, struct zl_lock *l) {
+    e->holder = l;
+    e->woken = 0;
+    l->claimed = 1;
+    if (!e->kept) return 0;
+    // someone queued behind it. the node stays on e for unkeep to
+    // delete, so that l queues up behind them with a new one
+    if (e->contended || !(l->owner = strdup(e->kept))) {
+        unlinger(s, e);
+        return 0;
+    }
+    l->id = e->kept;
+    e->kept = NULL;
+    unlinger(s, e);
+    return 1;
+}
+
+/**
+ * deletes the kept node claim left on the path of l, as lock_try
+ * would take it for ours again
+ */
+static void unkeep(struct zl_client *c, struct zl_lock *l) {
+    uint64_t h = hash_path(l->path, strlen(l->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_entry *e;
+    char *node = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, l->path, strlen(l->path));
+    if (e && e->holder == l && e->kept) {
+        node = child_path(l->path, e->kept);
+        free(e->kept);
+        e->kept = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (node) c->zb->ops->remove(c->zb, node, -1);
+    free(node);
+}
+
+/** deletes our node if there is one and gives the path up */
+static int release(struct zl_client *c, struct zl_lock *l) {
+    uint64_t h = hash_path(l->path, strlen(l->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_entry *e;
+    int ret = ZOK;
+
+    if (!l->claimed) return ZOK;
+    unkeep(c, l);
+    if (l->id) {
+        char *node = child_path(l->path, l->id);
+        ret = node ? c->zb->ops->remove(c->zb, node, -1) : ZSYSTEMERROR;
+        free(node);
+    }
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, l->path, strlen(l->path));
+    if (e && e->holder == l) {
+        e->holder = NULL;
+        free(e->watching);
+        e->watching = NULL;
+        // the next unlock may keep its node again
+        e->contended = 0;
+        forget(s, h, e);
+    }
+    l->claimed = 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int zl_lock_folder(struct zl_client *c, const char *path) {
+    struct zl_shard *s = shard_of(c, hash_path(path, strlen(path)));
+    char *copy;
+    int ret, i, known = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < ZL_FOLDERS && s->folders[i] && !known; i++) {
+        known = strcmp(s->folders[i], path) == 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (known) return ZOK;
+
+    ret = lock_parent(c->zb, path, c->flags);
+    // lock_try makes it again should zoo-locked gc take it away
+    if (ret == ZOK && (copy = strdup(path))) {
+        pthread_mutex_lock(&s->lock);
+        free(s->folders[s->nextfolder]);
+        s->folders[s->nextfolder] = copy;
+        s->nextfolder = (s->nextfolder + 1) % ZL_FOLDERS;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return ret;
+}
+
+/** one round of the recipe for a claimed lock */
+static enum zl_result attempt(struct zl_client *c, struct zl_lock *l) {
+    enum lock_result r;
+    // lock_try finds the node we already have by our session
+    free(l->id);
+    free(l->owner);
+    free(l->blocker);
+    l->id = l->owner = l->blocker = NULL;
+    unkeep(c, l);
+    if (zl_lock_folder(c, l->path) != ZOK) return ZL_FAILED;
+    r = lock_try(c->zb, l->path, c->flags, &l->id, &l->owner, &l->blocker);
+    return r == LOCK_ACQUIRED ? ZL_ACQUIRED : r == LOCK_LOCKED ? ZL_LOCKED : ZL_FAILED;
+}
+
+/** wakes every holder that watches and forgets the owners, the session is gone */
+static void all_gone(struct zl_client *c) {
+    struct zl_entry *e;
+    int i, j;
+
+    for (i = 0; i < ZL_SHARDS; i++) {
+        struct zl_shard *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (j = 0; j < ZL_BUCKETS; j++) {
+            struct zl_entry **p = &s->paths[j];
+            while ((e = *p)) {
+                if (e->watching) e->woken = 1;
+                unseen(e);
+                // the kept node went with the session
+                if (e->kept) {
+                    free(e->kept);
+                    e->kept = NULL;
+                    unlinger(s, e);
+                }
+                if (!e->holder && !e->queued) {
+                    *p = e->next;
+                    free_entry(e);
+                } else {
+                    p = &e->next;
+                }
+            }
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/**
+ * wakes the holder watching node, or forgets node as the owner of its
+ * folder. runs on whatever thread the engine fires watches, only the
+ * shard of node's folder is locked
+ */
+static void blocker_gone(struct backend *b, const char *node, void *ctx) {
+    struct zl_client *c = (struct zl_client*)ctx;
+    const char *slash = node ? strrchr(node, '/') : NULL;
+    struct zl_shard *s;
+    struct zl_entry *e;
+    uint64_t h;
+
+    if (!node || !*node || !slash) {
+        all_gone(c);
+        return;
+    }
+    h = hash_path(node, slash - node);
+    s = shard_of(c, h);
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, node, slash - node);
+    if (e && e->watching && strcmp(e->watching, node) == 0) {
+        e->woken = 1;
+        pthread_cond_broadcast(&s->cond);
+    }
+    if (e && e->owner && strcmp(e->owner, slash + 1) == 0) {
+        unseen(e);
+        forget(s, h, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * keeps the owner another session has on l's path, with one watch on
+ * its node. until that fires every try of this client on the path is
+ * LOCKED without a call, however many threads make them
+ */
+static void remember(struct zl_client *c, struct zl_lock *l) {
+    uint64_t h = hash_path(l->path, strlen(l->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_entry *e;
+    char *node;
+    int ret;
+
+    if (!l->owner || !(node = child_path(l->path, l->owner))) return;
+    pthread_mutex_lock(&s->lock);
+    e = entry(s, h, l->path);
+    // a try of another thread got there first, its watch is set
+    if (!e || e->owner || e->holder) {
+        pthread_mutex_unlock(&s->lock);
+        free(node);
+        return;
+    }
+    e->owner = strdup(l->owner);
+    e->tail = l->blocker ? strdup(l->blocker) : NULL;
+    if (!e->owner) unseen(e);
+    forget(s, h, e);
+    pthread_mutex_unlock(&s->lock);
+
+    // set after, the watch may fire before we are back
+    ret = c->zb->ops->watch(c->zb, node, blocker_gone, c);
+    if (ret != ZOK) {
+        pthread_mutex_lock(&s->lock);
+        e = find(s, h, l->path, strlen(l->path));
+        if (e && e->owner && strcmp(e->owner, l->owner) == 0) {
+            unseen(e);
+            forget(s, h, e);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(node);
+}
+
+enum zl_result zl_lock_try(struct zl_client *c, const char *path, struct zl_lock **lock) {
+    uint64_t h = hash_path(path, strlen(path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_lock *l = new_lock(c, path);
+    struct zl_entry *e;
+    enum zl_result r;
+    int other = 0;
+
+    *lock = NULL;
+    if (!l) return ZL_FAILED;
+    pthread_mutex_lock(&s->lock);
+    e = entry(s, h, path);
+    if (e && e->holder) {
+        // held or queued for by another thread of ours
+        other = 1;
+        l->owner = e->holder->owner ? strdup(e->holder->owner) : NULL;
+        l->blocker = e->holder->id ? strdup(e->holder->id) : NULL;
+    } else if (e && e->owner) {
+        // another session still has it, the watch on its node says so
+        other = 1;
+        l->owner = strdup(e->owner);
+        l->blocker = e->tail ? strdup(e->tail) : NULL;
+    } else if (e && claim(s, e, l)) {
+        pthread_mutex_unlock(&s->lock);
+        *lock = l;
+        return ZL_ACQUIRED;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!e) {
+        free_lock(l);
+        return ZL_FAILED;
+    }
+    if (other) {
+        *lock = l;
+        return ZL_LOCKED;
+    }
+
+    r = attempt(c, l);
+    if (r == ZL_ACQUIRED) {
+        *lock = l;
+        return r;
+    }
+    // do not stay in the queue, the next try would find us in front
+    release(c, l);
+    if (r == ZL_LOCKED) {
+        remember(c, l);
+        *lock = l;
+    } else {
+        free_lock(l);
+    }
+    return r;
+}
+
+/**
+ * one round of waiting for the holder of e. ZL_LOCKED means the node
+ * in front is watched and e gets woken once it is gone
+ */
+static enum zl_result step(struct zl_client *c, struct zl_shard *s, struct zl_entry *e, struct zl_lock *l,
+                           int64_t deadline_ns) {
+    enum zl_result r;
+    char *node;
+    int ret;
+
+    if (backend_clock() >= deadline_ns) return ZL_TIMEOUT;
+    r = attempt(c, l);
+    if (r != ZL_LOCKED) return r;
+    node = child_path(l->path, l->blocker);
+    if (!node) return ZL_FAILED;
+    pthread_mutex_lock(&s->lock);
+    free(e->watching);
+    e->watching = node;
+    e->woken = 0;
+    pthread_mutex_unlock(&s->lock);
+    ret = c->zb->ops->watch(c->zb, node, blocker_gone, c);
+    if (ret == ZNONODE) {
+        // gone already, try again straight away
+        pthread_mutex_lock(&s->lock);
+        e->woken = 1;
+        pthread_mutex_unlock(&s->lock);
+    } else if (ret != ZOK) {
+        return ZL_FAILED;
+    }
+    return ZL_LOCKED;
+}
+
+enum zl_result zl_lock_wait(struct zl_client *c, const char *path, int64_t deadline_ns, struct zl_lock **lock) {
+    uint64_t h = hash_path(path, strlen(path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_lock *l;
+    struct zl_entry *e;
+    enum zl_result r = ZL_TIMEOUT;
+
+    *lock = NULL;
+    l = new_lock(c, path);
+    if (!l) return ZL_FAILED;
+
+    // behind the other threads of ours first
+    pthread_mutex_lock(&s->lock);
+    e = entry(s, h, path);
+    if (!e) {
+        pthread_mutex_unlock(&s->lock);
+        free_lock(l);
+        return ZL_FAILED;
+    }
+    e->queued++;
+    while (e->holder && !c->closing) {
+        if (!wait_until(s, deadline_ns)) break;
+    }
+    e->queued--;
+    if (e->holder || c->closing) {
+        r = c->closing ? ZL_FAILED : ZL_TIMEOUT;
+        forget(s, h, e);
+        pthread_mutex_unlock(&s->lock);
+        free_lock(l);
+        return r;
+    }
+    if (claim(s, e, l)) {
+        pthread_mutex_unlock(&s->lock);
+        *lock = l;
+        return ZL_ACQUIRED;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // e stays while we hold the claim
+    for (;;) {
+        r = step(c, s, e, l, deadline_ns);
+        if (r != ZL_LOCKED) break;
+        pthread_mutex_lock(&s->lock);
+        while (!e->woken && !c->closing && wait_until(s, deadline_ns));
+        r = e->woken ? ZL_LOCKED : c->closing ? ZL_FAILED : ZL_TIMEOUT;
+        pthread_mutex_unlock(&s->lock);
+        if (r != ZL_LOCKED) break;
+    }
+
+    if (r == ZL_ACQUIRED) {
+        *lock = l;
+        return r;
+    }
+    release(c, l);
+    free_lock(l);
+    return r;
+}
+
+/** hands an async lock its outcome, called without the shard lock */
+static void decided(struct zl_client *c, struct zl_wait *w, enum zl_result r) {
+    if (r != ZL_ACQUIRED) {
+        release(c, w->lock);
+        free_lock(w->lock);
+        w->fn(c, r, NULL, w->ctx);
+    } else {
+        w->fn(c, r, w->lock, w->ctx);
+    }
+    free(w);
+}
+
+struct zl_worker {
+    struct zl_client *client;
+    struct zl_shard *shard;
+};
+
+static void unlink_wait(struct zl_shard *s, struct zl_wait *w) {
+    struct zl_wait **p = &s->waits;
+    while (*p && *p != w) p = &(*p)->next;
+    if (*p) *p = w->next;
+}
+
+/**
+ * deletes the node kept on e, called with s->lock held and let go in
+ * between. the path looks held meanwhile, a lock_try would take the
+ * node for ours
+ */
+static void drop(struct zl_client *c, struct zl_shard *s, struct zl_entry *e) {
+    uint64_t h = hash_path(e->path, strlen(e->path));
+    char *node = child_path(e->path, e->kept);
+    int closing;
+
+    free(e->kept);
+    e->kept = NULL;
+    unlinger(s, e);
+    if (!node) {
+        forget(s, h, e);
+        return;
+    }
+    e->holder = &dropping;
+    // the session takes it when closing
+    closing = c->closing;
+    pthread_mutex_unlock(&s->lock);
+    if (!closing) c->zb->ops->remove(c->zb, node, -1);
+    free(node);
+    pthread_mutex_lock(&s->lock);
+    e->holder = NULL;
+    forget(s, h, e);
+    pthread_cond_broadcast(&s->cond);
+}
+
+/**
+ * runs the async locks of one shard, one round of one lock at a time.
+ * a wait is ready when its path is free to claim or its watch fired.
+ * kept nodes are let go here once their time is up or someone queues
+ */
+static void* worker(void *arg) {
+    struct zl_client *c = ((struct zl_worker*)arg)->client;
+    struct zl_shard *s = ((struct zl_worker*)arg)->shard;
+
+    free(arg);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        struct zl_wait *w, *ready = NULL;
+        struct zl_entry *e = NULL;
+        int64_t now = backend_clock(), next = INT64_MAX;
+        enum zl_result r;
+        uint64_t h = 0;
+
+        for (e = s->lingering; e; e = e->lingering) {
+            if (c->closing || e->contended || e->kept_until <= now) break;
+            if (e->kept_until < next) next = e->kept_until;
+        }
+        if (e) {
+            drop(c, s, e);
+            continue;
+        }
+        e = NULL;
+        for (w = s->waits; w && !ready; w = w->next) {
+            h = hash_path(w->lock->path, strlen(w->lock->path));
+            e = find(s, h, w->lock->path, strlen(w->lock->path));
+            if (c->closing || w->deadline_ns <= now) ready = w;
+            else if (w->lock->claimed ? e->woken : !e || !e->holder) ready = w;
+            else if (w->deadline_ns < next) next = w->deadline_ns;
+        }
+        if (!ready) {
+            if (c->closing) break;
+            wait_until(s, next);
+            continue;
+        }
+        w = ready;
+        if (c->closing || w->deadline_ns <= now) {
+            r = c->closing ? ZL_FAILED : ZL_TIMEOUT;
+        } else {
+            if (!w->lock->claimed) {
+                e = entry(s, h, w->lock->path);
+                if (!e) {
+                    r = ZL_FAILED;
+                    goto done;
+                }
+                if (claim(s, e, w->lock)) {
+                    r = ZL_ACQUIRED;
+                    goto done;
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+            r = step(c, s, e, w->lock, w->deadline_ns);
+            pthread_mutex_lock(&s->lock);
+            if (r == ZL_LOCKED) continue;
+        }
+done:
+        unlink_wait(s, w);
+        pthread_mutex_unlock(&s->lock);
+        decided(c, w, r);
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/** starts the shard's worker unless it runs, called with s->lock held */
+static int start_worker(struct zl_client *c, struct zl_shard *s) {
+    struct zl_worker *arg;
+
+    if (s->working) return ZOK;
+    arg = malloc(sizeof(*arg));
+    if (!arg) return ZSYSTEMERROR;
+    arg->client = c;
+    arg->shard = s;
+    if (pthread_create(&s->worker, NULL, worker, arg) != 0) {
+        free(arg);
+        return ZSYSTEMERROR;
+    }
+    s->working = 1;
+    return ZOK;
+}
+
+/**
+ * puts w on its shard for the worker, called with s->lock held.
+ * returns an error code if it can not be run anymore
+ */
+static int queue_wait(struct zl_client *c, struct zl_shard *s, struct zl_wait *w) {
+    if (c->closing) return ZCLOSING;
+    if (start_worker(c, s) != ZOK) return ZSYSTEMERROR;
+    w->next = s->waits;
+    s->waits = w;
+    pthread_cond_broadcast(&s->cond);
+    return ZOK;
+}
+
+/**
+ * leaves a lock of a batch to its shard's worker. a claimed one is
+ * woken, lock_try finds the node the multi may have made by session
+ */
+static void unbatch(struct zl_client *c, struct zl_wait *w) {
+    uint64_t h = hash_path(w->lock->path, strlen(w->lock->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_entry *e;
+    int ret;
+
+    pthread_mutex_lock(&c->batch_lock);
+    c->batch_stats.fallbacks++;
+    pthread_mutex_unlock(&c->batch_lock);
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, w->lock->path, strlen(w->lock->path));
+    if (e && w->lock->claimed) e->woken = 1;
+    ret = queue_wait(c, s, w);
+    pthread_mutex_unlock(&s->lock);
+    if (ret != ZOK) decided(c, w, ZL_FAILED);
+}
+
+struct listing {
+    struct window *window;
+    int rc;
+    struct String_vector children;  // sorted copy
+};
+
+static void listed(struct backend *b, int rc, const char *path,
+                   const struct String_vector *children, const struct Stat *stat, void *ctx) {
+    struct listing *l = (struct listing*)ctx;
+    int i;
+
+    l->rc = rc;
+    if (rc == ZOK && children->count) {
+        l->children.data = calloc(children->count, sizeof(char*));
+        for (i = 0; l->children.data && i < children->count; i++) {
+            if (!(l->children.data[i] = strdup(children->data[i]))) break;
+        }
+        l->children.count = i;
+        if (i < children->count) l->rc = ZSYSTEMERROR;
+        sort_children(&l->children);
+    }
+    window_leave(l->window);
+}
+
+/**
+ * where a batched lock stands after the listing, the way lock_try
+ * decides. a blocker gets watched like in step
+ */
+static void settle(struct zl_client *c, struct zl_wait *w, struct listing *li) {
+    uint64_t h = hash_path(w->lock->path, strlen(w->lock->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_lock *l = w->lock;
+    struct zl_entry *e;
+    char *front, *node;
+    int ret;
+
+    if (li->rc != ZOK || !li->children.count) {
+        // our node went with the session, or the listing failed
+        if (li->rc == ZOK) decided(c, w, ZL_FAILED);
+        else unbatch(c, w);
+        return;
+    }
+    l->owner = strdup(li->children.data[0]);
+    front = child_floor(li->children.data, li->children.count, l->id);
+    if (!front) {
+        decided(c, w, l->owner && strcmp(l->owner, l->id) == 0 ? ZL_ACQUIRED : ZL_FAILED);
+        return;
+    }
+    l->blocker = strdup(front);
+    node = child_path(l->path, front);
+    if (!l->blocker || !node) {
+        free(node);
+        unbatch(c, w);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, l->path, strlen(l->path));
+    free(e->watching);
+    e->watching = node;
+    e->woken = 0;
+    pthread_mutex_unlock(&s->lock);
+    // before the worker gets w, it may be decided and gone right after
+    ret = c->zb->ops->watch(c->zb, node, blocker_gone, c);
+    pthread_mutex_lock(&s->lock);
+    if (ret != ZOK) e->woken = 1;
+    ret = queue_wait(c, s, w);
+    pthread_mutex_unlock(&s->lock);
+    if (ret != ZOK) decided(c, w, ZL_FAILED);
+}
+
+/** the size bucket of a batch of n, 1, 2-3, 4-7, ... */
+static int size_bucket(int n) {
+    int b = 0;
+    while (n > 1 && b < 7) {
+        n >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/**
+ * one multi creating the nodes of all locks of the batch whose path
+ * is free in this client, then one pipelined round of listings. the
+ * rest, and everything after a failed multi, goes one by one
+ */
+static void run_batch(struct zl_client *c, struct zl_wait *batch) {
+    struct zl_wait *w, *next, **sent;
+    struct listing *lists;
+    zoo_op_t *ops;
+    zoo_op_result_t *results;
+    char **bufs;
+    char prefix[30];
+    struct window win;
+    int64_t start = backend_clock(), waited = 0;
+    int i, n = 0, ret, stale;
+
+    for (w = batch; w; w = w->next) n++;
+    sent = calloc(n, sizeof(*sent));
+    ops = calloc(n, sizeof(*ops));
+    results = calloc(n, sizeof(*results));
+    bufs = calloc(n, sizeof(*bufs));
+    lists = calloc(n, sizeof(*lists));
+    snprintf(prefix, sizeof(prefix), "x-%016llx-", (unsigned long long)c->zb->ops->session(c->zb));
+
+    n = 0;
+    for (w = batch; w; w = next) {
+        uint64_t h = hash_path(w->lock->path, strlen(w->lock->path));
+        struct zl_shard *s = shard_of(c, h);
+        struct zl_entry *e = NULL;
+        int len = strlen(w->lock->path) + strlen(prefix) + 2;
+
+        next = w->next;
+        w->next = NULL;
+        waited += start - w->queued_ns;
+        if (!sent || !ops || !results || !bufs || !lists) {
+            unbatch(c, w);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        // held or queued for by us already, or twice in the batch
+        stale = 0;
+        if (!c->closing && (e = entry(s, h, w->lock->path)) && !e->holder) {
+            stale = e->kept != NULL;
+            if (claim(s, e, w->lock)) {
+                pthread_mutex_unlock(&s->lock);
+                decided(c, w, ZL_ACQUIRED);
+                continue;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+        // a kept node claim would not take is still ours, a new one
+        // next to it would never go away
+        if (stale || !w->lock->claimed || zl_lock_folder(c, w->lock->path) != ZOK || !(bufs[n] = malloc(2 * len + 20))) {
+            unbatch(c, w);
+            continue;
+        }
+        snprintf(bufs[n], len, "%s/%s", w->lock->path, prefix);
+        // the name we asked for, then the one we got
+        zoo_create_op_init(&ops[n], bufs[n], NULL, 0, &ZOO_OPEN_ACL_UNSAFE,
+                           ZOO_EPHEMERAL | ZOO_SEQUENCE, bufs[n] + len, len + 20);
+        sent[n++] = w;
+    }
+
+    ret = n ? c->zb->ops->multi(c->zb, n, ops, results) : ZOK;
+    for (i = 0; i < n && ret == ZOK; i++) {
+        if (results[i].err != ZOK || !(sent[i]->lock->id = getName(ops[i].create_op.buf))) ret = ZSYSTEMERROR;
+    }
+    if (ret != ZOK) {
+        // a gone folder or connection loss, lock_try sorts it out
+        for (i = 0; i < n; i++) unbatch(c, sent[i]);
+    } else if (n) {
+        window_init(&win, ZL_WINDOW);
+        for (i = 0; i < n; i++) {
+            lists[i].window = &win;
+            window_enter(&win);
+            // engines without pipelining call listed before this returns
+            if (backend_aget_children(c->zb, sent[i]->lock->path, listed, &lists[i]) != ZOK) {
+                lists[i].rc = ZSYSTEMERROR;
+                window_leave(&win);
+            }
+        }
+        window_wait(&win);
+        window_destroy(&win);
+    }
+
+    pthread_mutex_lock(&c->batch_lock);
+    if (n) {
+        c->batch_stats.batches++;
+        c->batch_stats.locks += n;
+        c->batch_stats.sizes[size_bucket(n)]++;
+        c->batch_stats.round_ns += backend_clock() - start;
+    }
+    c->batch_stats.wait_ns += waited;
+    pthread_mutex_unlock(&c->batch_lock);
+
+    for (i = 0; i < n && ret == ZOK; i++) {
+        settle(c, sent[i], &lists[i]);
+        free_String_vector(&lists[i].children);
+    }
+    for (i = 0; bufs && i < n; i++) free(bufs[i]);
+    free(sent);
+    free(ops);
+    free(results);
+    free(bufs);
+    free(lists);
+}
+
+/** gathers async locks for a window and sends them off in batches */
+static void* batcher(void *arg) {
+    struct zl_client *c = (struct zl_client*)arg;
+
+    pthread_mutex_lock(&c->batch_lock);
+    for (;;) {
+        struct zl_wait *batch;
+        struct timespec ts;
+        int64_t until;
+
+        while (!c->batch && !c->batch_closing) pthread_cond_wait(&c->batch_cond, &c->batch_lock);
+        if (!c->batch) break;
+        // the window opens with the oldest lock waiting
+        for (batch = c->batch; batch->next; batch = batch->next);
+        until = batch->queued_ns + (int64_t)c->batch_window_us * 1000;
+        while (c->batched < c->batch_max && !c->batch_closing && backend_clock() < until) {
+            ts.tv_sec = until / 1000000000;
+            ts.tv_nsec = until % 1000000000;
+            pthread_cond_timedwait(&c->batch_cond, &c->batch_lock, &ts);
+        }
+        // the oldest max go, the list is newest first
+        if (c->batched > c->batch_max && c->batch_max > 1) {
+            struct zl_wait **p = &c->batch;
+            int keep;
+            for (keep = c->batched - c->batch_max; keep > 0; keep--) p = &(*p)->next;
+            batch = *p;
+            *p = NULL;
+            c->batched -= c->batch_max;
+        } else {
+            batch = c->batch;
+            c->batch = NULL;
+            c->batched = 0;
+        }
+        pthread_mutex_unlock(&c->batch_lock);
+        run_batch(c, batch);
+        pthread_mutex_lock(&c->batch_lock);
+    }
+    pthread_mutex_unlock(&c->batch_lock);
+    return NULL;
+}
+
+void zl_batch(struct zl_client *c, int window_us, int max) {
+    pthread_mutex_lock(&c->batch_lock);
+    c->batch_window_us = window_us;
+    c->batch_max = max;
+    pthread_cond_broadcast(&c->batch_cond);
+    pthread_mutex_unlock(&c->batch_lock);
+}
+
+void zl_batch_stats(struct zl_client *c, struct zl_batch_stats *out) {
+    pthread_mutex_lock(&c->batch_lock);
+    *out = c->batch_stats;
+    pthread_mutex_unlock(&c->batch_lock);
+}
+
+/** hands w to the batcher, returns 0 if batching is off */
+static int batch_wait(struct zl_client *c, struct zl_wait *w) {
+    int ret = 0;
+
+    pthread_mutex_lock(&c->batch_lock);
+    if (c->batch_max > 1 && !c->batch_closing) {
+        if (!c->batching && pthread_create(&c->batcher, NULL, batcher, c) == 0) c->batching = 1;
+        if (c->batching) {
+            w->queued_ns = backend_clock();
+            w->next = c->batch;
+            c->batch = w;
+            c->batched++;
+            // the first opens the window, the last fills it
+            if (c->batched == 1 || c->batched >= c->batch_max) pthread_cond_broadcast(&c->batch_cond);
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&c->batch_lock);
+    return ret;
+}
+
+int zl_lock_async(struct zl_client *c, const char *path, int64_t deadline_ns, zl_lock_fn fn, void *ctx) {
+    struct zl_shard *s = shard_of(c, hash_path(path, strlen(path)));
+    struct zl_wait *w = calloc(1, sizeof(*w));
+    int ret;
+
+    if (!w || !(w->lock = new_lock(c, path))) {
+        free(w);
+        return ZSYSTEMERROR;
+    }
+    w->deadline_ns = deadline_ns;
+    w->fn = fn;
+    w->ctx = ctx;
+    if (batch_wait(c, w)) return ZOK;
+    pthread_mutex_lock(&s->lock);
+    ret = queue_wait(c, s, w);
+    pthread_mutex_unlock(&s->lock);
+    if (ret != ZOK) {
+        free_lock(w->lock);
+        free(w);
+    }
+    return ret;
+}
+
+/**
+ * someone joined or left the folder of a kept node, or with an empty
+ * path the session is gone. the worker lets the node go
+ */
+static void folder_changed(struct backend *b, const char *path, void *ctx) {
+    struct zl_client *c = (struct zl_client*)ctx;
+    struct zl_shard *s;
+    struct zl_entry *e;
+    uint64_t h;
+    int i;
+
+    for (i = 0; i < ZL_SHARDS && (!path || !*path); i++) {
+        s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (e = s->lingering; e; e = e->lingering) e->contended = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!path || !*path) return;
+    h = hash_path(path, strlen(path));
+    s = shard_of(c, h);
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, path, strlen(path));
+    if (e && e->kept) {
+        e->contended = 1;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * gives the path up but keeps our node for zl_linger, returns 0 if it
+ * has to go the usual way
+ */
+static int linger(struct zl_client *c, struct zl_lock *l) {
+    uint64_t h = hash_path(l->path, strlen(l->path));
+    struct zl_shard *s = shard_of(c, h);
+    struct zl_entry *e;
+    int count = 0, ret;
+
+    if (!l->claimed || !l->id || !c->zb->ops->watch_children) return 0;
+    pthread_mutex_lock(&s->lock);
+    e = find(s, h, l->path, strlen(l->path));
+    // a lease someone queued behind goes the usual way once, or the
+    // next local claim would keep them waiting again
+    if (!c->linger_ms || c->closing || !e || e->holder != l || e->kept || e->contended || start_worker(c, s) != ZOK) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    e->holder = NULL;
+    free(e->watching);
+    e->watching = NULL;
+    e->kept = l->id;
+    e->kept_until = backend_clock() + (int64_t)c->linger_ms * 1000000;
+    e->contended = 0;
+    e->lingering = s->lingering;
+    s->lingering = e;
+    l->id = NULL;
+    l->claimed = 0;
+    // the queue of ours gets it right away
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    // kept first, a contender coming in right after is seen either way
+    ret = c->zb->ops->watch_children(c->zb, l->path, &count, folder_changed, c);
+    if (ret != ZOK || count > 1) folder_changed(c->zb, l->path, c);
+    return 1;
+}
+
+/** takes every shard lock, in order. nothing else holds two of them */
+static void lock_shards(struct zl_client *c) {
+    int i;
+    for (i = 0; i < ZL_SHARDS; i++) pthread_mutex_lock(&c->shards[i].lock);
+}
+
+static void unlock_shards(struct zl_client *c) {
+    int i;
+    for (i = ZL_SHARDS - 1; i >= 0; i--) pthread_mutex_unlock(&c->shards[i].lock);
+}
+
+void zl_linger(struct zl_client *c, int ms) {
+    lock_shards(c);
+    c->linger_ms = ms;
+    unlock_shards(c);
+}
+
+int zl_unlock(struct zl_lock *lock) {
+    int ret = linger(lock->client, lock) ? ZOK : release(lock->client, lock);
+    free_lock(lock);
+    return ret;
+}
+
+void zl_close(struct zl_client *c) {
+    int i, j, k;
+
+    // what is still gathered goes out, the shards fail it below
+    pthread_mutex_lock(&c->batch_lock);
+    c->batch_closing = 1;
+    pthread_cond_broadcast(&c->batch_cond);
+    pthread_mutex_unlock(&c->batch_lock);
+    if (c->batching) pthread_join(c->batcher, NULL);
+
+    lock_shards(c);
+    c->closing = 1;
+    for (i = 0; i < ZL_SHARDS; i++) pthread_cond_broadcast(&c->shards[i].cond);
+    unlock_shards(c);
+    for (i = 0; i < ZL_SHARDS; i++) {
+        if (c->shards[i].working) pthread_join(c->shards[i].worker, NULL);
+    }
+
+    // the session takes our nodes with it
+    c->zb->ops->close(c->zb);
+    for (i = 0; i < ZL_SHARDS; i++) {
+        struct zl_shard *s = &c->shards[i];
+        for (j = 0; j < ZL_BUCKETS; j++) {
+            while (s->paths[j]) {
+                struct zl_entry *e = s->paths[j];
+                s->paths[j] = e->next;
+                if (e->holder) free_lock(e->holder);
+                free_entry(e);
+            }
+        }
+        for (k = 0; k < ZL_FOLDERS; k++) free(s->folders[k]);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+    }
+    pthread_cond_destroy(&c->batch_cond);
+    pthread_mutex_destroy(&c->batch_lock);
+    free(c);
+}
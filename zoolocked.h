@@ -0,0 +1,136 @@
+/**
+ * libzoolocked, the lock recipe of zoo-locked for use in-process
+ *
+ * a client is one session, shared by every lock taken through it and
+ * by all threads. taking a lock costs a few round trips on that
+ * session instead of starting zoo-locked and connecting for each
+ * critical section
+ *
+ *   struct zl_client *c = zl_open("zk", "zk1:2181,zk2:2181", 30000, 0);
+ *   struct zl_lock *l;
+ *   if (zl_lock_wait(c, "/locks/nightly", zl_deadline(5000), &l) == ZL_ACQUIRED) {
+ *       ...
+ *       zl_unlock(l);
+ *   }
+ *   zl_close(c);
+ *
+ * the lock nodes are named after the session, so within one client a
+ * path is only locked once at a time. a second try on it comes back
+ * ZL_LOCKED, a second wait queues behind the first in-process
+ */
+
+#ifndef ZOO_LOCKED_ZOOLOCKED_H
+#define ZOO_LOCKED_ZOOLOCKED_H
+
+#include <stdint.h>
+#include "backend.h"
+
+/** zl_open flags, lock folders become ZooKeeper 3.5 containers */
+#define ZL_CONTAINER 4
+
+enum zl_result {
+    ZL_ACQUIRED,
+    ZL_LOCKED,      // someone else holds it, only from zl_lock_try
+    ZL_TIMEOUT,     // the deadline passed while waiting
+    ZL_FAILED       // retries ran out, the session is gone or the client closed
+};
+
+struct zl_client;
+
+struct zl_lock {
+    struct zl_client *client;
+    char *path;     // the lock folder
+    char *id;       // our node in it
+    char *owner;    // the node holding the lock when we last looked
+    char *blocker;  // on ZL_LOCKED the node right in front of us
+    int claimed;    // the client's, set while the path is ours in-process
+};
+
+/**
+ * called once an async lock is decided, on the client's own thread.
+ * lock is set on ZL_ACQUIRED only and then has to be unlocked
+ */
+typedef void (*zl_lock_fn)(struct zl_client *c, enum zl_result result, struct zl_lock *lock, void *ctx);
+
+/**
+ * opens a session on an engine like backend_open does. returns NULL
+ * and sets errno on failure
+ */
+struct zl_client* zl_open(const char *engine, const char *hosts, int timeout, int flags);
+
+/** makes a client of an open backend, which it then owns */
+struct zl_client* zl_wrap(struct backend *b, int flags);
+
+struct backend* zl_backend(struct zl_client *c);
+
+/**
+ * closes the session. async locks still pending get ZL_FAILED first,
+ * locks still held go with the session and their handles are freed.
+ * every zl_lock_try and zl_lock_wait on c must have returned before,
+ * they are not waited for, and the handles are not to be used after
+ */
+void zl_close(struct zl_client *c);
+
+/** a deadline timeout_ms from now, for zl_lock_wait and zl_lock_async */
+int64_t zl_deadline(int timeout_ms);
+
+/**
+ * makes sure the lock folder exists ahead of the first lock on it,
+ * returns a ZooKeeper error code. the lock calls do this themselves
+ * when they have not seen the folder before
+ */
+int zl_lock_folder(struct zl_client *c, const char *path);
+
+/**
+ * one attempt at the lock on path. *lock is set on ZL_ACQUIRED, and on
+ * ZL_LOCKED to say who is in front, our node is already gone then.
+ * either way it is given back with zl_unlock
+ */
+enum zl_result zl_lock_try(struct zl_client *c, const char *path, struct zl_lock **lock);
+
+/**
+ * queues for the lock on path until it is ours or deadline (see
+ * zl_deadline) passes. *lock is set on ZL_ACQUIRED only
+ */
+enum zl_result zl_lock_wait(struct zl_client *c, const char *path, int64_t deadline_ns, struct zl_lock **lock);
+
+/**
+ * zl_lock_wait without blocking the caller, fn is run once it is
+ * decided. returns ZOK or an error code, fn is not run then
+ */
+int zl_lock_async(struct zl_client *c, const char *path, int64_t deadline_ns, zl_lock_fn fn, void *ctx);
+
+/**
+ * keeps the node of a lock for ms after zl_unlock, so that the next
+ * lock of the path in this client gets it without a call. it goes as
+ * soon as another session joins the queue behind it. needs an engine
+ * with child watches, 0 turns it off again
+ */
+void zl_linger(struct zl_client *c, int ms);
+
+/** how batching went so far, see zl_batch */
+struct zl_batch_stats {
+    uint64_t batches;       // multis sent
+    uint64_t locks;         // async locks that went out in one
+    uint64_t fallbacks;     // async locks left to the one by one path
+    uint64_t sizes[8];      // batches of 1, 2-3, 4-7, ... 128 and more locks
+    uint64_t wait_ns;       // summed time locks sat in the window
+    uint64_t round_ns;      // summed time of the multis and their listings
+};
+
+/**
+ * groups async locks that come in within window_us of the first one,
+ * or max of them, into one multi creating all their nodes and one
+ * round of pipelined listings. max 0 or 1 turns batching off again
+ */
+void zl_batch(struct zl_client *c, int window_us, int max);
+
+void zl_batch_stats(struct zl_client *c, struct zl_batch_stats *out);
+
+/**
+ * releases a lock and frees it, returns the ZooKeeper error code of
+ * deleting our node. ZNONODE means the lock was lost before
+ */
+int zl_unlock(struct zl_lock *lock);
+
+#endif
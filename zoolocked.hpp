@@ -0,0 +1,495 @@
+/**
+ * zoo-locked for C++17, header only
+ *
+ * lock_client<Backend, RetryPolicy, Clock> runs the same recipe as
+ * lock.c, with the engine, the retries and the clock picked at
+ * compile time. the children are scanned in one pass for our node,
+ * the owner and the node in front of us, no sort and no vtable
+ *
+ *   zoolocked::lock_client<zoolocked::zk_backend> client(zh);
+ *   if (auto lock = client.try_lock("/nightly")) {
+ *       ...
+ *   }   // our node is deleted here
+ *
+ * scoped_zk_lock is move-only, moving it hands the held lock on
+ * without touching the server
+ */
+
+#ifndef ZOO_LOCKED_ZOOLOCKED_HPP
+#define ZOO_LOCKED_ZOOLOCKED_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <zookeeper.h>
+
+extern "C" {
+#include "backend.h"
+}
+
+namespace zoolocked {
+
+enum class lock_status {
+    acquired,
+    locked,     // someone else is in front of us
+    timeout,    // the deadline passed while waiting
+    failed      // retries ran out or our node went missing
+};
+
+/** ZooKeeper 3.5 containers for the lock folders, like LOCK_CONTAINER */
+constexpr int container = 4;
+
+/* ---------------------------------------------------------------- */
+/* retry policies                                                   */
+
+/** one call, ZCONNECTIONLOSS is final */
+struct no_retry {
+    static constexpr int attempts = 1;
+    static constexpr std::chrono::microseconds delay(int) { return std::chrono::microseconds(0); }
+};
+
+/** the 5 tries 500us apart of lock.c */
+template <int Attempts = 5, int DelayUs = 500>
+struct fixed_retry {
+    static constexpr int attempts = Attempts;
+    static constexpr std::chrono::microseconds delay(int) { return std::chrono::microseconds(DelayUs); }
+};
+
+/** doubling from BaseUs up to MaxUs */
+template <int Attempts = 8, int BaseUs = 500, int MaxUs = 64000>
+struct exponential_retry {
+    static constexpr int attempts = Attempts;
+    static constexpr std::chrono::microseconds delay(int attempt) {
+        std::int64_t us = static_cast<std::int64_t>(BaseUs) << (attempt < 20 ? attempt : 20);
+        return std::chrono::microseconds(us < MaxUs ? us : MaxUs);
+    }
+};
+
+/* ---------------------------------------------------------------- */
+/* backends                                                         */
+
+/**
+ * a backend has exists, create, get_children, remove, watch and
+ * session with the results of the zoo_* calls. watch calls fn(ctx)
+ * once when the node is gone or the session expired, and returns
+ * ZNONODE without watching when it is gone already
+ */
+using watch_fn = void (*)(void *ctx);
+
+/** the synchronous zoo_* calls on a handle of the caller */
+class zk_backend {
+public:
+    explicit zk_backend(zhandle_t *zh) noexcept : zh_(zh) {}
+
+    int exists(const char *path) { return zoo_exists(zh_, path, 0, nullptr); }
+    int create(const char *path, int flags, char *buf, int buflen) {
+        return zoo_create(zh_, path, nullptr, -1, &ZOO_OPEN_ACL_UNSAFE, flags, buf, buflen);
+    }
+    int get_children(const char *path, String_vector *out) { return zoo_get_children(zh_, path, 0, out); }
+    int remove(const char *path) { return zoo_delete(zh_, path, -1); }
+    int watch(const char *path, watch_fn fn, void *ctx) {
+        auto *w = new watched{fn, ctx, false};
+        char buf[1];
+        int len = sizeof(buf);
+        // a get of a missing node, unlike exists, leaves no watch behind
+        int ret = zoo_wget(zh_, path, fired, w, buf, &len, nullptr);
+        if (ret != ZOK) delete w;
+        return ret;
+    }
+    std::int64_t session() { return zoo_client_id(zh_)->client_id; }
+
+private:
+    struct watched {
+        watch_fn fn;
+        void *ctx;
+        bool done = false;
+    };
+
+    static void fired(zhandle_t *, int type, int state, const char *, void *ctx) {
+        auto *w = static_cast<watched*>(ctx);
+        // like backend_zk.c, only expiry makes a session event count
+        if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) return;
+        if (w->done) return;
+        w->done = true;
+        w->fn(w->ctx);
+        if (type != ZOO_SESSION_EVENT) delete w;
+    }
+
+    zhandle_t *zh_;
+};
+
+/** any engine of backend.h, through its vtable */
+class vtable_backend {
+public:
+    explicit vtable_backend(struct backend *b) noexcept : b_(b) {}
+
+    int exists(const char *path) {
+        struct Stat stat;
+        return b_->ops->exists(b_, path, &stat);
+    }
+    int create(const char *path, int flags, char *buf, int buflen) {
+        return b_->ops->create(b_, path, nullptr, 0, flags, buf, buflen);
+    }
+    int get_children(const char *path, String_vector *out) { return b_->ops->get_children(b_, path, out); }
+    int remove(const char *path) { return b_->ops->remove(b_, path, -1); }
+    int watch(const char *path, watch_fn fn, void *ctx) {
+        auto *w = new watched{fn, ctx};
+        int ret = b_->ops->watch(b_, path, fired, w);
+        if (ret != ZOK) delete w;
+        return ret;
+    }
+    std::int64_t session() { return b_->ops->session(b_); }
+
+private:
+    struct watched {
+        watch_fn fn;
+        void *ctx;
+    };
+
+    static void fired(struct backend *, const char *, void *ctx) {
+        auto *w = static_cast<watched*>(ctx);
+        w->fn(w->ctx);
+        delete w;
+    }
+
+    struct backend *b_;
+};
+
+/* ---------------------------------------------------------------- */
+/* the guard                                                        */
+
+template <class Backend, class RetryPolicy, class Clock> class lock_client;
+template <class Executor, class RetryPolicy> class async_lock_client;
+
+/**
+ * a held lock, or the outcome of not getting it. deletes our node
+ * when it goes out of scope
+ */
+class scoped_zk_lock {
+public:
+    scoped_zk_lock() noexcept = default;
+    scoped_zk_lock(const scoped_zk_lock&) = delete;
+    scoped_zk_lock& operator=(const scoped_zk_lock&) = delete;
+
+    scoped_zk_lock(scoped_zk_lock&& other) noexcept
+        : backend_(std::exchange(other.backend_, nullptr)), remove_(other.remove_),
+          node_(std::move(other.node_)), blocker_(std::move(other.blocker_)), status_(other.status_) {
+        other.status_ = lock_status::failed;
+    }
+
+    scoped_zk_lock& operator=(scoped_zk_lock&& other) noexcept {
+        if (this != &other) {
+            unlock();
+            backend_ = std::exchange(other.backend_, nullptr);
+            remove_ = other.remove_;
+            node_ = std::move(other.node_);
+            blocker_ = std::move(other.blocker_);
+            status_ = std::exchange(other.status_, lock_status::failed);
+        }
+        return *this;
+    }
+
+    ~scoped_zk_lock() { unlock(); }
+
+    explicit operator bool() const noexcept { return status_ == lock_status::acquired; }
+    lock_status status() const noexcept { return status_; }
+    /** the full path of our node while we hold the lock */
+    const std::string& node() const noexcept { return node_; }
+    /** on lock_status::locked, the node right in front of us */
+    const std::string& blocker() const noexcept { return blocker_; }
+
+    /** releases the lock early, returns ZOK or the error of the delete */
+    int unlock() noexcept {
+        int ret = ZOK;
+        if (backend_) ret = remove_(backend_, node_.c_str());
+        backend_ = nullptr;
+        if (status_ == lock_status::acquired) status_ = lock_status::failed;
+        return ret;
+    }
+
+private:
+    template <class, class, class> friend class lock_client;
+    template <class, class> friend class async_lock_client;
+
+    scoped_zk_lock(lock_status status, std::string blocker) noexcept
+        : blocker_(std::move(blocker)), status_(status) {}
+
+    scoped_zk_lock(void *backend, int (*remove)(void*, const char*), std::string node) noexcept
+        : backend_(backend), remove_(remove), node_(std::move(node)), status_(lock_status::acquired) {}
+
+    void *backend_ = nullptr;
+    int (*remove_)(void*, const char*) = nullptr;
+    std::string node_;
+    std::string blocker_;
+    lock_status status_ = lock_status::failed;
+};
+
+/* ---------------------------------------------------------------- */
+/* the recipe                                                       */
+
+namespace detail {
+
+/** the sequence of an x-<session>-<sequence> name, -1 for other names */
+inline std::int64_t sequence_of(std::string_view name) noexcept {
+    std::size_t dash = name.rfind('-');
+    std::int64_t seq = 0;
+    if (name.size() < 20 || name.compare(0, 2, "x-") != 0 || dash != 18 || dash + 1 == name.size()) return -1;
+    for (std::size_t i = dash + 1; i < name.size(); i++) {
+        if (name[i] < '0' || name[i] > '9') return -1;
+        seq = seq * 10 + (name[i] - '0');
+    }
+    return seq;
+}
+
+/** where we stand in a listing */
+struct standing {
+    std::string_view ours;      // empty when we have no node
+    std::string_view owner;     // lowest sequence
+    std::string_view blocker;   // highest sequence below ours
+};
+
+inline standing stand(const String_vector &children, std::string_view prefix) noexcept {
+    standing s;
+    std::int64_t ours = -1, owner = -1, blocker = -1;
+    for (int i = 0; i < children.count; i++) {
+        std::string_view name(children.data[i]);
+        if (name.compare(0, prefix.size(), prefix) == 0) {
+            s.ours = name;
+            ours = sequence_of(name);
+        }
+    }
+    for (int i = 0; i < children.count; i++) {
+        std::string_view name(children.data[i]);
+        std::int64_t seq = sequence_of(name);
+        if (seq < 0) continue;
+        if (owner < 0 || seq < owner) {
+            owner = seq;
+            s.owner = name;
+        }
+        if (ours >= 0 && seq < ours && seq > blocker) {
+            blocker = seq;
+            s.blocker = name;
+        }
+    }
+    return s;
+}
+
+/** frees a listing on every way out */
+struct listing {
+    String_vector v{0, nullptr};
+    listing() = default;
+    listing(const listing&) = delete;
+    listing& operator=(const listing&) = delete;
+    ~listing() { clear(); }
+    void clear() {
+        if (v.data) deallocate_String_vector(&v);
+        v.count = 0;
+        v.data = nullptr;
+    }
+};
+
+/** what a wait shares with the watch, which may fire after it ended */
+struct wakeup {
+    std::mutex m;
+    std::condition_variable cv;
+    bool fired = false;
+
+    static void fire(void *ctx) {
+        auto *held = static_cast<std::shared_ptr<wakeup>*>(ctx);
+        {
+            std::lock_guard<std::mutex> g((*held)->m);
+            (*held)->fired = true;
+        }
+        (*held)->cv.notify_all();
+        delete held;
+    }
+};
+
+/** true for a Clock with a static sleep_for of its own */
+template <class Clock, class = void>
+struct sleeps : std::false_type {};
+
+template <class Clock>
+struct sleeps<Clock, std::void_t<decltype(Clock::sleep_for(std::chrono::microseconds()))>> : std::true_type {};
+
+/** the pause between retries, on Clock's own sleep_for if it has one */
+template <class Clock>
+void pause(std::chrono::microseconds delay) {
+    if constexpr (sleeps<Clock>::value) Clock::sleep_for(delay);
+    else std::this_thread::sleep_for(delay);
+}
+
+} // namespace detail
+
+/**
+ * takes locks over one session of Backend. the client only keeps the
+ * backend, locks are taken from any number of threads as long as the
+ * backend allows that, but a path once at a time: our nodes are found
+ * by the session in their name. it can not be copied or moved, the
+ * locks it hands out point to its backend.
+ *
+ * Clock decides the deadlines. the retries sleep with its static
+ * sleep_for if it has one, a test clock can let time pass there, and
+ * on the thread's real sleep otherwise
+ */
+template <class Backend, class RetryPolicy = fixed_retry<>, class Clock = std::chrono::steady_clock>
+class lock_client {
+public:
+    using time_point = typename Clock::time_point;
+
+    template <class... Args>
+    explicit lock_client(Args&&... args) : backend_(std::forward<Args>(args)...) {}
+
+    lock_client(const lock_client&) = delete;
+    lock_client& operator=(const lock_client&) = delete;
+    lock_client(lock_client&&) = delete;
+    lock_client& operator=(lock_client&&) = delete;
+
+    /** flags for new lock folders, 0 or zoolocked::container */
+    void folder_flags(int flags) noexcept { flags_ = flags; }
+
+    Backend& backend() noexcept { return backend_; }
+
+    /** one attempt, leaves the queue again when someone is in front */
+    scoped_zk_lock try_lock(const std::string &path) {
+        std::string node, blocker;
+        lock_status status = attempt(path, node, blocker);
+        if (status == lock_status::acquired) return held(std::move(node));
+        if (!node.empty()) backend_.remove(node.c_str());
+        return scoped_zk_lock(status, std::move(blocker));
+    }
+
+    /** queues until the lock is ours or deadline passed */
+    scoped_zk_lock lock(const std::string &path, time_point deadline) {
+        std::string node, blocker;
+        for (;;) {
+            if (Clock::now() >= deadline) break;
+            lock_status status = attempt(path, node, blocker);
+            if (status == lock_status::acquired) return held(std::move(node));
+            if (status != lock_status::locked) {
+                if (!node.empty()) backend_.remove(node.c_str());
+                return scoped_zk_lock(status, std::string());
+            }
+            auto wake = std::make_shared<detail::wakeup>();
+            auto *ctx = new std::shared_ptr<detail::wakeup>(wake);
+            int ret = backend_.watch((path + "/" + blocker).c_str(), detail::wakeup::fire, ctx);
+            if (ret == ZNONODE) {
+                // gone already, try again straight away
+                delete ctx;
+                continue;
+            }
+            if (ret != ZOK) {
+                delete ctx;
+                break;
+            }
+            std::unique_lock<std::mutex> g(wake->m);
+            if (!wake->cv.wait_until(g, deadline, [&] { return wake->fired; })) break;
+        }
+        if (!node.empty()) backend_.remove(node.c_str());
+        return scoped_zk_lock(lock_status::timeout, std::move(blocker));
+    }
+
+    template <class Rep, class Period>
+    scoped_zk_lock lock(const std::string &path, std::chrono::duration<Rep, Period> timeout) {
+        return lock(path, Clock::now() + std::chrono::duration_cast<typename Clock::duration>(timeout));
+    }
+
+private:
+    /** runs call until it is not a connection loss or the policy gives up */
+    template <class Call>
+    int retried(Call &&call) {
+        int ret = ZCONNECTIONLOSS;
+        for (int i = 0; i < RetryPolicy::attempts; i++) {
+            ret = call();
+            if (ret != ZCONNECTIONLOSS) break;
+            if (i + 1 < RetryPolicy::attempts) detail::pause<Clock>(RetryPolicy::delay(i));
+        }
+        return ret;
+    }
+
+    int make_folder(const std::string &path) {
+        int ret = retried([&] { return backend_.create(path.c_str(), flags_, nullptr, 0); });
+        // an older server does not know containers
+        if (flags_ && (ret == ZBADARGUMENTS || ret == ZUNIMPLEMENTED)) {
+            flags_ = 0;
+            ret = retried([&] { return backend_.create(path.c_str(), 0, nullptr, 0); });
+        }
+        return ret == ZNODEEXISTS ? ZOK : ret;
+    }
+
+    /**
+     * one round of lock.c's lock_try. node is our node, kept from the
+     * last round if we had one
+     */
+    lock_status attempt(const std::string &path, std::string &node, std::string &blocker) {
+        char prefix[32];
+        std::snprintf(prefix, sizeof(prefix), "x-%016llx-", static_cast<unsigned long long>(backend_.session()));
+        detail::listing children;
+        int ret = ZOK, remade = 0;
+        // making the folder again is no round of its own, with no_retry
+        // the only round would go to it
+        auto remake = [&](int &round) {
+            if (remade++ >= folder_remakes || make_folder(path) != ZOK) return false;
+            round--;
+            return true;
+        };
+
+        for (int round = 0; round < RetryPolicy::attempts; round++) {
+            if (round) detail::pause<Clock>(RetryPolicy::delay(round - 1));
+            children.clear();
+            ret = retried([&] { return backend_.get_children(path.c_str(), &children.v); });
+            if (ret == ZNONODE && remake(round)) continue;
+            if (ret != ZOK) continue;
+            detail::standing s = detail::stand(children.v, prefix);
+            if (s.ours.empty()) {
+                std::string want = path + "/" + prefix;
+                char buf[512];
+                ret = backend_.create(want.c_str(), ZOO_EPHEMERAL | ZOO_SEQUENCE, buf, sizeof(buf));
+                if (ret == ZNONODE && remake(round)) continue;
+                // a retried create could leave a second node behind
+                if (ret != ZOK) continue;
+                node = buf;
+                children.clear();
+                ret = retried([&] { return backend_.get_children(path.c_str(), &children.v); });
+                if (ret != ZOK) continue;
+                s = detail::stand(children.v, prefix);
+                // our node is gone with our session
+                if (s.ours.empty()) return lock_status::failed;
+            } else {
+                node = path + "/" + std::string(s.ours);
+            }
+            if (!s.blocker.empty()) {
+                blocker.assign(s.blocker);
+                return lock_status::locked;
+            }
+            return s.ours == s.owner ? lock_status::acquired : lock_status::failed;
+        }
+        return lock_status::failed;
+    }
+
+    scoped_zk_lock held(std::string node) {
+        return scoped_zk_lock(&backend_, remove_node, std::move(node));
+    }
+
+    static int remove_node(void *backend, const char *node) {
+        return static_cast<Backend*>(backend)->remove(node);
+    }
+
+    /** how often one attempt makes a collected folder again, like LOCK_MAX_RETRY */
+    static constexpr int folder_remakes = 5;
+
+    Backend backend_;
+    int flags_ = 0;
+};
+
+} // namespace zoolocked
+
+#endif
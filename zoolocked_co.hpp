@@ -0,0 +1,484 @@
+/**
+ * zoo-locked for C++20 coroutines, header only
+ *
+ * async_lock_client runs the recipe of zoolocked.hpp on the async
+ * zoo_a* calls. a lock being waited for is a suspended coroutine
+ * frame and a watch on the node in front of it, no thread blocks, so
+ * a few threads can carry tens of thousands of waits
+ *
+ *   zoolocked::async_lock_client<my_executor> client(zh, executor);
+ *   zoolocked::task<void> job(...) {
+ *       auto lock = co_await client.acquire("/nightly", std::chrono::seconds(30));
+ *       if (!lock) co_return;
+ *       ...
+ *   }
+ *
+ * the executor decides where a coroutine goes on once a reply, a watch
+ * or a deadline woke it: ex.execute(std::coroutine_handle<>) has to
+ * resume the handle, on any thread but without blocking the ZooKeeper
+ * completion thread for long. inline_executor resumes right there
+ */
+
+#ifndef ZOO_LOCKED_ZOOLOCKED_CO_HPP
+#define ZOO_LOCKED_ZOOLOCKED_CO_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "zoolocked.hpp"
+
+namespace zoolocked {
+
+/** resumes on the thread that woke the coroutine */
+struct inline_executor {
+    void execute(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+/* ---------------------------------------------------------------- */
+/* tasks                                                            */
+
+/** a lazy coroutine returning T, started by co_await or spawn */
+template <class T>
+class task {
+public:
+    struct promise_type {
+        T value{};
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        // like the C code, errors are results and not exceptions
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task(const task&) = delete;
+    ~task() {
+        if (h_) h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        h_.promise().continuation = continuation;
+        return h_;
+    }
+    T await_resume() { return std::move(h_.promise().value); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class task<void> {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task(const task&) = delete;
+    ~task() {
+        if (h_) h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        h_.promise().continuation = continuation;
+        return h_;
+    }
+    void await_resume() {}
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+/** a coroutine nobody waits for, it frees itself when done */
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+/** starts t from plain code, done gets its result */
+template <class T, class F>
+detail::detached spawn(task<T> t, F done) {
+    if constexpr (std::is_void_v<T>) {
+        co_await std::move(t);
+        done();
+    } else {
+        done(co_await std::move(t));
+    }
+}
+
+namespace detail {
+
+/**
+ * one thread for all deadlines of a client, it only wakes the waits
+ * that ran out and never runs a coroutine unless the executor does
+ */
+class timer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    timer() = default;
+    timer(const timer&) = delete;
+    ~timer() {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void at(clock::time_point when, std::function<void()> fn) {
+        std::lock_guard<std::mutex> g(m_);
+        if (!thread_.joinable()) thread_ = std::thread([this] { run(); });
+        queue_.push(entry{when, next_++, std::move(fn)});
+        cv_.notify_all();
+    }
+
+private:
+    struct entry {
+        clock::time_point when;
+        std::uint64_t order;
+        std::function<void()> fn;
+        bool operator>(const entry &o) const { return when != o.when ? when > o.when : order > o.order; }
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> g(m_);
+        while (!stop_) {
+            if (queue_.empty()) {
+                cv_.wait(g);
+                continue;
+            }
+            if (clock::now() < queue_.top().when) {
+                cv_.wait_until(g, queue_.top().when);
+                continue;
+            }
+            std::function<void()> fn = std::move(const_cast<entry&>(queue_.top()).fn);
+            queue_.pop();
+            g.unlock();
+            fn();
+            g.lock();
+        }
+    }
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue_;
+    std::uint64_t next_ = 0;
+    std::thread thread_;
+    bool stop_ = false;
+};
+
+/**
+ * where a reply meets the coroutine waiting for it. the reply may come
+ * before await_suspend is done, even on the same thread, so whichever
+ * of the two comes second resumes
+ */
+struct handoff {
+    std::atomic<bool> met{false};
+    std::coroutine_handle<> h;
+
+    /** from await_suspend once the call is out, false to go on right away */
+    bool suspend() { return !met.exchange(true); }
+    /** from the reply, true if it has to resume h */
+    bool arrived() { return met.exchange(true); }
+};
+
+inline void ignored(int, const void*) {}
+
+} // namespace detail
+
+/**
+ * takes locks over the caller's zhandle_t with the async calls. any
+ * number of acquires can be pending, one per path at a time: our
+ * nodes are found by the session in their name
+ */
+template <class Executor = inline_executor, class RetryPolicy = fixed_retry<>>
+class async_lock_client {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit async_lock_client(zhandle_t *zh, Executor ex = Executor()) : zh_(zh), ex_(std::move(ex)) {}
+    async_lock_client(const async_lock_client&) = delete;
+
+    /** flags for new lock folders, 0 or zoolocked::container */
+    void folder_flags(int flags) noexcept { flags_ = flags; }
+
+    /**
+     * queues for the lock on path until it is ours or deadline passes.
+     * the guard deletes our node without waiting for the reply
+     */
+    task<scoped_zk_lock> acquire(std::string path, clock::time_point deadline) {
+        std::string node;
+        int losses = 0;
+
+        for (;;) {
+            if (clock::now() >= deadline) break;
+            listed l = co_await list_op{this, path};
+            if (l.rc == ZNONODE) {
+                if (co_await make_folder(path) != ZOK) break;
+                continue;
+            }
+            if (l.rc == ZCONNECTIONLOSS && ++losses < RetryPolicy::attempts) {
+                co_await wait_op{this, std::string(), clock::now() + RetryPolicy::delay(losses - 1)};
+                continue;
+            }
+            if (l.rc != ZOK) break;
+            if (l.ours.empty()) {
+                // our node is gone with our session
+                if (!node.empty()) break;
+                created c = co_await create_op{this, path + "/" + l.prefix, ZOO_EPHEMERAL | ZOO_SEQUENCE};
+                if (c.rc == ZNONODE) {
+                    if (co_await make_folder(path) != ZOK) break;
+                    continue;
+                }
+                // the create may have gone through, the next listing
+                // finds our node by the session. retrying the create
+                // itself could leave a second node behind
+                if (c.rc == ZCONNECTIONLOSS && ++losses < RetryPolicy::attempts) {
+                    co_await wait_op{this, std::string(), clock::now() + RetryPolicy::delay(losses - 1)};
+                    continue;
+                }
+                if (c.rc != ZOK) break;
+                node = std::move(c.path);
+                continue;
+            }
+            node = path + "/" + l.ours;
+            if (l.blocker.empty()) {
+                if (l.ours != l.owner) break;
+                co_return scoped_zk_lock(zh_, remove_async, std::move(node));
+            }
+            int woke = co_await wait_op{this, path + "/" + l.blocker, deadline};
+            if (woke != ZOK) break;
+        }
+        if (!node.empty()) remove_async(zh_, node.c_str());
+        co_return scoped_zk_lock(clock::now() >= deadline ? lock_status::timeout : lock_status::failed,
+                                 std::string());
+    }
+
+    template <class Rep, class Period>
+    task<scoped_zk_lock> acquire(std::string path, std::chrono::duration<Rep, Period> timeout) {
+        return acquire(std::move(path), clock::now() + std::chrono::duration_cast<clock::duration>(timeout));
+    }
+
+private:
+    struct listed {
+        int rc = ZOK;
+        std::string prefix, ours, owner, blocker;
+    };
+
+    struct created {
+        int rc = ZOK;
+        std::string path;
+    };
+
+    /** zoo_aget_children, reduced to where we stand while the reply lives */
+    struct list_op {
+        async_lock_client *c;
+        std::string path;
+        listed result;
+        detail::handoff meet;
+
+        list_op(async_lock_client *c, std::string path) : c(c), path(std::move(path)) {}
+
+        bool await_ready() noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            meet.h = h;
+            int ret = zoo_aget_children(c->zh_, path.c_str(), 0, done, this);
+            if (ret != ZOK) {
+                result.rc = ret;
+                return false;
+            }
+            return meet.suspend();
+        }
+        listed await_resume() { return std::move(result); }
+
+        static void done(int rc, const String_vector *children, const void *data) {
+            auto *op = static_cast<list_op*>(const_cast<void*>(data));
+            op->result.rc = rc;
+            if (rc == ZOK) {
+                // the session is known once a reply came
+                char prefix[32];
+                std::snprintf(prefix, sizeof(prefix), "x-%016llx-",
+                              static_cast<unsigned long long>(zoo_client_id(op->c->zh_)->client_id));
+                detail::standing s = detail::stand(*children, prefix);
+                op->result.prefix = prefix;
+                op->result.ours.assign(s.ours);
+                op->result.owner.assign(s.owner);
+                op->result.blocker.assign(s.blocker);
+            }
+            if (op->meet.arrived()) op->c->ex_.execute(op->meet.h);
+        }
+    };
+
+    struct create_op {
+        async_lock_client *c;
+        std::string path;
+        int flags;
+        created result;
+        detail::handoff meet;
+
+        create_op(async_lock_client *c, std::string path, int flags) : c(c), path(std::move(path)), flags(flags) {}
+
+        bool await_ready() noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            meet.h = h;
+            int ret = zoo_acreate(c->zh_, path.c_str(), nullptr, -1, &ZOO_OPEN_ACL_UNSAFE, flags, done, this);
+            if (ret != ZOK) {
+                result.rc = ret;
+                return false;
+            }
+            return meet.suspend();
+        }
+        created await_resume() { return std::move(result); }
+
+        static void done(int rc, const char *value, const void *data) {
+            auto *op = static_cast<create_op*>(const_cast<void*>(data));
+            op->result.rc = rc;
+            if (rc == ZOK && value) op->result.path = value;
+            if (op->meet.arrived()) op->c->ex_.execute(op->meet.h);
+        }
+    };
+
+    /**
+     * what a wait shares with its watch, reply and deadline, any of
+     * which may come after it ended. the first of them decides
+     */
+    struct woken {
+        std::atomic<bool> decided{false};
+        int rc = ZOK;
+        detail::handoff meet;
+        async_lock_client *c;
+
+        void wake(int why) {
+            if (decided.exchange(true)) return;
+            rc = why;
+            if (meet.arrived()) c->ex_.execute(meet.h);
+        }
+    };
+
+    /**
+     * waits until the node on path is gone, ZOK, or deadline passed,
+     * ZOPERATIONTIMEOUT. without a path it only waits for the deadline
+     */
+    struct wait_op {
+        async_lock_client *c;
+        std::string path;
+        clock::time_point deadline;
+        std::shared_ptr<woken> state = std::make_shared<woken>();
+
+        wait_op(async_lock_client *c, std::string path, clock::time_point deadline)
+            : c(c), path(std::move(path)), deadline(deadline) {}
+
+        bool await_ready() noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::shared_ptr<woken> st = state;
+            st->c = c;
+            st->meet.h = h;
+            if (deadline != clock::time_point::max()) {
+                c->timer_.at(deadline, [st] { st->wake(ZOPERATIONTIMEOUT); });
+            }
+            if (!path.empty()) {
+                auto *watch_ctx = new std::shared_ptr<woken>(st);
+                auto *reply_ctx = new reply{st, watch_ctx};
+                int ret = zoo_awget(c->zh_, path.c_str(), watcher, watch_ctx, get_done, reply_ctx);
+                if (ret != ZOK) {
+                    delete watch_ctx;
+                    delete reply_ctx;
+                    st->wake(ret);
+                }
+            }
+            return st->meet.suspend();
+        }
+        int await_resume() { return state->rc; }
+
+        static void watcher(zhandle_t *, int type, int zstate, const char *, void *ctx) {
+            auto *st = static_cast<std::shared_ptr<woken>*>(ctx);
+            // like backend_zk.c, only expiry makes a session event count
+            if (type == ZOO_SESSION_EVENT && zstate != ZOO_EXPIRED_SESSION_STATE) return;
+            (*st)->wake(type == ZOO_SESSION_EVENT ? ZSESSIONEXPIRED : ZOK);
+            if (type != ZOO_SESSION_EVENT) delete st;
+        }
+
+        /** the watch context rides along, the client keeps it only on ZOK */
+        struct reply {
+            std::shared_ptr<woken> st;
+            std::shared_ptr<woken> *watch;
+        };
+
+        static void get_done(int rc, const char *, int, const struct Stat *, const void *data) {
+            auto *r = static_cast<reply*>(const_cast<void*>(data));
+            // ZOK means the watch is set, the watcher wakes us. a get
+            // of a node that is gone already watches nothing
+            if (rc != ZOK) {
+                delete r->watch;
+                r->st->wake(rc == ZNONODE ? ZOK : rc);
+            }
+            delete r;
+        }
+    };
+
+    task<int> make_folder(std::string path) {
+        created c = co_await create_op{this, path, flags_};
+        // an older server does not know containers
+        if (flags_ && (c.rc == ZBADARGUMENTS || c.rc == ZUNIMPLEMENTED)) {
+            flags_ = 0;
+            c = co_await create_op{this, path, 0};
+        }
+        co_return c.rc == ZNODEEXISTS ? ZOK : c.rc;
+    }
+
+    /** the guard does not wait for the delete */
+    static int remove_async(void *zh, const char *node) {
+        return zoo_adelete(static_cast<zhandle_t*>(zh), node, -1, detail::ignored, nullptr);
+    }
+
+    zhandle_t *zh_;
+    Executor ex_;
+    detail::timer timer_;
+    std::atomic<int> flags_{0};
+};
+
+} // namespace zoolocked
+
+#endif